@@ -24,6 +24,8 @@
 #include <linux/ktime.h>
 #include <linux/sched.h>
 
+#include <trace/events/cpufreq_governor.h>
+
 /*
  * dbs is used in this file as a shortform for demandbased switching
  * It helps to keep variable names smaller, simpler
@@ -390,16 +392,25 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 	 * break out if we 'cannot' reduce the speed as the user might
 	 * want freq_step to be zero
 	 */
-	if (dbs_tuners_ins.freq_step == 0)
+	if (dbs_tuners_ins.freq_step == 0) {
+		trace_cpufreq_governor_decision("conservative", policy->cpu,
+						max_load, policy->cur,
+						policy->cur, "nostep");
 		return;
+	}
 
 	/* Check for frequency increase */
 	if (max_load > dbs_tuners_ins.up_threshold) {
 		this_dbs_info->down_skip = 0;
 
 		/* if we are already at full speed then break out early */
-		if (this_dbs_info->requested_freq == policy->max)
+		if (this_dbs_info->requested_freq == policy->max) {
+			trace_cpufreq_governor_decision("conservative",
+							policy->cpu, max_load,
+							policy->cur,
+							policy->max, "max");
 			return;
+		}
 
 		freq_target = (dbs_tuners_ins.freq_step * policy->max) / 100;
 
@@ -411,6 +422,10 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 		if (this_dbs_info->requested_freq > policy->max)
 			this_dbs_info->requested_freq = policy->max;
 
+		trace_cpufreq_governor_decision("conservative", policy->cpu,
+						max_load, policy->cur,
+						this_dbs_info->requested_freq,
+						"up");
 		__cpufreq_driver_target(policy, this_dbs_info->requested_freq,
 			CPUFREQ_RELATION_H);
 		return;
@@ -431,13 +446,26 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 		/*
 		 * if we cannot reduce the frequency anymore, break out early
 		 */
-		if (policy->cur == policy->min)
+		if (policy->cur == policy->min) {
+			trace_cpufreq_governor_decision("conservative",
+							policy->cpu, max_load,
+							policy->cur,
+							policy->cur, "min");
 			return;
+		}
 
+		trace_cpufreq_governor_decision("conservative", policy->cpu,
+						max_load, policy->cur,
+						this_dbs_info->requested_freq,
+						"down");
 		__cpufreq_driver_target(policy, this_dbs_info->requested_freq,
 				CPUFREQ_RELATION_H);
 		return;
 	}
+
+	trace_cpufreq_governor_decision("conservative", policy->cpu,
+					max_load, policy->cur, policy->cur,
+					"hold");
 }
 
 static void do_dbs_timer(struct work_struct *work)
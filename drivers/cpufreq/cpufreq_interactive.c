@@ -30,13 +30,65 @@
 #include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/input.h>
+#include <linux/irq_work.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
 #include <asm/cputime.h>
+#include <trace/events/cpufreq_governor.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/cpufreq_interactive.h>
 
 static atomic_t active_count = ATOMIC_INIT(0);
 
+/*
+ * Tunables of one policy, shown in its "interactive" sysfs directory so
+ * that cpus sharing a clock, and nothing else, share them.
+ */
+struct cpufreq_interactive_tunables {
+	struct kobject kobj;
+	struct cpufreq_policy *policy;
+
+	/* Hi speed to bump to from lo speed when load burst (default max) */
+	unsigned long hispeed_freq;
+
+	/* Go to hi speed when CPU load at or above this value. */
+	unsigned long go_hispeed_load;
+
+	/*
+	 * Load aimed for, by speed: the first entry applies below the
+	 * speed of the second, the third from there on, and so on.
+	 */
+	spinlock_t target_loads_lock;
+	unsigned int *target_loads;
+	int ntarget_loads;
+
+	/*
+	 * The minimum amount of time to spend at a frequency before we
+	 * can ramp down.
+	 */
+	unsigned long min_sample_time;
+
+	/* The sample rate of the timer used to increase frequency */
+	unsigned long timer_rate;
+
+	/*
+	 * Wait this long before raising speed above hispeed, by default a
+	 * single timer interval.
+	 */
+	unsigned long above_hispeed_delay_val;
+
+	/*
+	 * Take load from the scheduler instead of sampling it from a timer.
+	 * The scheduler reports whether the cpu is busy on every enqueue,
+	 * dequeue and tick; speed is re-evaluated once per sched_sample_time
+	 * (us) of reports.  The timer is then only armed to bring down the
+	 * speed of an idle cpu.
+	 */
+	int use_sched_load;
+	unsigned long sched_sample_time;
+};
+
 struct cpufreq_interactive_cpuinfo {
 	struct timer_list cpu_timer;
 	int timer_idlecancel;
@@ -47,15 +99,35 @@ struct cpufreq_interactive_cpuinfo {
 	u64 target_set_time;
 	u64 target_set_time_in_idle;
 	struct cpufreq_policy *policy;
+	struct cpufreq_interactive_tunables *tunables;
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int target_freq;
 	unsigned int floor_freq;
 	u64 floor_validate_time;
 	int governor_enabled;
+	/* serializes cpufreq_interactive_eval() from the timer and hook */
+	spinlock_t load_lock;
+
+	/* load reported by the scheduler, see use_sched_load */
+	struct update_util_data update_util;
+	int util_hooked;
+	u64 util_window_start;
+	u64 util_last_update;
+	u64 util_busy;
+	int util_busy_state;
+	struct irq_work irq_work;
 };
 
 static DEFINE_PER_CPU(struct cpufreq_interactive_cpuinfo, cpuinfo);
 
+/*
+ * Tunables by policy cpu.  They outlive the governor being stopped, as
+ * it is on every hotplug of a cpu with a policy of its own, so that the
+ * values written by userspace are not lost.
+ */
+static DEFINE_PER_CPU(struct cpufreq_interactive_tunables *,
+		      cached_tunables);
+
 /* Workqueues handle frequency scaling */
 static struct task_struct *up_task;
 static struct workqueue_struct *down_wq;
@@ -66,31 +138,13 @@ static cpumask_t down_cpumask;
 static spinlock_t down_cpumask_lock;
 static struct mutex set_speed_lock;
 
-/* Hi speed to bump to from lo speed when load burst (default max) */
-static u64 hispeed_freq;
-
-/* Go to hi speed when CPU load at or above this value. */
 #define DEFAULT_GO_HISPEED_LOAD 85
-static unsigned long go_hispeed_load;
-
-/*
- * The minimum amount of time to spend at a frequency before we can ramp down.
- */
+#define DEFAULT_TARGET_LOAD 100
+static unsigned int default_target_loads[] = {DEFAULT_TARGET_LOAD};
 #define DEFAULT_MIN_SAMPLE_TIME (80 * USEC_PER_MSEC)
-static unsigned long min_sample_time;
-
-/*
- * The sample rate of the timer used to increase frequency
- */
 #define DEFAULT_TIMER_RATE (20 * USEC_PER_MSEC)
-static unsigned long timer_rate;
-
-/*
- * Wait this long before raising speed above hispeed, by default a single
- * timer interval.
- */
 #define DEFAULT_ABOVE_HISPEED_DELAY DEFAULT_TIMER_RATE
-static unsigned long above_hispeed_delay_val;
+#define DEFAULT_SCHED_SAMPLE_TIME USEC_PER_MSEC
 
 /*
  * Boost pulse to hispeed on touchscreen input.
@@ -111,6 +165,17 @@ static struct cpufreq_interactive_inputopen inputopen;
 
 static int boost_val;
 
+/* Serializes installing and removing the scheduler hooks */
+static DEFINE_MUTEX(sched_load_mutex);
+
+/* Results of cpufreq_interactive_eval() */
+enum {
+	INTERACTIVE_NOTYET,	/* no decision, look again soon */
+	INTERACTIVE_SAME,	/* speed stays */
+	INTERACTIVE_UP,		/* cpu queued in up_cpumask */
+	INTERACTIVE_DOWN,	/* cpu queued in down_cpumask */
+};
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event);
 
@@ -124,6 +189,142 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+static unsigned int freq_to_targetload(
+	struct cpufreq_interactive_tunables *tunables, unsigned int freq)
+{
+	int i;
+	unsigned int ret;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tunables->target_loads_lock, flags);
+
+	for (i = 0; i < tunables->ntarget_loads - 1 &&
+		    freq >= tunables->target_loads[i+1]; i += 2)
+		;
+
+	ret = tunables->target_loads[i];
+	spin_unlock_irqrestore(&tunables->target_loads_lock, flags);
+	return ret;
+}
+
+/*
+ * Pick a speed for @cpu given its load in percent, measured up to @now
+ * (us), when the cpu had been idle for @now_idle us in total.  The caller
+ * holds pcpu->load_lock and passes the result to cpufreq_interactive_kick()
+ * once it is safe to wake tasks up.
+ */
+static int cpufreq_interactive_eval(struct cpufreq_interactive_cpuinfo *pcpu,
+				    int cpu, int cpu_load, u64 now,
+				    u64 now_idle)
+{
+	struct cpufreq_interactive_tunables *tunables = pcpu->tunables;
+	unsigned int target_load;
+	unsigned int new_freq;
+	unsigned int index;
+	unsigned long flags;
+
+	target_load = freq_to_targetload(tunables, pcpu->target_freq);
+
+	if (cpu_load >= tunables->go_hispeed_load || boost_val) {
+		if (pcpu->target_freq <= pcpu->policy->min) {
+			new_freq = tunables->hispeed_freq;
+		} else {
+			new_freq = pcpu->policy->max * cpu_load / target_load;
+
+			if (new_freq < tunables->hispeed_freq)
+				new_freq = tunables->hispeed_freq;
+
+			if (pcpu->target_freq == tunables->hispeed_freq &&
+			    new_freq > tunables->hispeed_freq &&
+			    now - pcpu->target_set_time
+			    < tunables->above_hispeed_delay_val) {
+				trace_cpufreq_interactive_notyet(cpu, cpu_load,
+								 pcpu->target_freq,
+								 new_freq);
+				trace_cpufreq_governor_decision("interactive",
+						cpu, cpu_load,
+						pcpu->target_freq,
+						pcpu->target_freq,
+						"hispeed_delay");
+				return INTERACTIVE_NOTYET;
+			}
+		}
+	} else {
+		new_freq = pcpu->policy->max * cpu_load / target_load;
+	}
+
+	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
+					   new_freq, CPUFREQ_RELATION_H,
+					   &index)) {
+		pr_warn_once("cpu %d: cpufreq_frequency_table_target error\n",
+			     cpu);
+		return INTERACTIVE_NOTYET;
+	}
+
+	new_freq = pcpu->freq_table[index].frequency;
+
+	/*
+	 * Do not scale below floor_freq unless we have been at or above the
+	 * floor frequency for the minimum sample time since last validated.
+	 */
+	if (new_freq < pcpu->floor_freq) {
+		if (now - pcpu->floor_validate_time
+		    < tunables->min_sample_time) {
+			trace_cpufreq_interactive_notyet(cpu, cpu_load,
+					 pcpu->target_freq, new_freq);
+			trace_cpufreq_governor_decision("interactive", cpu,
+							cpu_load,
+							pcpu->target_freq,
+							pcpu->target_freq,
+							"floor");
+			return INTERACTIVE_NOTYET;
+		}
+	}
+
+	pcpu->floor_freq = new_freq;
+	pcpu->floor_validate_time = now;
+
+	if (pcpu->target_freq == new_freq) {
+		trace_cpufreq_interactive_already(cpu, cpu_load,
+						  pcpu->target_freq, new_freq);
+		trace_cpufreq_governor_decision("interactive", cpu, cpu_load,
+						pcpu->target_freq, new_freq,
+						"hold");
+		return INTERACTIVE_SAME;
+	}
+
+	trace_cpufreq_interactive_target(cpu, cpu_load, pcpu->target_freq,
+					 new_freq);
+	trace_cpufreq_governor_decision("interactive", cpu, cpu_load,
+					pcpu->target_freq, new_freq,
+					new_freq < pcpu->target_freq ?
+					"down" : "up");
+	pcpu->target_set_time_in_idle = now_idle;
+	pcpu->target_set_time = now;
+
+	if (new_freq < pcpu->target_freq) {
+		pcpu->target_freq = new_freq;
+		spin_lock_irqsave(&down_cpumask_lock, flags);
+		cpumask_set_cpu(cpu, &down_cpumask);
+		spin_unlock_irqrestore(&down_cpumask_lock, flags);
+		return INTERACTIVE_DOWN;
+	}
+
+	pcpu->target_freq = new_freq;
+	spin_lock_irqsave(&up_cpumask_lock, flags);
+	cpumask_set_cpu(cpu, &up_cpumask);
+	spin_unlock_irqrestore(&up_cpumask_lock, flags);
+	return INTERACTIVE_UP;
+}
+
+static void cpufreq_interactive_kick(int ret)
+{
+	if (ret == INTERACTIVE_UP)
+		wake_up_process(up_task);
+	else if (ret == INTERACTIVE_DOWN)
+		queue_work(down_wq, &freq_scale_down_work);
+}
+
 static void cpufreq_interactive_timer(unsigned long data)
 {
 	unsigned int delta_idle;
@@ -135,9 +336,8 @@ static void cpufreq_interactive_timer(unsigned long data)
 	struct cpufreq_interactive_cpuinfo *pcpu =
 		&per_cpu(cpuinfo, data);
 	u64 now_idle;
-	unsigned int new_freq;
-	unsigned int index;
 	unsigned long flags;
+	int ret;
 
 	smp_rmb();
 
@@ -194,81 +394,15 @@ static void cpufreq_interactive_timer(unsigned long data)
 	if (load_since_change > cpu_load)
 		cpu_load = load_since_change;
 
-	if (cpu_load >= go_hispeed_load || boost_val) {
-		if (pcpu->target_freq <= pcpu->policy->min) {
-			new_freq = hispeed_freq;
-		} else {
-			new_freq = pcpu->policy->max * cpu_load / 100;
+	spin_lock_irqsave(&pcpu->load_lock, flags);
+	ret = cpufreq_interactive_eval(pcpu, data, cpu_load,
+				       pcpu->timer_run_time, now_idle);
+	spin_unlock_irqrestore(&pcpu->load_lock, flags);
+	cpufreq_interactive_kick(ret);
 
-			if (new_freq < hispeed_freq)
-				new_freq = hispeed_freq;
-
-			if (pcpu->target_freq == hispeed_freq &&
-			    new_freq > hispeed_freq &&
-			    pcpu->timer_run_time - pcpu->target_set_time
-			    < above_hispeed_delay_val) {
-				trace_cpufreq_interactive_notyet(data, cpu_load,
-								 pcpu->target_freq,
-								 new_freq);
-				goto rearm;
-			}
-		}
-	} else {
-		new_freq = pcpu->policy->max * cpu_load / 100;
-	}
-
-	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
-					   new_freq, CPUFREQ_RELATION_H,
-					   &index)) {
-		pr_warn_once("timer %d: cpufreq_frequency_table_target error\n",
-			     (int) data);
+	if (ret == INTERACTIVE_NOTYET)
 		goto rearm;
-	}
-
-	new_freq = pcpu->freq_table[index].frequency;
 
-	/*
-	 * Do not scale below floor_freq unless we have been at or above the
-	 * floor frequency for the minimum sample time since last validated.
-	 */
-	if (new_freq < pcpu->floor_freq) {
-		if (pcpu->timer_run_time - pcpu->floor_validate_time
-		    < min_sample_time) {
-			trace_cpufreq_interactive_notyet(data, cpu_load,
-					 pcpu->target_freq, new_freq);
-			goto rearm;
-		}
-	}
-
-	pcpu->floor_freq = new_freq;
-	pcpu->floor_validate_time = pcpu->timer_run_time;
-
-	if (pcpu->target_freq == new_freq) {
-		trace_cpufreq_interactive_already(data, cpu_load,
-						  pcpu->target_freq, new_freq);
-		goto rearm_if_notmax;
-	}
-
-	trace_cpufreq_interactive_target(data, cpu_load, pcpu->target_freq,
-					 new_freq);
-	pcpu->target_set_time_in_idle = now_idle;
-	pcpu->target_set_time = pcpu->timer_run_time;
-
-	if (new_freq < pcpu->target_freq) {
-		pcpu->target_freq = new_freq;
-		spin_lock_irqsave(&down_cpumask_lock, flags);
-		cpumask_set_cpu(data, &down_cpumask);
-		spin_unlock_irqrestore(&down_cpumask_lock, flags);
-		queue_work(down_wq, &freq_scale_down_work);
-	} else {
-		pcpu->target_freq = new_freq;
-		spin_lock_irqsave(&up_cpumask_lock, flags);
-		cpumask_set_cpu(data, &up_cpumask);
-		spin_unlock_irqrestore(&up_cpumask_lock, flags);
-		wake_up_process(up_task);
-	}
-
-rearm_if_notmax:
 	/*
 	 * Already set max speed and don't see a need to change that,
 	 * wait until next idle to re-evaluate, don't need timer.
@@ -277,6 +411,17 @@ rearm_if_notmax:
 		goto exit;
 
 rearm:
+	/*
+	 * With load coming from the scheduler the timer is only needed
+	 * while the cpu idles, see cpufreq_interactive_idle_start().
+	 */
+	if (pcpu->tunables->use_sched_load) {
+		smp_rmb();
+
+		if (!pcpu->idling)
+			goto exit;
+	}
+
 	if (!timer_pending(&pcpu->cpu_timer)) {
 		/*
 		 * If already at min: if that CPU is idle, don't set timer.
@@ -294,8 +439,8 @@ rearm:
 
 		pcpu->time_in_idle = get_cpu_idle_time_us(
 			data, &pcpu->idle_exit_time);
-		mod_timer(&pcpu->cpu_timer,
-			  jiffies + usecs_to_jiffies(timer_rate));
+		mod_timer(&pcpu->cpu_timer, jiffies +
+			  usecs_to_jiffies(pcpu->tunables->timer_rate));
 	}
 
 exit:
@@ -329,8 +474,8 @@ static void cpufreq_interactive_idle_start(void)
 			pcpu->time_in_idle = get_cpu_idle_time_us(
 				smp_processor_id(), &pcpu->idle_exit_time);
 			pcpu->timer_idlecancel = 0;
-			mod_timer(&pcpu->cpu_timer,
-				  jiffies + usecs_to_jiffies(timer_rate));
+			mod_timer(&pcpu->cpu_timer, jiffies +
+				  usecs_to_jiffies(pcpu->tunables->timer_rate));
 		}
 #endif
 	} else {
@@ -375,15 +520,102 @@ static void cpufreq_interactive_idle_end(void)
 	 */
 	if (timer_pending(&pcpu->cpu_timer) == 0 &&
 	    pcpu->timer_run_time >= pcpu->idle_exit_time &&
-	    pcpu->governor_enabled) {
+	    pcpu->governor_enabled && !pcpu->tunables->use_sched_load) {
 		pcpu->time_in_idle =
 			get_cpu_idle_time_us(smp_processor_id(),
 					     &pcpu->idle_exit_time);
 		pcpu->timer_idlecancel = 0;
-		mod_timer(&pcpu->cpu_timer,
-			  jiffies + usecs_to_jiffies(timer_rate));
+		mod_timer(&pcpu->cpu_timer, jiffies +
+			  usecs_to_jiffies(pcpu->tunables->timer_rate));
+	}
+
+}
+
+static void cpufreq_interactive_irq_work(struct irq_work *work)
+{
+	if (!cpumask_empty(&up_cpumask))
+		wake_up_process(up_task);
+	if (!cpumask_empty(&down_cpumask))
+		queue_work(down_wq, &freq_scale_down_work);
+}
+
+/*
+ * Runs from the scheduler with the runqueue lock held, so the speed
+ * change is handed to an irq_work rather than waking up_task here.
+ */
+static void cpufreq_interactive_update_util(struct update_util_data *data,
+					    u64 time, unsigned long nr_running)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu =
+		container_of(data, struct cpufreq_interactive_cpuinfo,
+			     update_util);
+	int cpu = smp_processor_id();
+	u64 window;
+	u64 now;
+	u64 now_idle;
+	int cpu_load;
+	int ret;
+
+	if (!pcpu->governor_enabled)
+		return;
+
+	if (!pcpu->util_window_start) {
+		pcpu->util_window_start = time;
+		goto out;
+	}
+
+	if (pcpu->util_busy_state)
+		pcpu->util_busy += time - pcpu->util_last_update;
+
+	window = time - pcpu->util_window_start;
+	if (window < (u64)pcpu->tunables->sched_sample_time * NSEC_PER_USEC)
+		goto out;
+
+	cpu_load = div64_u64(pcpu->util_busy * 100, window);
+	pcpu->util_window_start = time;
+	pcpu->util_busy = 0;
+
+	now = ktime_to_us(ktime_get());
+	now_idle = get_cpu_idle_time_us(cpu, &now);
+
+	spin_lock(&pcpu->load_lock);
+	ret = cpufreq_interactive_eval(pcpu, cpu, cpu_load, now, now_idle);
+	spin_unlock(&pcpu->load_lock);
+
+	if (ret == INTERACTIVE_UP || ret == INTERACTIVE_DOWN)
+		irq_work_queue(&pcpu->irq_work);
+
+out:
+	pcpu->util_last_update = time;
+	pcpu->util_busy_state = nr_running > 0;
+}
+
+/*
+ * Install or remove the scheduler hook of @cpu.  Called with
+ * sched_load_mutex held; after removing, the caller must wait for
+ * running hooks with synchronize_sched().
+ */
+static void cpufreq_interactive_hook_cpu(int cpu, int enable)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+
+	if (pcpu->util_hooked == enable)
+		return;
+
+	if (enable && !pcpu->governor_enabled)
+		return;
+
+	if (enable) {
+		pcpu->util_window_start = 0;
+		pcpu->util_busy = 0;
+		pcpu->util_busy_state = 0;
+		cpufreq_add_update_util_hook(cpu, &pcpu->update_util,
+					     cpufreq_interactive_update_util);
+	} else {
+		cpufreq_remove_update_util_hook(cpu);
 	}
 
+	pcpu->util_hooked = enable;
 }
 
 static int cpufreq_interactive_up_task(void *data)
@@ -492,12 +724,24 @@ static void cpufreq_interactive_boost(void)
 	int i;
 	int anyboost = 0;
 	unsigned long flags;
+	unsigned long hispeed_freq;
 	struct cpufreq_interactive_cpuinfo *pcpu;
 
 	spin_lock_irqsave(&up_cpumask_lock, flags);
 
 	for_each_online_cpu(i) {
 		pcpu = &per_cpu(cpuinfo, i);
+		smp_rmb();
+
+		/*
+		 * Tunables go away once the governor is disabled and
+		 * synchronize_sched() has returned, which our disabled
+		 * interrupts hold off.
+		 */
+		if (!pcpu->governor_enabled)
+			continue;
+
+		hispeed_freq = pcpu->tunables->hispeed_freq;
 
 		if (pcpu->target_freq < hispeed_freq) {
 			pcpu->target_freq = hispeed_freq;
@@ -612,117 +856,355 @@ static struct input_handler cpufreq_interactive_input_handler = {
 	.id_table       = cpufreq_interactive_ids,
 };
 
-static ssize_t show_hispeed_freq(struct kobject *kobj,
-				 struct attribute *attr, char *buf)
+/*
+ * Per-policy tunables live in a kobject of their own below the policy's,
+ * rather than in a group on the policy kobject: attributes of the latter
+ * take the policy rwsem, which is held across CPUFREQ_GOV_STOP where the
+ * directory is removed.
+ */
+struct interactive_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct cpufreq_interactive_tunables *tunables,
+			char *buf);
+	ssize_t (*store)(struct cpufreq_interactive_tunables *tunables,
+			 const char *buf, size_t count);
+};
+
+#define to_tunables(k) container_of(k, struct cpufreq_interactive_tunables, \
+				    kobj)
+#define to_interactive_attr(a) container_of(a, struct interactive_attr, attr)
+
+static ssize_t interactive_sysfs_show(struct kobject *kobj,
+				      struct attribute *attr, char *buf)
 {
-	return sprintf(buf, "%llu\n", hispeed_freq);
+	struct interactive_attr *iattr = to_interactive_attr(attr);
+
+	if (!iattr->show)
+		return -EIO;
+	return iattr->show(to_tunables(kobj), buf);
 }
 
-static ssize_t store_hispeed_freq(struct kobject *kobj,
-				  struct attribute *attr, const char *buf,
-				  size_t count)
+static ssize_t interactive_sysfs_store(struct kobject *kobj,
+				       struct attribute *attr,
+				       const char *buf, size_t count)
 {
-	int ret;
-	u64 val;
+	struct interactive_attr *iattr = to_interactive_attr(attr);
 
-	ret = strict_strtoull(buf, 0, &val);
-	if (ret < 0)
-		return ret;
-	hispeed_freq = val;
-	return count;
+	if (!iattr->store)
+		return -EIO;
+	return iattr->store(to_tunables(kobj), buf, count);
 }
 
-static struct global_attr hispeed_freq_attr = __ATTR(hispeed_freq, 0644,
-		show_hispeed_freq, store_hispeed_freq);
+static const struct sysfs_ops interactive_sysfs_ops = {
+	.show	= interactive_sysfs_show,
+	.store	= interactive_sysfs_store,
+};
 
+#define show_one(file_name)						\
+static ssize_t show_##file_name(					\
+	struct cpufreq_interactive_tunables *tunables, char *buf)	\
+{									\
+	return sprintf(buf, "%lu\n", tunables->file_name);		\
+}
+
+#define store_one(file_name)						\
+static ssize_t store_##file_name(					\
+	struct cpufreq_interactive_tunables *tunables,			\
+	const char *buf, size_t count)					\
+{									\
+	int ret;							\
+	unsigned long val;						\
+									\
+	ret = kstrtoul(buf, 0, &val);					\
+	if (ret < 0)							\
+		return ret;						\
+	tunables->file_name = val;					\
+	return count;							\
+}
+
+#define interactive_attr_rw(_name)					\
+static struct interactive_attr _name##_attr =				\
+	__ATTR(_name, 0644, show_##_name, store_##_name)
+
+show_one(hispeed_freq);
+store_one(hispeed_freq);
+interactive_attr_rw(hispeed_freq);
 
-static ssize_t show_go_hispeed_load(struct kobject *kobj,
-				     struct attribute *attr, char *buf)
+show_one(go_hispeed_load);
+store_one(go_hispeed_load);
+interactive_attr_rw(go_hispeed_load);
+
+show_one(min_sample_time);
+store_one(min_sample_time);
+interactive_attr_rw(min_sample_time);
+
+static ssize_t show_above_hispeed_delay(
+	struct cpufreq_interactive_tunables *tunables, char *buf)
 {
-	return sprintf(buf, "%lu\n", go_hispeed_load);
+	return sprintf(buf, "%lu\n", tunables->above_hispeed_delay_val);
 }
 
-static ssize_t store_go_hispeed_load(struct kobject *kobj,
-			struct attribute *attr, const char *buf, size_t count)
+static ssize_t store_above_hispeed_delay(
+	struct cpufreq_interactive_tunables *tunables,
+	const char *buf, size_t count)
 {
 	int ret;
 	unsigned long val;
 
-	ret = strict_strtoul(buf, 0, &val);
+	ret = kstrtoul(buf, 0, &val);
 	if (ret < 0)
 		return ret;
-	go_hispeed_load = val;
+	tunables->above_hispeed_delay_val = val;
 	return count;
 }
 
-static struct global_attr go_hispeed_load_attr = __ATTR(go_hispeed_load, 0644,
-		show_go_hispeed_load, store_go_hispeed_load);
+interactive_attr_rw(above_hispeed_delay);
+
+show_one(timer_rate);
+store_one(timer_rate);
+interactive_attr_rw(timer_rate);
+
+/*
+ * Parse "load [freq:load ...]" into an array of numbers, which must come
+ * in with speeds ascending.
+ */
+static unsigned int *get_target_loads(const char *buf, int *num_tokens)
+{
+	const char *cp;
+	int i;
+	int ntokens = 1;
+	unsigned int *target_loads;
+	int err = -EINVAL;
+
+	cp = buf;
+	while ((cp = strpbrk(cp + 1, " :")))
+		ntokens++;
+
+	if (!(ntokens & 0x1))
+		goto err;
+
+	target_loads = kmalloc(ntokens * sizeof(unsigned int), GFP_KERNEL);
+	if (!target_loads) {
+		err = -ENOMEM;
+		goto err;
+	}
+
+	cp = buf;
+	i = 0;
+	while (i < ntokens) {
+		if (sscanf(cp, "%u", &target_loads[i++]) != 1)
+			goto err_kfree;
+
+		cp = strpbrk(cp, " :");
+		if (!cp)
+			break;
+		cp++;
+	}
+
+	if (i != ntokens)
+		goto err_kfree;
+
+	for (i = 0; i < ntokens; i += 2)
+		if (!target_loads[i] ||
+		    (i >= 4 && target_loads[i - 1] <= target_loads[i - 3]))
+			goto err_kfree;
+
+	*num_tokens = ntokens;
+	return target_loads;
+
+err_kfree:
+	kfree(target_loads);
+err:
+	return ERR_PTR(err);
+}
 
-static ssize_t show_min_sample_time(struct kobject *kobj,
-				struct attribute *attr, char *buf)
+static ssize_t show_target_loads(
+	struct cpufreq_interactive_tunables *tunables, char *buf)
 {
-	return sprintf(buf, "%lu\n", min_sample_time);
+	int i;
+	ssize_t ret = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tunables->target_loads_lock, flags);
+
+	for (i = 0; i < tunables->ntarget_loads; i++)
+		ret += sprintf(buf + ret, "%u%s", tunables->target_loads[i],
+			       i & 0x1 ? ":" : " ");
+
+	sprintf(buf + ret - 1, "\n");
+	spin_unlock_irqrestore(&tunables->target_loads_lock, flags);
+	return ret;
 }
 
-static ssize_t store_min_sample_time(struct kobject *kobj,
-			struct attribute *attr, const char *buf, size_t count)
+static ssize_t store_target_loads(
+	struct cpufreq_interactive_tunables *tunables,
+	const char *buf, size_t count)
 {
-	int ret;
-	unsigned long val;
+	int ntokens;
+	unsigned int *new_target_loads;
+	unsigned int *old_target_loads;
+	unsigned long flags;
 
-	ret = strict_strtoul(buf, 0, &val);
-	if (ret < 0)
-		return ret;
-	min_sample_time = val;
+	new_target_loads = get_target_loads(buf, &ntokens);
+	if (IS_ERR(new_target_loads))
+		return PTR_ERR(new_target_loads);
+
+	spin_lock_irqsave(&tunables->target_loads_lock, flags);
+	old_target_loads = tunables->target_loads;
+	tunables->target_loads = new_target_loads;
+	tunables->ntarget_loads = ntokens;
+	spin_unlock_irqrestore(&tunables->target_loads_lock, flags);
+
+	if (old_target_loads != default_target_loads)
+		kfree(old_target_loads);
 	return count;
 }
 
-static struct global_attr min_sample_time_attr = __ATTR(min_sample_time, 0644,
-		show_min_sample_time, store_min_sample_time);
+interactive_attr_rw(target_loads);
 
-static ssize_t show_above_hispeed_delay(struct kobject *kobj,
-					struct attribute *attr, char *buf)
+static ssize_t show_use_sched_load(
+	struct cpufreq_interactive_tunables *tunables, char *buf)
 {
-	return sprintf(buf, "%lu\n", above_hispeed_delay_val);
+	return sprintf(buf, "%d\n", tunables->use_sched_load);
 }
 
-static ssize_t store_above_hispeed_delay(struct kobject *kobj,
-					 struct attribute *attr,
-					 const char *buf, size_t count)
+static ssize_t store_use_sched_load(
+	struct cpufreq_interactive_tunables *tunables,
+	const char *buf, size_t count)
 {
 	int ret;
 	unsigned long val;
+	unsigned int cpu;
 
-	ret = strict_strtoul(buf, 0, &val);
+	ret = kstrtoul(buf, 0, &val);
 	if (ret < 0)
 		return ret;
-	above_hispeed_delay_val = val;
+
+	mutex_lock(&sched_load_mutex);
+	if (tunables->use_sched_load != !!val) {
+		tunables->use_sched_load = !!val;
+		for_each_cpu(cpu, tunables->policy->cpus)
+			cpufreq_interactive_hook_cpu(cpu,
+						     tunables->use_sched_load);
+		if (!tunables->use_sched_load)
+			synchronize_sched();
+	}
+	mutex_unlock(&sched_load_mutex);
 	return count;
 }
 
-define_one_global_rw(above_hispeed_delay);
+interactive_attr_rw(use_sched_load);
 
-static ssize_t show_timer_rate(struct kobject *kobj,
-			struct attribute *attr, char *buf)
+static ssize_t show_sched_sample_time(
+	struct cpufreq_interactive_tunables *tunables, char *buf)
 {
-	return sprintf(buf, "%lu\n", timer_rate);
+	return sprintf(buf, "%lu\n", tunables->sched_sample_time);
 }
 
-static ssize_t store_timer_rate(struct kobject *kobj,
-			struct attribute *attr, const char *buf, size_t count)
+static ssize_t store_sched_sample_time(
+	struct cpufreq_interactive_tunables *tunables,
+	const char *buf, size_t count)
 {
 	int ret;
 	unsigned long val;
 
-	ret = strict_strtoul(buf, 0, &val);
+	ret = kstrtoul(buf, 0, &val);
 	if (ret < 0)
 		return ret;
-	timer_rate = val;
+	if (!val)
+		return -EINVAL;
+	tunables->sched_sample_time = val;
 	return count;
 }
 
-static struct global_attr timer_rate_attr = __ATTR(timer_rate, 0644,
-		show_timer_rate, store_timer_rate);
+interactive_attr_rw(sched_sample_time);
+
+static struct attribute *interactive_policy_attributes[] = {
+	&hispeed_freq_attr.attr,
+	&go_hispeed_load_attr.attr,
+	&target_loads_attr.attr,
+	&above_hispeed_delay_attr.attr,
+	&min_sample_time_attr.attr,
+	&timer_rate_attr.attr,
+	&use_sched_load_attr.attr,
+	&sched_sample_time_attr.attr,
+	NULL,
+};
+
+static void cpufreq_interactive_tunables_release(struct kobject *kobj)
+{
+	struct cpufreq_interactive_tunables *tunables = to_tunables(kobj);
+
+	if (tunables->target_loads != default_target_loads)
+		kfree(tunables->target_loads);
+	kfree(tunables);
+}
+
+static struct kobj_type interactive_ktype = {
+	.sysfs_ops	= &interactive_sysfs_ops,
+	.default_attrs	= interactive_policy_attributes,
+	.release	= cpufreq_interactive_tunables_release,
+};
+
+static struct cpufreq_interactive_tunables *cpufreq_interactive_tunables_alloc(
+	struct cpufreq_policy *policy)
+{
+	struct cpufreq_interactive_tunables *tunables;
+
+	tunables = kzalloc(sizeof(*tunables), GFP_KERNEL);
+	if (!tunables)
+		return NULL;
+
+	tunables->hispeed_freq = policy->max;
+	tunables->go_hispeed_load = DEFAULT_GO_HISPEED_LOAD;
+	spin_lock_init(&tunables->target_loads_lock);
+	tunables->target_loads = default_target_loads;
+	tunables->ntarget_loads = ARRAY_SIZE(default_target_loads);
+	tunables->min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
+	tunables->timer_rate = DEFAULT_TIMER_RATE;
+	tunables->above_hispeed_delay_val = DEFAULT_ABOVE_HISPEED_DELAY;
+	tunables->sched_sample_time = DEFAULT_SCHED_SAMPLE_TIME;
+	kobject_init(&tunables->kobj, &interactive_ktype);
+	return tunables;
+}
+
+/*
+ * Attach the tunables of the policy to it, allocating them the first
+ * time the governor is started on it.
+ */
+static struct cpufreq_interactive_tunables *cpufreq_interactive_tunables_get(
+	struct cpufreq_policy *policy)
+{
+	struct cpufreq_interactive_tunables *tunables;
+	int rc;
+
+	tunables = per_cpu(cached_tunables, policy->cpu);
+	if (!tunables) {
+		tunables = cpufreq_interactive_tunables_alloc(policy);
+		if (!tunables)
+			return ERR_PTR(-ENOMEM);
+		per_cpu(cached_tunables, policy->cpu) = tunables;
+	}
+
+	/* the policy may have been freed and allocated again */
+	tunables->policy = policy;
+	rc = kobject_add(&tunables->kobj, &policy->kobj, "interactive");
+	if (rc)
+		return ERR_PTR(rc);
+
+	kobject_uevent(&tunables->kobj, KOBJ_ADD);
+	return tunables;
+}
+
+/*
+ * Detach the tunables from the policy, waiting for sysfs accesses in
+ * progress.  They are kept for the next start.
+ */
+static void cpufreq_interactive_tunables_put(
+	struct cpufreq_interactive_tunables *tunables)
+{
+	kobject_del(&tunables->kobj);
+}
 
 static ssize_t show_input_boost(struct kobject *kobj, struct attribute *attr,
 				char *buf)
@@ -794,11 +1276,6 @@ static struct global_attr boostpulse =
 	__ATTR(boostpulse, 0200, NULL, store_boostpulse);
 
 static struct attribute *interactive_attributes[] = {
-	&hispeed_freq_attr.attr,
-	&go_hispeed_load_attr.attr,
-	&above_hispeed_delay.attr,
-	&min_sample_time_attr.attr,
-	&timer_rate_attr.attr,
 	&input_boost.attr,
 	&boost.attr,
 	&boostpulse.attr,
@@ -817,18 +1294,24 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 	unsigned int j;
 	struct cpufreq_interactive_cpuinfo *pcpu;
 	struct cpufreq_frequency_table *freq_table;
+	struct cpufreq_interactive_tunables *tunables;
 
 	switch (event) {
 	case CPUFREQ_GOV_START:
 		if (!cpu_online(policy->cpu))
 			return -EINVAL;
 
+		tunables = cpufreq_interactive_tunables_get(policy);
+		if (IS_ERR(tunables))
+			return PTR_ERR(tunables);
+
 		freq_table =
 			cpufreq_frequency_get_table(policy->cpu);
 
 		for_each_cpu(j, policy->cpus) {
 			pcpu = &per_cpu(cpuinfo, j);
 			pcpu->policy = policy;
+			pcpu->tunables = tunables;
 			pcpu->target_freq = policy->cur;
 			pcpu->freq_table = freq_table;
 			pcpu->target_set_time_in_idle =
@@ -841,8 +1324,12 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 			smp_wmb();
 		}
 
-		if (!hispeed_freq)
-			hispeed_freq = policy->max;
+		/* kept across a stop, the tunable may already be set */
+		mutex_lock(&sched_load_mutex);
+		for_each_cpu(j, policy->cpus)
+			cpufreq_interactive_hook_cpu(j,
+						     tunables->use_sched_load);
+		mutex_unlock(&sched_load_mutex);
 
 		/*
 		 * Do not register the idle hook and create sysfs
@@ -864,10 +1351,27 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		break;
 
 	case CPUFREQ_GOV_STOP:
+		/* no more stores to use_sched_load hooking the cpus again */
+		cpufreq_interactive_tunables_put(
+			per_cpu(cpuinfo, policy->cpu).tunables);
+
 		for_each_cpu(j, policy->cpus) {
 			pcpu = &per_cpu(cpuinfo, j);
 			pcpu->governor_enabled = 0;
 			smp_wmb();
+		}
+
+		mutex_lock(&sched_load_mutex);
+		for_each_cpu(j, policy->cpus)
+			cpufreq_interactive_hook_cpu(j, 0);
+		mutex_unlock(&sched_load_mutex);
+
+		/* wait for the hooks, idle notifiers and boosts in flight */
+		synchronize_sched();
+
+		for_each_cpu(j, policy->cpus) {
+			pcpu = &per_cpu(cpuinfo, j);
+			irq_work_sync(&pcpu->irq_work);
 			del_timer_sync(&pcpu->cpu_timer);
 
 			/*
@@ -880,6 +1384,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		}
 
 		flush_work(&freq_scale_down_work);
+
 		if (atomic_dec_return(&active_count) > 0)
 			return 0;
 
@@ -927,17 +1432,14 @@ static int __init cpufreq_interactive_init(void)
 	struct cpufreq_interactive_cpuinfo *pcpu;
 	struct sched_param param = { .sched_priority = MAX_RT_PRIO-1 };
 
-	go_hispeed_load = DEFAULT_GO_HISPEED_LOAD;
-	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
-	above_hispeed_delay_val = DEFAULT_ABOVE_HISPEED_DELAY;
-	timer_rate = DEFAULT_TIMER_RATE;
-
 	/* Initalize per-cpu timers */
 	for_each_possible_cpu(i) {
 		pcpu = &per_cpu(cpuinfo, i);
 		init_timer(&pcpu->cpu_timer);
 		pcpu->cpu_timer.function = cpufreq_interactive_timer;
 		pcpu->cpu_timer.data = i;
+		spin_lock_init(&pcpu->load_lock);
+		init_irq_work(&pcpu->irq_work, cpufreq_interactive_irq_work);
 	}
 
 	up_task = kthread_create(cpufreq_interactive_up_task, NULL,
@@ -979,7 +1481,12 @@ module_init(cpufreq_interactive_init);
 
 static void __exit cpufreq_interactive_exit(void)
 {
+	unsigned int cpu;
+
 	cpufreq_unregister_governor(&cpufreq_gov_interactive);
+	for_each_possible_cpu(cpu)
+		if (per_cpu(cached_tunables, cpu))
+			kobject_put(&per_cpu(cached_tunables, cpu)->kobj);
 	kthread_stop(up_task);
 	put_task_struct(up_task);
 	destroy_workqueue(down_wq);
@@ -23,6 +23,8 @@
 #include <linux/ktime.h>
 #include <linux/sched.h>
 
+#include <trace/events/cpufreq_governor.h>
+
 /*
  * dbs is used in this file as a shortform for demandbased switching
  * It helps to keep variable names smaller, simpler
@@ -556,14 +558,23 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 		if (policy->cur < policy->max)
 			this_dbs_info->rate_mult =
 				dbs_tuners_ins.sampling_down_factor;
+		trace_cpufreq_governor_decision("ondemand", policy->cpu,
+						max_load_freq / policy->cur,
+						policy->cur, policy->max,
+						"up");
 		dbs_freq_increase(policy, policy->max);
 		return;
 	}
 
 	/* Check for frequency decrease */
 	/* if we cannot reduce the frequency anymore, break out early */
-	if (policy->cur == policy->min)
+	if (policy->cur == policy->min) {
+		trace_cpufreq_governor_decision("ondemand", policy->cpu,
+						max_load_freq / policy->cur,
+						policy->cur, policy->cur,
+						"min");
 		return;
+	}
 
 	/*
 	 * The optimal frequency is the frequency that is the lowest that
@@ -584,6 +595,11 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 		if (freq_next < policy->min)
 			freq_next = policy->min;
 
+		trace_cpufreq_governor_decision("ondemand", policy->cpu,
+						max_load_freq / policy->cur,
+						policy->cur, freq_next,
+						"down");
+
 		if (!dbs_tuners_ins.powersave_bias) {
 			__cpufreq_driver_target(policy, freq_next,
 					CPUFREQ_RELATION_L);
@@ -593,7 +609,12 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 			__cpufreq_driver_target(policy, freq,
 				CPUFREQ_RELATION_L);
 		}
+		return;
 	}
+
+	trace_cpufreq_governor_decision("ondemand", policy->cpu,
+					max_load_freq / policy->cur,
+					policy->cur, policy->cur, "hold");
 }
 
 static void do_dbs_timer(struct work_struct *work)
@@ -15,6 +15,7 @@
  */
 
 #include <linux/device.h>
+#include <linux/dma-mapping.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/anon_inodes.h>
@@ -25,6 +26,7 @@
 #include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/rbtree.h>
+#include <linux/scatterlist.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/seq_file.h>
@@ -76,6 +78,7 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 
 	buffer->heap = heap;
 	kref_init(&buffer->ref);
+	INIT_LIST_HEAD(&buffer->vmas);
 
 	ret = heap->ops->allocate(heap, buffer, len, align, flags);
 	if (ret) {
@@ -90,16 +93,26 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	return buffer;
 }
 
-static void ion_buffer_destroy(struct kref *kref)
+void ion_buffer_destroy(struct ion_buffer *buffer)
+{
+	buffer->heap->ops->free(buffer);
+	kfree(buffer);
+}
+
+static void _ion_buffer_destroy(struct kref *kref)
 {
 	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
+	struct ion_heap *heap = buffer->heap;
 	struct ion_device *dev = buffer->dev;
 
-	buffer->heap->ops->free(buffer);
 	mutex_lock(&dev->lock);
 	rb_erase(&buffer->node, &dev->buffers);
 	mutex_unlock(&dev->lock);
-	kfree(buffer);
+
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_freelist_add(heap, buffer);
+	else
+		ion_buffer_destroy(buffer);
 }
 
 static void ion_buffer_get(struct ion_buffer *buffer)
@@ -109,7 +122,7 @@ static void ion_buffer_get(struct ion_buffer *buffer)
 
 static int ion_buffer_put(struct ion_buffer *buffer)
 {
-	return kref_put(&buffer->ref, ion_buffer_destroy);
+	return kref_put(&buffer->ref, _ion_buffer_destroy);
 }
 
 static struct ion_handle *ion_handle_create(struct ion_client *client,
@@ -235,6 +248,10 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 		if (!((1 << heap->id) & flags))
 			continue;
 		buffer = ion_buffer_create(heap, dev, len, align, flags);
+		/* memory may only be waiting for the free thread */
+		if (IS_ERR(buffer) && (heap->flags & ION_HEAP_FLAG_DEFER_FREE) &&
+		    ion_heap_freelist_drain(heap, 0))
+			buffer = ion_buffer_create(heap, dev, len, align, flags);
 		if (!IS_ERR_OR_NULL(buffer))
 			break;
 	}
@@ -775,12 +792,134 @@ static struct vm_operations_struct ion_vm_ops = {
 	.close = ion_vma_close,
 };
 
+/*
+ * Cacheable mappings of heaps that can look up their pages one at a time
+ * start out empty.  Each page is mapped when it is first touched and
+ * marked in the mapping's dirty bitmap, so cache maintenance can skip the
+ * pages the cpu never accessed.  Maintenance unmaps the pages it covered
+ * from the caller's own mappings again; mappings of other processes keep
+ * their bits, so their pages keep being maintained until they sync too.
+ */
+struct ion_vma_list {
+	struct list_head list;
+	struct vm_area_struct *vma;
+	/* pages of the buffer, not of the vma, mapped since last synced */
+	unsigned long dirty[0];
+};
+
+static struct ion_vma_list *ion_vma_list_alloc(struct ion_buffer *buffer,
+					       struct vm_area_struct *vma)
+{
+	unsigned long nr_pages = PAGE_ALIGN(buffer->size) >> PAGE_SHIFT;
+	struct ion_vma_list *vma_list;
+
+	vma_list = kzalloc(sizeof(struct ion_vma_list) +
+			   BITS_TO_LONGS(nr_pages) * sizeof(unsigned long),
+			   GFP_KERNEL);
+	if (vma_list)
+		vma_list->vma = vma;
+	return vma_list;
+}
+
+/* must be called with buffer->lock held */
+static struct ion_vma_list *ion_vma_list_find(struct ion_buffer *buffer,
+					      struct vm_area_struct *vma)
+{
+	struct ion_vma_list *vma_list;
+
+	list_for_each_entry(vma_list, &buffer->vmas, list)
+		if (vma_list->vma == vma)
+			return vma_list;
+	return NULL;
+}
+
+static void ion_vm_fault_open(struct vm_area_struct *vma)
+{
+	struct ion_buffer *buffer = vma->vm_file->private_data;
+	unsigned long nr_pages = PAGE_ALIGN(buffer->size) >> PAGE_SHIFT;
+	struct ion_vma_list *vma_list;
+
+	/*
+	 * A split or fork: the new vma may already have pages mapped, so
+	 * all of them count as dirty.  If it cannot be tracked, every page
+	 * of the buffer does from now on.
+	 */
+	vma_list = ion_vma_list_alloc(buffer, vma);
+	mutex_lock(&buffer->lock);
+	if (vma_list) {
+		bitmap_fill(vma_list->dirty, nr_pages);
+		list_add(&vma_list->list, &buffer->vmas);
+	} else {
+		buffer->vmas_untracked = true;
+	}
+	mutex_unlock(&buffer->lock);
+	ion_vma_open(vma);
+}
+
+static void ion_vm_fault_close(struct vm_area_struct *vma)
+{
+	struct ion_buffer *buffer = vma->vm_file->private_data;
+	struct ion_vma_list *vma_list;
+
+	mutex_lock(&buffer->lock);
+	vma_list = ion_vma_list_find(buffer, vma);
+	if (vma_list) {
+		list_del(&vma_list->list);
+		kfree(vma_list);
+	}
+	mutex_unlock(&buffer->lock);
+	ion_vma_close(vma);
+}
+
+static int ion_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct ion_buffer *buffer = vma->vm_file->private_data;
+	struct ion_vma_list *vma_list;
+	unsigned long pfn;
+	int ret;
+
+	if (vmf->pgoff >= PAGE_ALIGN(buffer->size) >> PAGE_SHIFT)
+		return VM_FAULT_SIGBUS;
+
+	mutex_lock(&buffer->lock);
+	vma_list = ion_vma_list_find(buffer, vma);
+	if (vma_list)
+		set_bit(vmf->pgoff, vma_list->dirty);
+	pfn = buffer->heap->ops->pfn(buffer->heap, buffer, vmf->pgoff);
+	ret = vm_insert_pfn(vma, (unsigned long)vmf->virtual_address, pfn);
+	mutex_unlock(&buffer->lock);
+
+	/* -EBUSY: another thread faulted it in first */
+	if (ret && ret != -EBUSY)
+		return VM_FAULT_SIGBUS;
+	return VM_FAULT_NOPAGE;
+}
+
+static struct vm_operations_struct ion_vm_fault_ops = {
+	.open = ion_vm_fault_open,
+	.close = ion_vm_fault_close,
+	.fault = ion_vm_fault,
+};
+
+/*
+ * Faulted in mappings are maintained through the buffer's struct pages,
+ * so heaps whose memory has none keep mapping it all up front.
+ */
+static bool ion_buffer_fault_user_mappings(struct ion_buffer *buffer)
+{
+	struct ion_heap *heap = buffer->heap;
+
+	return buffer->cached && heap->ops->pfn &&
+		pfn_valid(heap->ops->pfn(heap, buffer, 0));
+}
+
 static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct ion_buffer *buffer = file->private_data;
 	unsigned long size = vma->vm_end - vma->vm_start;
 	struct ion_client *client;
 	struct ion_handle *handle;
+	struct ion_vma_list *vma_list;
 	int ret;
 
 	pr_debug("%s: %d\n", __func__, __LINE__);
@@ -816,17 +955,36 @@ static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 		goto err1;
 	}
 
-	mutex_lock(&buffer->lock);
-	/* now map it to userspace */
-	ret = buffer->heap->ops->map_user(buffer->heap, buffer, vma);
-	mutex_unlock(&buffer->lock);
-	if (ret) {
-		pr_err("%s: failure mapping buffer to userspace\n",
-		       __func__);
-		goto err1;
+	/*
+	 * vm_insert_pfn() can't be used in a COW mapping, so private
+	 * mappings are set up in full by the heap.
+	 */
+	if ((vma->vm_flags & VM_SHARED) &&
+	    ion_buffer_fault_user_mappings(buffer)) {
+		/* mapped page by page in ion_vm_fault */
+		vma_list = ion_vma_list_alloc(buffer, vma);
+		if (!vma_list) {
+			ret = -ENOMEM;
+			goto err1;
+		}
+		vma->vm_flags |= VM_IO | VM_RESERVED | VM_PFNMAP;
+		vma->vm_ops = &ion_vm_fault_ops;
+		mutex_lock(&buffer->lock);
+		list_add(&vma_list->list, &buffer->vmas);
+		mutex_unlock(&buffer->lock);
+	} else {
+		mutex_lock(&buffer->lock);
+		/* now map it to userspace */
+		ret = buffer->heap->ops->map_user(buffer->heap, buffer, vma);
+		mutex_unlock(&buffer->lock);
+		if (ret) {
+			pr_err("%s: failure mapping buffer to userspace\n",
+			       __func__);
+			goto err1;
+		}
+		vma->vm_ops = &ion_vm_ops;
 	}
 
-	vma->vm_ops = &ion_vm_ops;
 	/* move the handle into the vm_private_data so we can access it from
 	   vma_open/close */
 	vma->vm_private_data = handle;
@@ -846,24 +1004,131 @@ err:
 	return ret;
 }
 
-static int ion_flush_cached(struct ion_handle *handle, size_t size,
-			   unsigned long vaddr)
+/* must be called with buffer->lock held */
+static bool ion_buffer_page_dirty(struct ion_buffer *buffer,
+				  unsigned long pgoff)
 {
-	struct ion_buffer *buffer;
-	int ret = -EINVAL;
+	struct ion_vma_list *vma_list;
 
-	if (!handle->buffer->heap->ops->flush_user) {
-		pr_err("%s: this heap does not define a method for flushing\n",
-				__func__);
-		return ret;
+	if (buffer->vmas_untracked)
+		return true;
+	list_for_each_entry(vma_list, &buffer->vmas, list) {
+		struct vm_area_struct *vma = vma_list->vma;
+
+		if (pgoff >= vma->vm_pgoff &&
+		    pgoff < vma->vm_pgoff + vma_pages(vma) &&
+		    test_bit(pgoff, vma_list->dirty))
+			return true;
 	}
+	return false;
+}
 
-	buffer = handle->buffer;
+static void ion_buffer_sync_page(struct ion_buffer *buffer,
+				 unsigned long pgoff, enum cache_operation op)
+{
+	struct ion_heap *heap = buffer->heap;
+	struct scatterlist sg;
+
+	sg_init_table(&sg, 1);
+	sg_set_page(&sg, pfn_to_page(heap->ops->pfn(heap, buffer, pgoff)),
+		    PAGE_SIZE, 0);
+	if (op == CACHE_INVALIDATE)
+		dma_sync_sg_for_cpu(NULL, &sg, 1, DMA_FROM_DEVICE);
+	else
+		dma_sync_sg_for_device(NULL, &sg, 1, DMA_BIDIRECTIONAL);
+}
 
+/*
+ * Do cache maintenance on the part of the buffer the caller mapped at
+ * [vaddr, vaddr + size), if that is a faulted in mapping.  Only pages
+ * touched through any mapping since their last maintenance are covered,
+ * through their struct pages rather than through the caller's mapping.
+ * They are then unmapped from the caller's mappings, so the next access
+ * marks them again.  Returns -ENOENT if vaddr is not in a faulted in
+ * mapping of the buffer.
+ *
+ * Must be called with current->mm->mmap_sem held for read, which keeps
+ * the caller's mappings from going away while they are unmapped, and with
+ * buffer->lock held.
+ */
+static int ion_buffer_sync_pages(struct ion_buffer *buffer, size_t size,
+				 unsigned long vaddr, enum cache_operation op)
+{
+	struct vm_area_struct *vma;
+	struct ion_vma_list *vma_list;
+	unsigned long pgoff, first, last;
+
+	vma = find_vma(current->mm, vaddr);
+	if (!vma || vaddr < vma->vm_start ||
+	    vma->vm_ops != &ion_vm_fault_ops ||
+	    vma->vm_file->private_data != buffer)
+		return -ENOENT;
+
+	/* pages of the buffer, and of the part of it the caller mapped */
+	first = vma->vm_pgoff + ((vaddr - vma->vm_start) >> PAGE_SHIFT);
+	last = vma->vm_pgoff + ((min(PAGE_ALIGN(vaddr + size), vma->vm_end) -
+				 vma->vm_start) >> PAGE_SHIFT);
+
+	for (pgoff = first; pgoff < last; pgoff++)
+		if (ion_buffer_page_dirty(buffer, pgoff))
+			ion_buffer_sync_page(buffer, pgoff, op);
+
+	list_for_each_entry(vma_list, &buffer->vmas, list) {
+		struct vm_area_struct *v = vma_list->vma;
+		unsigned long s = max(first, v->vm_pgoff);
+		unsigned long e = min(last, v->vm_pgoff + vma_pages(v));
+
+		if (v->vm_mm != current->mm || s >= e)
+			continue;
+		bitmap_clear(vma_list->dirty, s, e - s);
+		zap_vma_ptes(v, v->vm_start + ((s - v->vm_pgoff) << PAGE_SHIFT),
+			     (e - s) << PAGE_SHIFT);
+	}
+
+	return 0;
+}
+
+/*
+ * Faulted in mappings are maintained by ion itself, anything else by the
+ * heap's op on the caller's mapping.  That touches user memory, so it
+ * runs without buffer->lock or mmap_sem held.
+ */
+static int ion_buffer_sync_user(struct ion_buffer *buffer, size_t size,
+				unsigned long vaddr, enum cache_operation op)
+{
+	struct mm_struct *mm = current->mm;
+	int (*heap_op)(struct ion_buffer *buffer, unsigned long offset,
+		       size_t len, unsigned long vaddr);
+	int ret;
+
+	down_read(&mm->mmap_sem);
 	mutex_lock(&buffer->lock);
-	/* now flush buffer mapped to userspace */
-	ret = buffer->heap->ops->flush_user(buffer, size, vaddr);
+	ret = ion_buffer_sync_pages(buffer, size, vaddr, op);
 	mutex_unlock(&buffer->lock);
+	up_read(&mm->mmap_sem);
+	if (ret != -ENOENT)
+		return ret;
+
+	if (op == CACHE_INVALIDATE)
+		heap_op = buffer->heap->ops->inval_user;
+	else
+		heap_op = buffer->heap->ops->flush_user;
+	if (!heap_op) {
+		pr_err("%s: this heap does not define a method for %s\n",
+		       __func__, op == CACHE_INVALIDATE ? "invalidating" :
+		       "flushing");
+		return -EINVAL;
+	}
+	return heap_op(buffer, 0, size, vaddr);
+}
+
+static int ion_flush_cached(struct ion_handle *handle, size_t size,
+			   unsigned long vaddr)
+{
+	int ret;
+
+	/* now flush buffer mapped to userspace */
+	ret = ion_buffer_sync_user(handle->buffer, size, vaddr, CACHE_FLUSH);
 	if (ret)
 		pr_err("%s: failure flushing buffer\n",
 		       __func__);
@@ -874,21 +1139,11 @@ static int ion_flush_cached(struct ion_handle *handle, size_t size,
 static int ion_inval_cached(struct ion_handle *handle, size_t size,
 			   unsigned long vaddr)
 {
-	struct ion_buffer *buffer;
-	int ret = -EINVAL;
-
-	if (!handle->buffer->heap->ops->inval_user) {
-		pr_err("%s: this heap does not define a method for invalidating"
-				"\n", __func__);
-		return ret;
-	}
-
-	buffer = handle->buffer;
+	int ret;
 
-	mutex_lock(&buffer->lock);
-	/* now flush buffer mapped to userspace */
-	ret = buffer->heap->ops->inval_user(buffer, size, vaddr);
-	mutex_unlock(&buffer->lock);
+	/* now invalidate buffer mapped to userspace */
+	ret = ion_buffer_sync_user(handle->buffer, size, vaddr,
+				   CACHE_INVALIDATE);
 	if (ret)
 		pr_err("%s: failure invalidating buffer\n",
 		       __func__);
@@ -1141,6 +1396,11 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 		seq_printf(s, "%16.s %16u %16u\n", client->name, client->pid,
 			   size);
 	}
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		seq_printf(s, "\n%16s %16zu\n", "deferred free",
+			   ion_heap_freelist_size(heap));
+	if (heap->debug_show)
+		heap->debug_show(heap, s, unused);
 	return 0;
 }
 
@@ -111,14 +111,24 @@ static int ion_carveout_heap_map_user(struct ion_heap *heap,
 			       : pgprot_writecombine(vma->vm_page_prot)));
 }
 
+static unsigned long ion_carveout_heap_pfn(struct ion_heap *heap,
+					   struct ion_buffer *buffer,
+					   unsigned long pgoff)
+{
+	return __phys_to_pfn(buffer->priv_phys) + pgoff;
+}
+
 static void per_cpu_cache_flush_arm(void *arg)
 {
 	flush_cache_all();
 }
 
 static int ion_carveout_heap_cache_operation(struct ion_buffer *buffer,
-		size_t len, unsigned long vaddr, enum cache_operation cacheop)
+		unsigned long offset, size_t len, unsigned long vaddr,
+		enum cache_operation cacheop)
 {
+	ion_phys_addr_t phys = buffer->priv_phys + offset;
+
 	if (!buffer || !buffer->cached) {
 		pr_err("%s(): buffer not mapped as cacheable\n", __func__);
 		return -EINVAL;
@@ -133,24 +143,24 @@ static int ion_carveout_heap_cache_operation(struct ion_buffer *buffer,
 	 __cpuc_coherent_user_range((vaddr) & PAGE_MASK, PAGE_ALIGN(vaddr+len));
 
 	if (cacheop == CACHE_FLUSH)
-		outer_flush_range(buffer->priv_phys, buffer->priv_phys+len);
+		outer_flush_range(phys, phys + len);
 	else
-		outer_inv_range(buffer->priv_phys, buffer->priv_phys+len);
+		outer_inv_range(phys, phys + len);
 
 	return 0;
 }
 
-static int ion_carveout_heap_flush_user(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr)
+static int ion_carveout_heap_flush_user(struct ion_buffer *buffer,
+			unsigned long offset, size_t len, unsigned long vaddr)
 {
-	return ion_carveout_heap_cache_operation(buffer, len,
+	return ion_carveout_heap_cache_operation(buffer, offset, len,
 			vaddr, CACHE_FLUSH);
 }
 
-static int ion_carveout_heap_inval_user(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr)
+static int ion_carveout_heap_inval_user(struct ion_buffer *buffer,
+			unsigned long offset, size_t len, unsigned long vaddr)
 {
-	return ion_carveout_heap_cache_operation(buffer, len,
+	return ion_carveout_heap_cache_operation(buffer, offset, len,
 			vaddr, CACHE_INVALIDATE);
 }
 
@@ -159,6 +169,7 @@ static struct ion_heap_ops carveout_heap_ops = {
 	.free = ion_carveout_heap_free,
 	.phys = ion_carveout_heap_phys,
 	.map_user = ion_carveout_heap_map_user,
+	.pfn = ion_carveout_heap_pfn,
 	.map_kernel = (void *)ion_carveout_heap_map_kernel,
 	.unmap_kernel = ion_carveout_heap_unmap_kernel,
 	.flush_user = ion_carveout_heap_flush_user,
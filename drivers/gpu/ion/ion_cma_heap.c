@@ -0,0 +1,230 @@
+/*
+ * drivers/gpu/ion/ion_cma_heap.c
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/device.h>
+#include <linux/dma-contiguous.h>
+#include <linux/err.h>
+#include <linux/highmem.h>
+#include <linux/hrtimer.h>
+#include <linux/ion.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include "ion_priv.h"
+
+/*
+ * Physically contiguous buffers carved out of a CMA area on demand.
+ * Unlike a carveout the area is usable for movable pages while no buffer
+ * is allocated, at the price of having to migrate those pages away when
+ * one is: the allocation latency is recorded so that it can be watched
+ * in the heap's debugfs file.
+ */
+struct ion_cma_heap {
+	struct ion_heap heap;
+	struct device *dev;
+
+	/* allocation statistics, updated under the ion device lock */
+	unsigned long allocs;
+	unsigned long alloc_fails;
+	u64 alloc_ns;
+	u64 alloc_max_ns;
+	/* bytes in buffers, frees are not serialised with allocations */
+	atomic_long_t allocated;
+};
+
+#define to_cma_heap(x) container_of(x, struct ion_cma_heap, heap)
+
+static int ion_cma_heap_allocate(struct ion_heap *heap,
+				 struct ion_buffer *buffer,
+				 unsigned long size, unsigned long align,
+				 unsigned long flags)
+{
+	struct ion_cma_heap *cma_heap = to_cma_heap(heap);
+	int count = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	unsigned int order = align > PAGE_SIZE ? get_order(align) : 0;
+	struct page *page;
+	ktime_t start;
+	u64 ns;
+	int i;
+
+	start = ktime_get();
+	page = dma_alloc_from_contiguous(cma_heap->dev, count, order);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (!page) {
+		cma_heap->alloc_fails++;
+		return -ENOMEM;
+	}
+	cma_heap->allocs++;
+	cma_heap->alloc_ns += ns;
+	cma_heap->alloc_max_ns = max(cma_heap->alloc_max_ns, ns);
+	atomic_long_add(count << PAGE_SHIFT, &cma_heap->allocated);
+
+	/* the pages may have been in use by anyone */
+	for (i = 0; i < count; i++)
+		clear_highpage(nth_page(page, i));
+
+	buffer->priv_virt = page;
+	return 0;
+}
+
+static void ion_cma_heap_free(struct ion_buffer *buffer)
+{
+	struct ion_cma_heap *cma_heap = to_cma_heap(buffer->heap);
+	int count = PAGE_ALIGN(buffer->size) >> PAGE_SHIFT;
+
+	dma_release_from_contiguous(cma_heap->dev, buffer->priv_virt, count);
+	atomic_long_sub(count << PAGE_SHIFT, &cma_heap->allocated);
+}
+
+static int ion_cma_heap_phys(struct ion_heap *heap,
+			     struct ion_buffer *buffer,
+			     ion_phys_addr_t *addr, size_t *len)
+{
+	*addr = page_to_phys((struct page *)buffer->priv_virt);
+	*len = buffer->size;
+	return 0;
+}
+
+static struct scatterlist *ion_cma_heap_map_dma(struct ion_heap *heap,
+						struct ion_buffer *buffer)
+{
+	struct scatterlist *sglist;
+
+	sglist = vmalloc(sizeof(struct scatterlist));
+	if (!sglist)
+		return ERR_PTR(-ENOMEM);
+	sg_init_table(sglist, 1);
+	sg_set_page(sglist, buffer->priv_virt, PAGE_ALIGN(buffer->size), 0);
+	return sglist;
+}
+
+static void ion_cma_heap_unmap_dma(struct ion_heap *heap,
+				   struct ion_buffer *buffer)
+{
+	if (buffer->sglist)
+		vfree(buffer->sglist);
+}
+
+static void *ion_cma_heap_map_kernel(struct ion_heap *heap,
+				     struct ion_buffer *buffer)
+{
+	struct page *page = buffer->priv_virt;
+	int n_pages = PAGE_ALIGN(buffer->size) >> PAGE_SHIFT;
+	struct page **pages;
+	void *vaddr;
+	int i;
+
+	if (!PageHighMem(page))
+		return page_address(page);
+
+	pages = vmalloc(sizeof(struct page *) * n_pages);
+	if (!pages)
+		return NULL;
+	for (i = 0; i < n_pages; i++)
+		pages[i] = nth_page(page, i);
+	vaddr = vm_map_ram(pages, n_pages, -1, PAGE_KERNEL);
+	vfree(pages);
+
+	return vaddr;
+}
+
+static void ion_cma_heap_unmap_kernel(struct ion_heap *heap,
+				      struct ion_buffer *buffer)
+{
+	if (PageHighMem((struct page *)buffer->priv_virt))
+		vm_unmap_ram(buffer->vaddr,
+			     PAGE_ALIGN(buffer->size) >> PAGE_SHIFT);
+}
+
+static int ion_cma_heap_map_user(struct ion_heap *heap,
+				 struct ion_buffer *buffer,
+				 struct vm_area_struct *vma)
+{
+	return remap_pfn_range(vma, vma->vm_start,
+			       page_to_pfn((struct page *)buffer->priv_virt) +
+			       vma->vm_pgoff,
+			       vma->vm_end - vma->vm_start,
+			       (buffer->cached ? (vma->vm_page_prot)
+			       : pgprot_writecombine(vma->vm_page_prot)));
+}
+
+static unsigned long ion_cma_heap_pfn(struct ion_heap *heap,
+				      struct ion_buffer *buffer,
+				      unsigned long pgoff)
+{
+	return page_to_pfn((struct page *)buffer->priv_virt) + pgoff;
+}
+
+static int ion_cma_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
+				   void *unused)
+{
+	struct ion_cma_heap *cma_heap = to_cma_heap(heap);
+	unsigned long allocs = cma_heap->allocs;
+	u64 avg_ns = cma_heap->alloc_ns;
+
+	if (allocs)
+		do_div(avg_ns, allocs);
+
+	seq_printf(s, "\n%16s %16ld\n", "allocated",
+		   atomic_long_read(&cma_heap->allocated));
+	seq_printf(s, "%16s %16lu\n", "allocations", allocs);
+	seq_printf(s, "%16s %16lu\n", "failed", cma_heap->alloc_fails);
+	seq_printf(s, "%16s %16llu\n", "avg alloc us",
+		   (unsigned long long)avg_ns / NSEC_PER_USEC);
+	seq_printf(s, "%16s %16llu\n", "max alloc us",
+		   (unsigned long long)cma_heap->alloc_max_ns / NSEC_PER_USEC);
+	return 0;
+}
+
+static struct ion_heap_ops cma_heap_ops = {
+	.allocate = ion_cma_heap_allocate,
+	.free = ion_cma_heap_free,
+	.phys = ion_cma_heap_phys,
+	.map_dma = ion_cma_heap_map_dma,
+	.unmap_dma = ion_cma_heap_unmap_dma,
+	.map_kernel = ion_cma_heap_map_kernel,
+	.unmap_kernel = ion_cma_heap_unmap_kernel,
+	.map_user = ion_cma_heap_map_user,
+	.pfn = ion_cma_heap_pfn,
+};
+
+struct ion_heap *ion_cma_heap_create(struct ion_platform_heap *heap_data)
+{
+	struct ion_cma_heap *cma_heap;
+
+	cma_heap = kzalloc(sizeof(struct ion_cma_heap), GFP_KERNEL);
+	if (!cma_heap)
+		return ERR_PTR(-ENOMEM);
+
+	/*
+	 * The device the board file declared a CMA area for with
+	 * dma_declare_contiguous(), or NULL for the default area.
+	 */
+	cma_heap->dev = heap_data->priv;
+	cma_heap->heap.ops = &cma_heap_ops;
+	cma_heap->heap.type = ION_HEAP_TYPE_CMA;
+	cma_heap->heap.debug_show = ion_cma_heap_debug_show;
+
+	return &cma_heap->heap;
+}
+
+void ion_cma_heap_destroy(struct ion_heap *heap)
+{
+	kfree(to_cma_heap(heap));
+}
@@ -0,0 +1,173 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+/*
+ * Freed pages go on the dirty list and are zeroed by a worker, which
+ * moves them to the clean list.  Allocations take clean pages first,
+ * zero a dirty page themselves if that is all there is, and only then
+ * go to the page allocator.  No memory is allocated with the mutex
+ * held, so the shrinker can always take it.
+ */
+
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(nth_page(page, i));
+}
+
+static void ion_page_pool_add(struct ion_page_pool *pool, struct page *page,
+			      bool clean)
+{
+	mutex_lock(&pool->mutex);
+	if (clean) {
+		list_add_tail(&page->lru, &pool->clean_items);
+		pool->clean_count++;
+	} else {
+		list_add_tail(&page->lru, &pool->dirty_items);
+		pool->dirty_count++;
+	}
+	mutex_unlock(&pool->mutex);
+}
+
+/* Must be called with the mutex held */
+static struct page *ion_page_pool_remove(struct ion_page_pool *pool,
+					 bool clean)
+{
+	struct list_head *items;
+	struct page *page;
+
+	items = clean ? &pool->clean_items : &pool->dirty_items;
+	if (list_empty(items))
+		return NULL;
+
+	page = list_first_entry(items, struct page, lru);
+	list_del(&page->lru);
+	if (clean)
+		pool->clean_count--;
+	else
+		pool->dirty_count--;
+	return page;
+}
+
+static void ion_page_pool_zero_work(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  zero_work);
+	struct page *page;
+
+	for (;;) {
+		mutex_lock(&pool->mutex);
+		page = ion_page_pool_remove(pool, false);
+		mutex_unlock(&pool->mutex);
+		if (!page)
+			break;
+
+		ion_page_pool_zero(pool, page);
+		ion_page_pool_add(pool, page, true);
+		cond_resched();
+	}
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page;
+	bool clean = true;
+
+	mutex_lock(&pool->mutex);
+	page = ion_page_pool_remove(pool, true);
+	if (!page) {
+		page = ion_page_pool_remove(pool, false);
+		clean = false;
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (!page)
+		return alloc_pages(pool->gfp_mask | __GFP_ZERO, pool->order);
+
+	/* the worker has not got to it yet */
+	if (!clean)
+		ion_page_pool_zero(pool, page);
+	return page;
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	ion_page_pool_add(pool, page, false);
+	queue_work(system_unbound_wq, &pool->zero_work);
+}
+
+/*
+ * Give up to @nr_to_scan pages back to the system, dirty ones first as
+ * they are not ready for use anyway.  Returns the number of pages left
+ * in the pool, or just counts them if @nr_to_scan is 0.
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan)
+{
+	struct page *page;
+	int freed = 0;
+	int count;
+
+	mutex_lock(&pool->mutex);
+	while (freed < nr_to_scan) {
+		page = ion_page_pool_remove(pool, false);
+		if (!page)
+			page = ion_page_pool_remove(pool, true);
+		if (!page)
+			break;
+		__free_pages(page, pool->order);
+		freed += 1 << pool->order;
+	}
+	count = (pool->clean_count + pool->dirty_count) << pool->order;
+	mutex_unlock(&pool->mutex);
+
+	return count;
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
+					     GFP_KERNEL);
+	if (!pool)
+		return NULL;
+	pool->clean_count = 0;
+	pool->dirty_count = 0;
+	INIT_LIST_HEAD(&pool->clean_items);
+	INIT_LIST_HEAD(&pool->dirty_items);
+	mutex_init(&pool->mutex);
+	INIT_WORK(&pool->zero_work, ion_page_pool_zero_work);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	cancel_work_sync(&pool->zero_work);
+	ion_page_pool_shrink(pool, INT_MAX);
+	kfree(pool);
+}
@@ -18,11 +18,14 @@
 #define _ION_PRIV_H
 
 #include <linux/kref.h>
+#include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
 #include <linux/ion.h>
 #include <linux/miscdevice.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
 
 struct ion_mapping;
 
@@ -126,10 +129,15 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * @vaddr:		the kenrel mapping if kmap_cnt is not zero
  * @dmap_cnt:		number of times the buffer is mapped for dma
  * @sglist:		the scatterlist for the buffer is dmap_cnt is not zero
+ * @list:		element in the heap's deferred free list
+ * @vmas:		the faulted in cacheable mappings, as struct ion_vma_list
+ * @vmas_untracked:	a faulted in mapping could not be added to @vmas, so
+ *			every page is taken to be dirty
 */
 struct ion_buffer {
 	struct kref ref;
 	struct rb_node node;
+	struct list_head list;
 	struct ion_device *dev;
 	struct ion_heap *heap;
 	unsigned long flags;
@@ -144,6 +152,8 @@ struct ion_buffer {
 	int dmap_cnt;
 	struct scatterlist *sglist;
 	bool cached;
+	struct list_head vmas;
+	bool vmas_untracked;
 };
 
 /**
@@ -157,8 +167,17 @@ struct ion_buffer {
  * @map_kernel		map memory to the kernel
  * @unmap_kernel	unmap memory to the kernel
  * @map_user		map memory to userspace
+ * @pfn			pfn of a page of the buffer.  If defined and the
+ *			pages have struct pages, cacheable mappings are
+ *			faulted in a page at a time instead of using
+ *			map_user, so that cache maintenance only has to
+ *			cover the pages the cpu has touched, and flush_user
+ *			and inval_user are not needed for them
  * @flush_user		flush memory if mapped as cacheable
  * @inval_user		invalidate memory if mapped as cacheable
+ *
+ * flush_user and inval_user operate on @len bytes at @offset into the
+ * buffer, which the calling process has mapped at @vaddr.
  */
 struct ion_heap_ops {
 	int (*allocate) (struct ion_heap *heap,
@@ -174,10 +193,12 @@ struct ion_heap_ops {
 	void (*unmap_kernel) (struct ion_heap *heap, struct ion_buffer *buffer);
 	int (*map_user) (struct ion_heap *mapper, struct ion_buffer *buffer,
 			 struct vm_area_struct *vma);
-	int (*flush_user) (struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr);
-	int (*inval_user) (struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr);
+	unsigned long (*pfn) (struct ion_heap *heap, struct ion_buffer *buffer,
+			      unsigned long pgoff);
+	int (*flush_user) (struct ion_buffer *buffer, unsigned long offset,
+			size_t len, unsigned long vaddr);
+	int (*inval_user) (struct ion_buffer *buffer, unsigned long offset,
+			size_t len, unsigned long vaddr);
 };
 
 /**
@@ -190,6 +211,16 @@ struct ion_heap_ops {
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @flags:		ION_HEAP_FLAG_* flags, from the platform data
+ * @free_list:		buffers waiting to be freed, if ION_HEAP_FLAG_DEFER_FREE
+ * @free_list_size:	total size of the buffers on free_list
+ * @free_lock:		protects free_list and free_list_size
+ * @waitqueue:		the free thread waits here for buffers
+ * @task:		thread that frees the buffers on free_list
+ * @shrinker:		if the heap sets shrinker.shrink, registered by
+ *			ion_heap_create once the heap is fully set up
+ * @debug_show:		called when the heap debug file is read to add any
+ *			heap specific debug info to the output
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -203,6 +234,15 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	unsigned long flags;
+	struct list_head free_list;
+	size_t free_list_size;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	struct shrinker shrinker;
+	int (*debug_show)(struct ion_heap *heap, struct seq_file *s,
+			  void *unused);
 };
 
 /**
@@ -238,6 +278,55 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap);
 struct ion_heap *ion_heap_create(struct ion_platform_heap *);
 void ion_heap_destroy(struct ion_heap *);
 
+/**
+ * ion_buffer_destroy - release a buffer's memory back to its heap
+ * @buffer:		a buffer which is no longer referenced
+ *
+ * Called directly when the last reference is dropped, or from the heap's
+ * free thread for heaps with ION_HEAP_FLAG_DEFER_FREE.
+ */
+void ion_buffer_destroy(struct ion_buffer *buffer);
+
+/**
+ * functions for deferred freeing -- heaps with ION_HEAP_FLAG_DEFER_FREE
+ * queue released buffers on a free list which a per heap thread empties,
+ * so that the caller of ion_free does not wait for the heap.
+ */
+
+/**
+ * ion_heap_init_deferred_free -- start the free thread of a heap
+ * @heap:		the heap
+ *
+ * Called by ion_heap_create for heaps with ION_HEAP_FLAG_DEFER_FREE,
+ * after it initialized the free list.  Custom heaps setting the flag have
+ * to do both themselves.
+ */
+int ion_heap_init_deferred_free(struct ion_heap *heap);
+
+/**
+ * ion_heap_freelist_add - add a buffer to the deferred free list
+ * @heap:		the heap
+ * @buffer:		the buffer
+ */
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer);
+
+/**
+ * ion_heap_freelist_drain - free buffers on the deferred free list now
+ * @heap:		the heap
+ * @size:		amount of memory to free in bytes, 0 for all of it
+ *
+ * Frees buffers in the calling context until at least @size bytes have
+ * been released or the list is empty, e.g. when an allocation failed or
+ * the heap is asked to shrink.  Returns the number of bytes freed.
+ */
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size);
+
+/**
+ * ion_heap_freelist_size - bytes waiting on the deferred free list
+ * @heap:		the heap
+ */
+size_t ion_heap_freelist_size(struct ion_heap *heap);
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *);
 void ion_system_heap_destroy(struct ion_heap *);
 
@@ -246,6 +335,9 @@ void ion_system_contig_heap_destroy(struct ion_heap *);
 
 struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *);
 void ion_carveout_heap_destroy(struct ion_heap *);
+
+struct ion_heap *ion_cma_heap_create(struct ion_platform_heap *);
+void ion_cma_heap_destroy(struct ion_heap *);
 /**
  * kernel api to allocate/free from carveout -- used when carveout is
  * used to back an architecture specific custom heap
@@ -254,6 +346,49 @@ ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap, unsigned long size,
 				      unsigned long align);
 void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 		       unsigned long size);
+
+/**
+ * struct ion_page_pool - pagepool struct
+ * @clean_count:	number of zeroed items in the pool
+ * @dirty_count:	number of items in the pool still to be zeroed
+ * @clean_items:	list of zeroed items
+ * @dirty_items:	list of items still to be zeroed
+ * @mutex:		lock protecting this struct and especially the counts
+ *			and item lists
+ * @zero_work:		zeroes dirty items in the background
+ * @gfp_mask:		gfp_mask to use from alloc
+ * @order:		order of pages in the pool
+ *
+ * Allows you to keep a pool of pre allocated, zeroed pages to use from
+ * your heap.  Items are pages of the given order, linked through
+ * page->lru.  Pages freed to the pool are zeroed by a worker before
+ * they are handed out again, so the freeing path does not pay for it.
+ */
+struct ion_page_pool {
+	int clean_count;
+	int dirty_count;
+	struct list_head clean_items;
+	struct list_head dirty_items;
+	struct mutex mutex;
+	struct work_struct zero_work;
+	gfp_t gfp_mask;
+	unsigned int order;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+
+/**
+ * ion_page_pool_shrink - shrinks the size of the memory cached in the pool
+ * @pool:		the pool
+ * @nr_to_scan:		number of pages to free, 0 to only count them
+ *
+ * returns the number of pages left in the pool
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan);
+
 /**
  * The carveout heap returns physical addresses, since 0 may be a valid
  * physical address, this is used to indicate allocation failed
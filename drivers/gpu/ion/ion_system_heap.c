@@ -15,6 +15,7 @@
  */
 
 #include <linux/err.h>
+#include <linux/highmem.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
@@ -22,64 +23,160 @@
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
 
+/*
+ * Buffers are built from the largest chunks that are available: high
+ * order pages where they can be had without effort, so there are fewer
+ * pages to allocate, map and free, and single pages otherwise.  Freed
+ * chunks go back to a pool per order, which hands them out again once
+ * they have been zeroed.
+ */
+static const unsigned int orders[] = {8, 4, 0};
+static const int num_orders = ARRAY_SIZE(orders);
+
+static unsigned int high_order_gfp_flags = (GFP_HIGHUSER | __GFP_NOWARN |
+					    __GFP_NORETRY | __GFP_NO_KSWAPD) &
+					   ~__GFP_WAIT;
+static unsigned int low_order_gfp_flags  = (GFP_HIGHUSER | __GFP_NOWARN);
+
+static int order_to_index(unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < num_orders; i++)
+		if (order == orders[i])
+			return i;
+	BUG();
+	return -1;
+}
+
+struct ion_system_heap {
+	struct ion_heap heap;
+	struct ion_page_pool **pools;
+};
+
+struct page_info {
+	struct page *page;
+	unsigned int order;
+	struct list_head list;
+};
+
+/* buffer->priv_virt of a system heap buffer */
+struct ion_system_buffer {
+	struct list_head pages;		/* of struct page_info */
+	int nents;
+};
+
+static struct page_info *alloc_largest_available(struct ion_system_heap *heap,
+						 unsigned long size,
+						 unsigned int max_order)
+{
+	struct page *page;
+	struct page_info *info;
+	int i;
+
+	for (i = 0; i < num_orders; i++) {
+		if (size < (PAGE_SIZE << orders[i]))
+			continue;
+		if (max_order < orders[i])
+			continue;
+
+		page = ion_page_pool_alloc(heap->pools[i]);
+		if (!page)
+			continue;
+
+		info = kmalloc(sizeof(struct page_info), GFP_KERNEL);
+		if (!info) {
+			ion_page_pool_free(heap->pools[i], page);
+			return NULL;
+		}
+		info->page = page;
+		info->order = orders[i];
+		return info;
+	}
+	return NULL;
+}
+
+static void free_buffer_pages(struct ion_system_heap *heap,
+			      struct ion_system_buffer *sbuf)
+{
+	struct page_info *info, *tmp;
+
+	list_for_each_entry_safe(info, tmp, &sbuf->pages, list) {
+		ion_page_pool_free(heap->pools[order_to_index(info->order)],
+				   info->page);
+		list_del(&info->list);
+		kfree(info);
+	}
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				    struct ion_buffer *buffer,
 				    unsigned long size, unsigned long align,
 				    unsigned long flags)
 {
-	struct page **page_list;
-	int n_pages = PAGE_ALIGN(size) / PAGE_SIZE;
-	const int gfp_mask = GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO;
-	int i = 0;
-
-	page_list = kmalloc(n_pages * sizeof(void *), GFP_KERNEL);
-	if (!page_list)
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer *sbuf;
+	struct page_info *info;
+	long size_remaining = PAGE_ALIGN(size);
+	unsigned int max_order = orders[0];
+
+	sbuf = kmalloc(sizeof(struct ion_system_buffer), GFP_KERNEL);
+	if (!sbuf)
 		return -ENOMEM;
-
-	for (i = 0; i < n_pages; i++) {
-		page_list[i] = alloc_page(gfp_mask);
-		if (page_list[i] == NULL)
-			goto out;
+	INIT_LIST_HEAD(&sbuf->pages);
+	sbuf->nents = 0;
+
+	while (size_remaining > 0) {
+		info = alloc_largest_available(sys_heap, size_remaining,
+					       max_order);
+		if (!info)
+			goto err;
+		list_add_tail(&info->list, &sbuf->pages);
+		size_remaining -= PAGE_SIZE << info->order;
+		/* no point in trying an order that just failed again */
+		max_order = info->order;
+		sbuf->nents++;
 	}
 
-	buffer->priv_virt = page_list;
+	buffer->priv_virt = sbuf;
 	return 0;
 
-out:
-	/* failed on i, so go to i-1 */
-	for (i -= 1; i >= 0; i--)
-		__free_page(page_list[i]);
-
-	kfree(page_list);
+err:
+	free_buffer_pages(sys_heap, sbuf);
+	kfree(sbuf);
 	return -ENOMEM;
 }
 
 static void ion_system_heap_free(struct ion_buffer *buffer)
 {
-	int i;
-	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	struct page **page_list = (struct page **)buffer->priv_virt;
-
-	for (i = 0; i < n_pages; i++)
-		__free_page(page_list[i]);
-	kfree(page_list);
+	struct ion_heap *heap = buffer->heap;
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer *sbuf = buffer->priv_virt;
+
+	free_buffer_pages(sys_heap, sbuf);
+	kfree(sbuf);
 }
 
 static struct scatterlist *ion_system_heap_map_dma(struct ion_heap *heap,
 					    struct ion_buffer *buffer)
 {
-	struct scatterlist *sglist;
-	struct page **page_list = (struct page **)buffer->priv_virt;
-	int i;
-	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+	struct ion_system_buffer *sbuf = buffer->priv_virt;
+	struct scatterlist *sglist, *sg;
+	struct page_info *info;
 
-	sglist = vmalloc(n_pages * sizeof(struct scatterlist));
+	sglist = vmalloc(sbuf->nents * sizeof(struct scatterlist));
 	if (!sglist)
 		return ERR_PTR(-ENOMEM);
-	memset(sglist, 0, n_pages * sizeof(struct scatterlist));
-	sg_init_table(sglist, n_pages);
-	for (i = 0; i < n_pages; i++)
-		sg_set_page(&sglist[i], page_list[i], PAGE_SIZE, 0);
+	sg_init_table(sglist, sbuf->nents);
+	sg = sglist;
+	list_for_each_entry(info, &sbuf->pages, list) {
+		sg_set_page(sg, info->page, PAGE_SIZE << info->order, 0);
+		sg = sg_next(sg);
+	}
 	/* XXX do cache maintenance for dma? */
 	return sglist;
 }
@@ -95,10 +192,28 @@ static void ion_system_heap_unmap_dma(struct ion_heap *heap,
 static void *ion_system_heap_map_kernel(struct ion_heap *heap,
 				 struct ion_buffer *buffer)
 {
+	struct ion_system_buffer *sbuf = buffer->priv_virt;
 	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	struct page **page_list = (struct page **)buffer->priv_virt;
+	struct page **pages, **tmp;
+	struct page_info *info;
+	void *vaddr;
+	int i;
+
+	pages = vmalloc(sizeof(struct page *) * n_pages);
+	if (!pages)
+		return NULL;
 
-	return vm_map_ram(page_list, n_pages, -1, PAGE_KERNEL);
+	tmp = pages;
+	list_for_each_entry(info, &sbuf->pages, list) {
+		for (i = 0; i < (1 << info->order) && tmp < pages + n_pages;
+		     i++)
+			*(tmp++) = nth_page(info->page, i);
+	}
+
+	vaddr = vm_map_ram(pages, n_pages, -1, PAGE_KERNEL);
+	vfree(pages);
+
+	return vaddr;
 }
 
 static void ion_system_heap_unmap_kernel(struct ion_heap *heap,
@@ -113,28 +228,51 @@ static int ion_system_heap_map_user(struct ion_heap *heap,
 				struct ion_buffer *buffer,
 				struct vm_area_struct *vma)
 {
-	unsigned long uaddr = vma->vm_start;
-	unsigned long usize = vma->vm_end - vma->vm_start;
-	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	struct page **page_list = (struct page **)buffer->priv_virt;
-	int i = 0;
-
-	if (usize > (n_pages << PAGE_SHIFT))
-		return -EINVAL;
-
-	do {
-		int ret;
-
-		ret = vm_insert_page(vma, uaddr, page_list[i]);
+	struct ion_system_buffer *sbuf = buffer->priv_virt;
+	unsigned long addr = vma->vm_start;
+	unsigned long offset = vma->vm_pgoff * PAGE_SIZE;
+	struct page_info *info;
+	int ret;
+
+	list_for_each_entry(info, &sbuf->pages, list) {
+		unsigned long remainder = vma->vm_end - addr;
+		unsigned long len = PAGE_SIZE << info->order;
+		unsigned long pfn = page_to_pfn(info->page);
+
+		if (offset >= len) {
+			offset -= len;
+			continue;
+		}
+		pfn += offset >> PAGE_SHIFT;
+		len -= offset;
+		offset = 0;
+
+		len = min(len, remainder);
+		ret = remap_pfn_range(vma, addr, pfn, len, vma->vm_page_prot);
 		if (ret)
 			return ret;
+		addr += len;
+		if (addr >= vma->vm_end)
+			return 0;
+	}
 
-		uaddr += PAGE_SIZE;
-		usize -= PAGE_SIZE;
-	} while (usize > 0);
+	/* the mapping is larger than the buffer */
+	return -EINVAL;
+}
 
-	vma->vm_flags |= VM_RESERVED;
+static unsigned long ion_system_heap_pfn(struct ion_heap *heap,
+					 struct ion_buffer *buffer,
+					 unsigned long pgoff)
+{
+	struct ion_system_buffer *sbuf = buffer->priv_virt;
+	struct page_info *info;
 
+	list_for_each_entry(info, &sbuf->pages, list) {
+		if (pgoff < (1 << info->order))
+			return page_to_pfn(info->page) + pgoff;
+		pgoff -= 1 << info->order;
+	}
+	BUG();
 	return 0;
 }
 
@@ -146,23 +284,113 @@ static struct ion_heap_ops vmalloc_ops = {
 	.map_kernel = ion_system_heap_map_kernel,
 	.unmap_kernel = ion_system_heap_unmap_kernel,
 	.map_user = ion_system_heap_map_user,
+	.pfn = ion_system_heap_pfn,
 };
 
+static int ion_system_heap_shrink(struct shrinker *shrinker,
+				  struct shrink_control *sc)
+{
+	struct ion_system_heap *sys_heap = container_of(shrinker,
+							struct ion_system_heap,
+							heap.shrinker);
+	int nr_to_scan = sc->nr_to_scan;
+	int nr_total = 0;
+	int i;
+
+	/* buffers waiting to be freed would end up in the pools anyway */
+	if (nr_to_scan > 0)
+		ion_heap_freelist_drain(&sys_heap->heap,
+					(size_t)nr_to_scan * PAGE_SIZE);
+	else
+		nr_total = ion_heap_freelist_size(&sys_heap->heap) / PAGE_SIZE;
+
+	/* shrink the largest chunks first, they are the hardest to get */
+	for (i = 0; i < num_orders; i++) {
+		struct ion_page_pool *pool = sys_heap->pools[i];
+		int before = ion_page_pool_shrink(pool, 0);
+		int after = ion_page_pool_shrink(pool, nr_to_scan);
+
+		nr_to_scan = max(nr_to_scan - (before - after), 0);
+		nr_total += after;
+	}
+
+	return nr_total;
+}
+
+static int ion_system_heap_debug_show(struct ion_heap *heap,
+				      struct seq_file *s, void *unused)
+{
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	int i;
+
+	for (i = 0; i < num_orders; i++) {
+		struct ion_page_pool *pool = sys_heap->pools[i];
+
+		seq_printf(s, "%d order %u pages in pool = %lu total "
+			   "(%d still to be zeroed)\n",
+			   pool->clean_count + pool->dirty_count, pool->order,
+			   (unsigned long)(pool->clean_count +
+					   pool->dirty_count) *
+			   (PAGE_SIZE << pool->order), pool->dirty_count);
+	}
+	return 0;
+}
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 {
-	struct ion_heap *heap;
+	struct ion_system_heap *heap;
+	int i;
 
-	heap = kzalloc(sizeof(struct ion_heap), GFP_KERNEL);
+	heap = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
 	if (!heap)
 		return ERR_PTR(-ENOMEM);
-	heap->ops = &vmalloc_ops;
-	heap->type = ION_HEAP_TYPE_SYSTEM;
-	return heap;
+	heap->heap.ops = &vmalloc_ops;
+	heap->heap.type = ION_HEAP_TYPE_SYSTEM;
+	heap->heap.debug_show = ion_system_heap_debug_show;
+	heap->pools = kzalloc(sizeof(struct ion_page_pool *) * num_orders,
+			      GFP_KERNEL);
+	if (!heap->pools)
+		goto err_alloc_pools;
+	for (i = 0; i < num_orders; i++) {
+		struct ion_page_pool *pool;
+		gfp_t gfp_flags = low_order_gfp_flags;
+
+		if (orders[i] > 0)
+			gfp_flags = high_order_gfp_flags;
+		pool = ion_page_pool_create(gfp_flags, orders[i]);
+		if (!pool)
+			goto err_create_pool;
+		heap->pools[i] = pool;
+	}
+
+	heap->heap.shrinker.shrink = ion_system_heap_shrink;
+	heap->heap.shrinker.seeks = DEFAULT_SEEKS;
+	heap->heap.shrinker.batch = 0;
+	return &heap->heap;
+
+err_create_pool:
+	for (i = 0; i < num_orders; i++)
+		if (heap->pools[i])
+			ion_page_pool_destroy(heap->pools[i]);
+	kfree(heap->pools);
+err_alloc_pools:
+	kfree(heap);
+	return ERR_PTR(-ENOMEM);
 }
 
 void ion_system_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	int i;
+
+	for (i = 0; i < num_orders; i++)
+		ion_page_pool_destroy(sys_heap->pools[i]);
+	kfree(sys_heap->pools);
+	kfree(sys_heap);
 }
 
 static int ion_system_contig_heap_allocate(struct ion_heap *heap,
@@ -204,6 +432,17 @@ static struct scatterlist *ion_system_contig_heap_map_dma(struct ion_heap *heap,
 	return sglist;
 }
 
+static void *ion_system_contig_heap_map_kernel(struct ion_heap *heap,
+					      struct ion_buffer *buffer)
+{
+	return buffer->priv_virt;
+}
+
+static void ion_system_contig_heap_unmap_kernel(struct ion_heap *heap,
+					       struct ion_buffer *buffer)
+{
+}
+
 static int ion_system_contig_heap_map_user(struct ion_heap *heap,
 				    struct ion_buffer *buffer,
 				    struct vm_area_struct *vma)
@@ -214,15 +453,23 @@ static int ion_system_contig_heap_map_user(struct ion_heap *heap,
 
 }
 
+static unsigned long ion_system_contig_heap_pfn(struct ion_heap *heap,
+						struct ion_buffer *buffer,
+						unsigned long pgoff)
+{
+	return __phys_to_pfn(virt_to_phys(buffer->priv_virt)) + pgoff;
+}
+
 static struct ion_heap_ops kmalloc_ops = {
 	.allocate = ion_system_contig_heap_allocate,
 	.free = ion_system_contig_heap_free,
 	.phys = ion_system_contig_heap_phys,
 	.map_dma = ion_system_contig_heap_map_dma,
 	.unmap_dma = ion_system_heap_unmap_dma,
-	.map_kernel = ion_system_heap_map_kernel,
-	.unmap_kernel = ion_system_heap_unmap_kernel,
+	.map_kernel = ion_system_contig_heap_map_kernel,
+	.unmap_kernel = ion_system_contig_heap_unmap_kernel,
 	.map_user = ion_system_contig_heap_map_user,
+	.pfn = ion_system_contig_heap_pfn,
 };
 
 struct ion_heap *ion_system_contig_heap_create(struct ion_platform_heap *unused)
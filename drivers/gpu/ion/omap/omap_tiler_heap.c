@@ -350,8 +350,9 @@ static void per_cpu_cache_flush_arm(void *arg)
 	   flush_cache_all();
 }
 
-static int omap_tiler_cache_operation(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr, enum cache_operation cacheop)
+static int omap_tiler_cache_operation(struct ion_buffer *buffer,
+			unsigned long offset, size_t len, unsigned long vaddr,
+			enum cache_operation cacheop)
 {
 	struct omap_tiler_info *info;
 	int n_pages;
@@ -372,7 +373,7 @@ static int omap_tiler_cache_operation(struct ion_buffer *buffer, size_t len,
 	}
 
 	n_pages = info->n_tiler_pages;
-	if (len > (n_pages * PAGE_SIZE)) {
+	if (offset + len > (n_pages * PAGE_SIZE)) {
 		pr_err("%s(): size to flush is greater than allocated size\n",
 				__func__);
 		return -EINVAL;
@@ -392,24 +393,26 @@ static int omap_tiler_cache_operation(struct ion_buffer *buffer, size_t len,
 	__cpuc_coherent_user_range((vaddr) & PAGE_MASK, PAGE_ALIGN(vaddr+len));
 
 	if (cacheop == CACHE_FLUSH)
-		outer_flush_range(info->tiler_addrs[0],
-				info->tiler_addrs[0] + len);
+		outer_flush_range(info->tiler_addrs[0] + offset,
+				info->tiler_addrs[0] + offset + len);
 	else
-		outer_inv_range(info->tiler_addrs[0],
-				info->tiler_addrs[0] + len);
+		outer_inv_range(info->tiler_addrs[0] + offset,
+				info->tiler_addrs[0] + offset + len);
 	return 0;
 }
 
-static int omap_tiler_heap_flush_user(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr)
+static int omap_tiler_heap_flush_user(struct ion_buffer *buffer,
+			unsigned long offset, size_t len, unsigned long vaddr)
 {
-	return omap_tiler_cache_operation(buffer, len, vaddr, CACHE_FLUSH);
+	return omap_tiler_cache_operation(buffer, offset, len, vaddr,
+					  CACHE_FLUSH);
 }
 
-static int omap_tiler_heap_inval_user(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr)
+static int omap_tiler_heap_inval_user(struct ion_buffer *buffer,
+			unsigned long offset, size_t len, unsigned long vaddr)
 {
-	return omap_tiler_cache_operation(buffer, len, vaddr, CACHE_INVALIDATE);
+	return omap_tiler_cache_operation(buffer, offset, len, vaddr,
+					  CACHE_INVALIDATE);
 }
 
 static struct ion_heap_ops omap_tiler_ops = {
@@ -12,12 +12,20 @@
  * hash device. Setting this greatly improves performance when data and hash
  * are on the same disk on different partitions on devices with poor random
  * access behavior.
+ *
+ * In the file "/sys/module/dm_verity/parameters/split_size" you can set the
+ * size of the pieces that large reads are split into for hashing, each piece
+ * being verified by a separate work item so that several CPUs can hash one
+ * read. 0 disables splitting.
  */
 
 #include "dm-bufio.h"
 
 #include <linux/module.h>
 #include <linux/device-mapper.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
 #include <crypto/hash.h>
 
 #define DM_MSG_PREFIX			"verity"
@@ -25,6 +33,7 @@
 #define DM_VERITY_IO_VEC_INLINE		16
 #define DM_VERITY_MEMPOOL_SIZE		4
 #define DM_VERITY_DEFAULT_PREFETCH_SIZE	262144
+#define DM_VERITY_DEFAULT_SPLIT_SIZE	32768
 
 #define DM_VERITY_MAX_LEVELS		63
 
@@ -32,6 +41,10 @@ static unsigned dm_verity_prefetch_cluster = DM_VERITY_DEFAULT_PREFETCH_SIZE;
 
 module_param_named(prefetch_cluster, dm_verity_prefetch_cluster, uint, S_IRUGO | S_IWUSR);
 
+static unsigned dm_verity_split_size = DM_VERITY_DEFAULT_SPLIT_SIZE;
+
+module_param_named(split_size, dm_verity_split_size, uint, S_IRUGO | S_IWUSR);
+
 struct dm_verity {
 	struct dm_dev *data_dev;
 	struct dm_dev *hash_dev;
@@ -57,11 +70,60 @@ struct dm_verity {
 
 	mempool_t *io_mempool;	/* mempool of struct dm_verity_io */
 	mempool_t *vec_mempool;	/* mempool of bio vector */
+	mempool_t *part_mempool;	/* mempool of struct dm_verity_part */
 
 	struct workqueue_struct *verify_wq;
 
+	/*
+	 * With the "verify_hash_once" option, a bit per hash block that is
+	 * set once the block has been verified, so that it is trusted when
+	 * read again after dm-bufio dropped it.
+	 */
+	unsigned long *verified_bitmap;
+
 	/* starting blocks for each tree level. 0 is the lowest level. */
 	sector_t hash_level_block[DM_VERITY_MAX_LEVELS];
+
+	/*
+	 * Hashing statistics, shown by verity_status(). Added to once per
+	 * part, and kept apart from the fields above that every io reads.
+	 */
+	atomic64_t hashed_bytes ____cacheline_aligned_in_smp;
+	atomic64_t hash_ns;
+	atomic64_t hash_blocks_skipped;
+};
+
+struct dm_verity_io;
+
+/*
+ * A run of blocks of an io verified by one work item. Each io has one
+ * embedded; large ios get more, see verity_split_io().
+ */
+struct dm_verity_part {
+	struct dm_verity_io *io;
+	struct work_struct work;
+
+	sector_t block;
+	unsigned n_blocks;
+
+	/* where the data of the first block starts in io->io_vec */
+	unsigned vector;
+	unsigned offset;
+
+	/* statistics, added to those of the target in verity_part_done() */
+	ktime_t start;
+	unsigned hashed_bytes;
+	unsigned hash_blocks_skipped;
+
+	/*
+	 * Three variably-size fields follow this struct:
+	 *
+	 * u8 hash_desc[v->shash_descsize];
+	 * u8 real_digest[v->digest_size];
+	 * u8 want_digest[v->digest_size];
+	 *
+	 * To access them use: io_hash_desc(), io_real_digest() and io_want_digest().
+	 */
 };
 
 struct dm_verity_io {
@@ -79,35 +141,30 @@ struct dm_verity_io {
 	struct bio_vec *io_vec;
 	unsigned io_vec_size;
 
-	struct work_struct work;
+	/* parts not verified yet, and the error of any that failed */
+	atomic_t parts_pending;
+	int error;
 
 	/* A space for short vectors; longer vectors are allocated separately. */
 	struct bio_vec io_vec_inline[DM_VERITY_IO_VEC_INLINE];
 
-	/*
-	 * Three variably-size fields follow this struct:
-	 *
-	 * u8 hash_desc[v->shash_descsize];
-	 * u8 real_digest[v->digest_size];
-	 * u8 want_digest[v->digest_size];
-	 *
-	 * To access them use: io_hash_desc(), io_real_digest() and io_want_digest().
-	 */
+	/* Must be last, the fields of the part follow it. */
+	struct dm_verity_part part;
 };
 
-static struct shash_desc *io_hash_desc(struct dm_verity *v, struct dm_verity_io *io)
+static struct shash_desc *io_hash_desc(struct dm_verity *v, struct dm_verity_part *part)
 {
-	return (struct shash_desc *)(io + 1);
+	return (struct shash_desc *)(part + 1);
 }
 
-static u8 *io_real_digest(struct dm_verity *v, struct dm_verity_io *io)
+static u8 *io_real_digest(struct dm_verity *v, struct dm_verity_part *part)
 {
-	return (u8 *)(io + 1) + v->shash_descsize;
+	return (u8 *)(part + 1) + v->shash_descsize;
 }
 
-static u8 *io_want_digest(struct dm_verity *v, struct dm_verity_io *io)
+static u8 *io_want_digest(struct dm_verity *v, struct dm_verity_part *part)
 {
-	return (u8 *)(io + 1) + v->shash_descsize + v->digest_size;
+	return (u8 *)(part + 1) + v->shash_descsize + v->digest_size;
 }
 
 /*
@@ -178,17 +235,17 @@ static void verity_hash_at_level(struct dm_verity *v, sector_t block, int level,
  * Verify hash of a metadata block pertaining to the specified data block
  * ("block" argument) at a specified level ("level" argument).
  *
- * On successful return, io_want_digest(v, io) contains the hash value for
+ * On successful return, io_want_digest(v, part) contains the hash value for
  * a lower tree level or for the data block (if we're at the lowest leve).
  *
  * If "skip_unverified" is true, unverified buffer is skipped and 1 is returned.
  * If "skip_unverified" is false, unverified buffer is hashed and verified
- * against current value of io_want_digest(v, io).
+ * against current value of io_want_digest(v, part).
  */
-static int verity_verify_level(struct dm_verity_io *io, sector_t block,
+static int verity_verify_level(struct dm_verity_part *part, sector_t block,
 			       int level, bool skip_unverified)
 {
-	struct dm_verity *v = io->v;
+	struct dm_verity *v = part->io->v;
 	struct dm_buffer *buf;
 	struct buffer_aux *aux;
 	u8 *data;
@@ -204,6 +261,12 @@ static int verity_verify_level(struct dm_verity_io *io, sector_t block,
 
 	aux = dm_bufio_get_aux_data(buf);
 
+	if (!aux->hash_verified && v->verified_bitmap &&
+	    test_bit(hash_block - v->hash_start, v->verified_bitmap)) {
+		aux->hash_verified = 1;
+		part->hash_blocks_skipped++;
+	}
+
 	if (!aux->hash_verified) {
 		struct shash_desc *desc;
 		u8 *result;
@@ -213,7 +276,7 @@ static int verity_verify_level(struct dm_verity_io *io, sector_t block,
 			goto release_ret_r;
 		}
 
-		desc = io_hash_desc(v, io);
+		desc = io_hash_desc(v, part);
 		desc->tfm = v->tfm;
 		desc->flags = CRYPTO_TFM_REQ_MAY_SLEEP;
 		r = crypto_shash_init(desc);
@@ -244,25 +307,30 @@ static int verity_verify_level(struct dm_verity_io *io, sector_t block,
 			}
 		}
 
-		result = io_real_digest(v, io);
+		result = io_real_digest(v, part);
 		r = crypto_shash_final(desc, result);
 		if (r < 0) {
 			DMERR("crypto_shash_final failed: %d", r);
 			goto release_ret_r;
 		}
-		if (unlikely(memcmp(result, io_want_digest(v, io), v->digest_size))) {
+		part->hashed_bytes += 1 << v->hash_dev_block_bits;
+		if (unlikely(memcmp(result, io_want_digest(v, part), v->digest_size))) {
 			DMERR_LIMIT("metadata block %llu is corrupted",
 				(unsigned long long)hash_block);
 			v->hash_failed = 1;
 			r = -EIO;
 			goto release_ret_r;
-		} else
+		} else {
 			aux->hash_verified = 1;
+			if (v->verified_bitmap)
+				set_bit(hash_block - v->hash_start,
+					v->verified_bitmap);
+		}
 	}
 
 	data += offset;
 
-	memcpy(io_want_digest(v, io), data, v->digest_size);
+	memcpy(io_want_digest(v, part), data, v->digest_size);
 
 	dm_bufio_release(buf);
 	return 0;
@@ -274,16 +342,21 @@ release_ret_r:
 }
 
 /*
- * Verify one "dm_verity_io" structure.
+ * Verify the blocks of one "dm_verity_part" structure.
  */
-static int verity_verify_io(struct dm_verity_io *io)
+static int verity_verify_part(struct dm_verity_part *part)
 {
+	struct dm_verity_io *io = part->io;
 	struct dm_verity *v = io->v;
 	unsigned b;
 	int i;
-	unsigned vector = 0, offset = 0;
+	unsigned vector = part->vector, offset = part->offset;
+
+	part->start = ktime_get();
+	part->hashed_bytes = 0;
+	part->hash_blocks_skipped = 0;
 
-	for (b = 0; b < io->n_blocks; b++) {
+	for (b = 0; b < part->n_blocks; b++) {
 		struct shash_desc *desc;
 		u8 *result;
 		int r;
@@ -297,23 +370,23 @@ static int verity_verify_io(struct dm_verity_io *io)
 			 * function returns 0 and we fall back to whole
 			 * chain verification.
 			 */
-			int r = verity_verify_level(io, io->block + b, 0, true);
+			int r = verity_verify_level(part, part->block + b, 0, true);
 			if (likely(!r))
 				goto test_block_hash;
 			if (r < 0)
 				return r;
 		}
 
-		memcpy(io_want_digest(v, io), v->root_digest, v->digest_size);
+		memcpy(io_want_digest(v, part), v->root_digest, v->digest_size);
 
 		for (i = v->levels - 1; i >= 0; i--) {
-			int r = verity_verify_level(io, io->block + b, i, false);
+			int r = verity_verify_level(part, part->block + b, i, false);
 			if (unlikely(r))
 				return r;
 		}
 
 test_block_hash:
-		desc = io_hash_desc(v, io);
+		desc = io_hash_desc(v, part);
 		desc->tfm = v->tfm;
 		desc->flags = CRYPTO_TFM_REQ_MAY_SLEEP;
 		r = crypto_shash_init(desc);
@@ -365,21 +438,24 @@ test_block_hash:
 			}
 		}
 
-		result = io_real_digest(v, io);
+		result = io_real_digest(v, part);
 		r = crypto_shash_final(desc, result);
 		if (r < 0) {
 			DMERR("crypto_shash_final failed: %d", r);
 			return r;
 		}
-		if (unlikely(memcmp(result, io_want_digest(v, io), v->digest_size))) {
+		part->hashed_bytes += 1 << v->data_dev_block_bits;
+		if (unlikely(memcmp(result, io_want_digest(v, part), v->digest_size))) {
 			DMERR_LIMIT("data block %llu is corrupted",
-				(unsigned long long)(io->block + b));
+				(unsigned long long)(part->block + b));
 			v->hash_failed = 1;
 			return -EIO;
 		}
 	}
-	BUG_ON(vector != io->io_vec_size);
-	BUG_ON(offset);
+	if (part->block + part->n_blocks == io->block + io->n_blocks) {
+		BUG_ON(vector != io->io_vec_size);
+		BUG_ON(offset);
+	}
 
 	return 0;
 }
@@ -403,11 +479,116 @@ static void verity_finish_io(struct dm_verity_io *io, int error)
 	bio_endio(bio, error);
 }
 
+/*
+ * Account one verified part; the last one ends the io.
+ */
+static void verity_part_done(struct dm_verity_part *part, int error)
+{
+	struct dm_verity_io *io = part->io;
+	struct dm_verity *v = io->v;
+
+	atomic64_add(part->hashed_bytes, &v->hashed_bytes);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), part->start)),
+		     &v->hash_ns);
+	if (part->hash_blocks_skipped)
+		atomic64_add(part->hash_blocks_skipped,
+			     &v->hash_blocks_skipped);
+
+	if (unlikely(error))
+		io->error = error;
+
+	if (part != &io->part)
+		mempool_free(part, v->part_mempool);
+
+	if (atomic_dec_and_test(&io->parts_pending))
+		verity_finish_io(io, io->error);
+}
+
+static void verity_part_work(struct work_struct *w)
+{
+	struct dm_verity_part *part = container_of(w, struct dm_verity_part, work);
+
+	verity_part_done(part, verity_verify_part(part));
+}
+
+/*
+ * Move a position in the io vector "bytes" forward.
+ */
+static void verity_advance_vec(struct dm_verity_io *io, unsigned *vector,
+			       unsigned *offset, unsigned bytes)
+{
+	while (bytes) {
+		struct bio_vec *bv;
+		unsigned len;
+
+		BUG_ON(*vector >= io->io_vec_size);
+		bv = &io->io_vec[*vector];
+		len = min(bv->bv_len - *offset, bytes);
+		*offset += len;
+		bytes -= len;
+		if (*offset == bv->bv_len) {
+			*offset = 0;
+			(*vector)++;
+		}
+	}
+}
+
+/*
+ * Hand all but the last "split_size" piece of a large io, up to one per
+ * CPU, to other work items, leaving the rest to the embedded part.
+ *
+ * Parts are allocated without waiting: all the workqueue's workers could
+ * be waiting here for parts that none of them is free to verify. Whatever
+ * could not be split off is verified by the embedded part.
+ */
+static void verity_split_io(struct dm_verity_io *io)
+{
+	struct dm_verity *v = io->v;
+	struct dm_verity_part *part;
+	unsigned split = ACCESS_ONCE(dm_verity_split_size) >> v->data_dev_block_bits;
+	unsigned n_parts, per_part, b = 0;
+	unsigned vector = 0, offset = 0;
+
+	atomic_set(&io->parts_pending, 1);
+	io->error = 0;
+
+	if (split && io->n_blocks >= 2 * split) {
+		n_parts = min(io->n_blocks / split, num_online_cpus());
+		per_part = DIV_ROUND_UP(io->n_blocks, n_parts);
+
+		while (n_parts > 1 && io->n_blocks - b > per_part) {
+			part = mempool_alloc(v->part_mempool, GFP_NOWAIT);
+			if (!part)
+				break;
+
+			part->io = io;
+			part->block = io->block + b;
+			part->n_blocks = per_part;
+			part->vector = vector;
+			part->offset = offset;
+
+			atomic_inc(&io->parts_pending);
+			INIT_WORK(&part->work, verity_part_work);
+			queue_work(v->verify_wq, &part->work);
+
+			b += per_part;
+			verity_advance_vec(io, &vector, &offset,
+					   per_part << v->data_dev_block_bits);
+		}
+	}
+
+	io->part.block = io->block + b;
+	io->part.n_blocks = io->n_blocks - b;
+	io->part.vector = vector;
+	io->part.offset = offset;
+}
+
 static void verity_work(struct work_struct *w)
 {
-	struct dm_verity_io *io = container_of(w, struct dm_verity_io, work);
+	struct dm_verity_io *io = container_of(w, struct dm_verity_io, part.work);
 
-	verity_finish_io(io, verity_verify_io(io));
+	verity_split_io(io);
+	verity_part_done(&io->part, verity_verify_part(&io->part));
 }
 
 static void verity_end_io(struct bio *bio, int error)
@@ -419,8 +600,8 @@ static void verity_end_io(struct bio *bio, int error)
 		return;
 	}
 
-	INIT_WORK(&io->work, verity_work);
-	queue_work(io->v->verify_wq, &io->work);
+	INIT_WORK(&io->part.work, verity_work);
+	queue_work(io->v->verify_wq, &io->part.work);
 }
 
 /*
@@ -493,6 +674,7 @@ static int verity_map(struct dm_target *ti, struct bio *bio,
 	io->orig_bi_private = bio->bi_private;
 	io->block = bio->bi_sector >> (v->data_dev_block_bits - SECTOR_SHIFT);
 	io->n_blocks = bio->bi_size >> v->data_dev_block_bits;
+	io->part.io = io;
 
 	bio->bi_end_io = verity_end_io;
 	bio->bi_private = io;
@@ -512,7 +694,10 @@ static int verity_map(struct dm_target *ti, struct bio *bio,
 }
 
 /*
- * Status: V (valid) or C (corruption found)
+ * Status: V (valid) or C (corruption found), then the number of bytes
+ * hashed, the time spent verifying them in microseconds, the resulting
+ * throughput in KiB/s per CPU and the number of hash blocks trusted
+ * without hashing because of "verify_hash_once".
  */
 static int verity_status(struct dm_target *ti, status_type_t type,
 			 char *result, unsigned maxlen)
@@ -520,10 +705,19 @@ static int verity_status(struct dm_target *ti, status_type_t type,
 	struct dm_verity *v = ti->private;
 	unsigned sz = 0;
 	unsigned x;
+	u64 bytes, ns, ms;
 
 	switch (type) {
 	case STATUSTYPE_INFO:
-		DMEMIT("%c", v->hash_failed ? 'C' : 'V');
+		bytes = atomic64_read(&v->hashed_bytes);
+		ns = atomic64_read(&v->hash_ns);
+		ms = div64_u64(ns, NSEC_PER_MSEC);
+		DMEMIT("%c %llu %llu %llu %llu", v->hash_failed ? 'C' : 'V',
+		       (unsigned long long)bytes,
+		       (unsigned long long)div64_u64(ns, NSEC_PER_USEC),
+		       (unsigned long long)(ms ? div64_u64((bytes >> 10) *
+							   MSEC_PER_SEC, ms) : 0),
+		       (unsigned long long)atomic64_read(&v->hash_blocks_skipped));
 		break;
 	case STATUSTYPE_TABLE:
 		DMEMIT("%u %s %s %u %u %llu %llu %s ",
@@ -544,6 +738,8 @@ static int verity_status(struct dm_target *ti, status_type_t type,
 		else
 			for (x = 0; x < v->salt_size; x++)
 				DMEMIT("%02x", v->salt[x]);
+		if (v->verified_bitmap)
+			DMEMIT(" 1 verify_hash_once");
 		break;
 	}
 
@@ -607,6 +803,9 @@ static void verity_dtr(struct dm_target *ti)
 	if (v->verify_wq)
 		destroy_workqueue(v->verify_wq);
 
+	if (v->part_mempool)
+		mempool_destroy(v->part_mempool);
+
 	if (v->vec_mempool)
 		mempool_destroy(v->vec_mempool);
 
@@ -616,6 +815,7 @@ static void verity_dtr(struct dm_target *ti)
 	if (v->bufio)
 		dm_bufio_client_destroy(v->bufio);
 
+	vfree(v->verified_bitmap);
 	kfree(v->salt);
 	kfree(v->root_digest);
 
@@ -646,12 +846,23 @@ static void verity_dtr(struct dm_target *ti)
  *	<algorithm>
  *	<digest>
  *	<salt>		Hex string or "-" if no salt.
+ *
+ * Optionally followed by the number of feature arguments and:
+ *	verify_hash_once	Trust hash blocks that have been verified once
+ *				when they are read again.
  */
 static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 {
+	static struct dm_arg _args[] = {
+		{0, 1, "Invalid number of feature args"},
+	};
 	struct dm_verity *v;
+	struct dm_arg_set as;
+	const char *opt_string;
 	unsigned num;
+	unsigned opt_params;
 	unsigned long long num_ll;
+	bool verify_hash_once = false;
 	int r;
 	int i;
 	sector_t hash_position;
@@ -671,12 +882,37 @@ static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 		goto bad;
 	}
 
-	if (argc != 10) {
-		ti->error = "Invalid argument count: exactly 10 arguments required";
+	if (argc < 10) {
+		ti->error = "Invalid argument count: at least 10 arguments required";
 		r = -EINVAL;
 		goto bad;
 	}
 
+	as.argc = argc - 10;
+	as.argv = argv + 10;
+	if (as.argc) {
+		r = dm_read_arg_group(_args, &as, &opt_params, &ti->error);
+		if (r)
+			goto bad;
+
+		while (opt_params--) {
+			opt_string = dm_shift_arg(&as);
+			if (!strcasecmp(opt_string, "verify_hash_once")) {
+				verify_hash_once = true;
+				continue;
+			}
+			ti->error = "Unrecognised verity feature requested";
+			r = -EINVAL;
+			goto bad;
+		}
+
+		if (as.argc) {
+			ti->error = "Too many arguments";
+			r = -EINVAL;
+			goto bad;
+		}
+	}
+
 	if (sscanf(argv[0], "%d%c", &num, &dummy) != 1 ||
 	    num < 0 || num > 1) {
 		ti->error = "Invalid version";
@@ -825,6 +1061,17 @@ static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 	}
 	v->hash_blocks = hash_position;
 
+	if (verify_hash_once) {
+		v->verified_bitmap = vzalloc(BITS_TO_LONGS(v->hash_blocks -
+							    v->hash_start) *
+					     sizeof(unsigned long));
+		if (!v->verified_bitmap) {
+			ti->error = "Cannot allocate verified bitmap";
+			r = -ENOMEM;
+			goto bad;
+		}
+	}
+
 	v->bufio = dm_bufio_client_create(v->hash_dev->bdev,
 		1 << v->hash_dev_block_bits, 1, sizeof(struct buffer_aux),
 		dm_bufio_alloc_callback, NULL);
@@ -849,6 +1096,14 @@ static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 		goto bad;
 	}
 
+	v->part_mempool = mempool_create_kmalloc_pool(DM_VERITY_MEMPOOL_SIZE,
+	  sizeof(struct dm_verity_part) + v->shash_descsize + v->digest_size * 2);
+	if (!v->part_mempool) {
+		ti->error = "Cannot allocate part mempool";
+		r = -ENOMEM;
+		goto bad;
+	}
+
 	v->vec_mempool = mempool_create_kmalloc_pool(DM_VERITY_MEMPOOL_SIZE,
 					BIO_MAX_PAGES * sizeof(struct bio_vec));
 	if (!v->vec_mempool) {
@@ -875,7 +1130,7 @@ bad:
 
 static struct target_type verity_target = {
 	.name		= "verity",
-	.version	= {1, 0, 0},
+	.version	= {1, 1, 0},
 	.module		= THIS_MODULE,
 	.ctr		= verity_ctr,
 	.dtr		= verity_dtr,
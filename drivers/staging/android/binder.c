@@ -19,12 +19,14 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/nsproxy.h>
+#include <linux/percpu.h>
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
@@ -33,6 +35,7 @@
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 #include <linux/slab.h>
+#include <linux/uio.h>
 
 #include "binder.h"
 
@@ -103,6 +106,13 @@ static uint32_t binder_debug_mask = BINDER_DEBUG_USER_ERROR |
 	BINDER_DEBUG_FAILED_TRANSACTION | BINDER_DEBUG_DEAD_TRANSACTION;
 module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 
+static unsigned int binder_page_cache_max = 16;
+module_param_named(page_cache_max, binder_page_cache_max,
+		   uint, S_IWUSR | S_IRUGO);
+
+static bool binder_inherit_rt = 1;
+module_param_named(inherit_rt, binder_inherit_rt, bool, S_IWUSR | S_IRUGO);
+
 static bool binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
@@ -148,7 +158,7 @@ enum binder_stat_types {
 
 struct binder_stats {
 	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	int bc[_IOC_NR(BC_REPLY_SG) + 1];
 	int obj_created[BINDER_STAT_COUNT];
 	int obj_deleted[BINDER_STAT_COUNT];
 };
@@ -199,6 +209,33 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 	return e;
 }
 
+/*
+ * Latency histograms, in power of two microsecond buckets: bucket 0 counts
+ * samples under 1us, bucket i samples in [2^(i-1), 2^i) us and the last
+ * bucket everything above.
+ */
+enum binder_latency_types {
+	BINDER_LATENCY_QUEUE_WAIT,	/* enqueued until taken by a thread */
+	BINDER_LATENCY_WAKEUP,		/* enqueued until sleeping thread ran */
+	BINDER_LATENCY_REPLY,		/* transaction sent until reply sent */
+	BINDER_LATENCY_COUNT
+};
+
+#define BINDER_LATENCY_BUCKETS 16
+
+struct binder_latency_stats {
+	u32 hist[BINDER_LATENCY_COUNT][BINDER_LATENCY_BUCKETS];
+};
+
+/*
+ * Scheduling policy and priority of a task, with prio in the scheduler's
+ * internal scale (0..MAX_RT_PRIO-1 for real-time, above that for nice).
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
 struct binder_work {
 	struct list_head entry;
 	enum {
@@ -233,6 +270,7 @@ struct binder_node {
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
+	struct binder_latency_stats *latency;	/* allocated on first use */
 };
 
 struct binder_ref_death {
@@ -274,6 +312,11 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+struct binder_lru_page {
+	struct list_head lru;	/* on proc->page_cache while unused */
+	struct page *page;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -296,12 +339,24 @@ struct binder_proc {
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	/*
+	 * alloc_lock protects the buffer allocator (buffers, free_buffers,
+	 * allocated_buffers, free_async_space and pages) so that senders can
+	 * allocate and fill a buffer in this process without holding
+	 * binder_lock.  It nests inside binder_lock.
+	 */
+	struct mutex alloc_lock;
 	struct list_head buffers;
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
+	struct list_head page_cache;
+	int page_cache_count;
+	unsigned long page_cache_hits;
+	unsigned long page_cache_misses;
+	unsigned long page_cache_evicted;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -312,8 +367,12 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	struct list_head waiting_threads;
+	struct binder_priority default_priority;
 	struct dentry *debugfs_entry;
+	struct binder_latency_stats __percpu *latency;
+	atomic_t tmp_ref;
+	int is_dead;
 };
 
 enum {
@@ -329,6 +388,8 @@ struct binder_thread {
 	struct binder_proc *proc;
 	struct rb_node rb_node;
 	int pid;
+	struct task_struct *task;	/* only valid while on waiting_threads */
+	struct list_head waiting_thread_node;
 	int looper;
 	struct binder_transaction *transaction_stack;
 	struct list_head todo;
@@ -349,16 +410,21 @@ struct binder_transaction {
 	struct binder_thread *to_thread;
 	struct binder_transaction *to_parent;
 	unsigned need_reply:1;
+	unsigned set_priority_called:1;
 	/* unsigned is_dead:1; */	/* not used at the moment */
 
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	u64	enqueue_ns;
 };
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
@@ -499,21 +565,142 @@ out_unlock:
 	return -EBADF;
 }
 
-static void binder_set_nice(long nice)
+static u64 binder_clock(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static void binder_latency_add(struct binder_proc *proc,
+			       struct binder_node *node,
+			       enum binder_latency_types type, u64 delta_ns)
+{
+	u64 us = div_u64(delta_ns, NSEC_PER_USEC);
+	int bucket;
+
+	bucket = us > UINT_MAX ? BINDER_LATENCY_BUCKETS - 1 : fls(us);
+	if (bucket >= BINDER_LATENCY_BUCKETS)
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+
+	if (proc)
+		this_cpu_inc(proc->latency->hist[type][bucket]);
+	if (node) {
+		if (node->latency == NULL)
+			node->latency = kzalloc(sizeof(*node->latency),
+						GFP_KERNEL);
+		if (node->latency)
+			node->latency->hist[type][bucket]++;
+	}
+}
+
+static void binder_free_node(struct binder_node *node)
+{
+	kfree(node->latency);
+	kfree(node);
+}
+
+static inline int binder_nice_to_prio(long nice)
+{
+	return MAX_RT_PRIO + 20 + nice;
+}
+
+static inline long binder_prio_to_nice(int prio)
+{
+	return prio - MAX_RT_PRIO - 20;
+}
+
+static inline bool binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static struct binder_priority binder_get_priority(struct task_struct *task)
+{
+	struct binder_priority p;
+
+	p.sched_policy = task->policy;
+	p.prio = task->normal_prio;
+	return p;
+}
+
+static bool binder_can_nice(struct task_struct *task, long nice)
+{
+	if (task == current)
+		return can_nice(task, nice);
+	return 20 - nice <= task_rlimit(task, RLIMIT_NICE) ||
+		has_capability_noaudit(task, CAP_SYS_NICE);
+}
+
+static void binder_set_nice(struct task_struct *task, long nice)
 {
 	long min_nice;
-	if (can_nice(current, nice)) {
-		set_user_nice(current, nice);
+	if (binder_can_nice(task, nice)) {
+		set_user_nice(task, nice);
 		return;
 	}
-	min_nice = 20 - current->signal->rlim[RLIMIT_NICE].rlim_cur;
+	min_nice = 20 - task_rlimit(task, RLIMIT_NICE);
 	binder_debug(BINDER_DEBUG_PRIORITY_CAP,
 		     "binder: %d: nice value %ld not allowed use "
-		     "%ld instead\n", current->pid, nice, min_nice);
-	set_user_nice(current, min_nice);
+		     "%ld instead\n", task->pid, nice, min_nice);
+	set_user_nice(task, min_nice);
 	if (min_nice < 20)
 		return;
-	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
+	binder_user_error("binder: %d RLIMIT_NICE not set\n", task->pid);
+}
+
+static void binder_set_priority(struct task_struct *task,
+				struct binder_priority desired)
+{
+	struct sched_param params;
+
+	if (binder_is_rt_policy(desired.sched_policy)) {
+		if (task->policy == desired.sched_policy &&
+		    task->normal_prio == desired.prio)
+			return;
+		params.sched_priority = MAX_RT_PRIO - 1 - desired.prio;
+		sched_setscheduler_nocheck(task, desired.sched_policy, &params);
+		return;
+	}
+	if (binder_is_rt_policy(task->policy)) {
+		params.sched_priority = 0;
+		sched_setscheduler_nocheck(task, desired.sched_policy, &params);
+	}
+	binder_set_nice(task, binder_prio_to_nice(desired.prio));
+}
+
+/*
+ * Run task at the priority t should be served with: the caller's policy
+ * and priority for synchronous transactions, raised to the node's
+ * min_priority if that is higher.  The task's own priority is saved so
+ * the reply can restore it.  This is done at most once per transaction,
+ * either when a waiting thread is picked for t or when t is dequeued.
+ */
+static void binder_transaction_priority(struct task_struct *task,
+					struct binder_transaction *t,
+					struct binder_node *node)
+{
+	struct binder_priority desired;
+
+	if (t->set_priority_called)
+		return;
+	t->set_priority_called = 1;
+	t->saved_priority = binder_get_priority(task);
+
+	if (t->flags & TF_ONE_WAY) {
+		desired = t->saved_priority;
+	} else {
+		desired = t->priority;
+		if (binder_is_rt_policy(desired.sched_policy) &&
+		    !binder_inherit_rt) {
+			desired.sched_policy = SCHED_NORMAL;
+			desired.prio = binder_nice_to_prio(0);
+		}
+	}
+	if (!binder_is_rt_policy(desired.sched_policy) &&
+	    binder_nice_to_prio(node->min_priority) < desired.prio) {
+		desired.sched_policy = SCHED_NORMAL;
+		desired.prio = binder_nice_to_prio(node->min_priority);
+	}
+	binder_set_priority(task, desired);
 }
 
 static size_t binder_buffer_size(struct binder_proc *proc,
@@ -587,13 +774,15 @@ static void binder_insert_allocated_buffer(struct binder_proc *proc,
 static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 						  void __user *user_ptr)
 {
-	struct rb_node *n = proc->allocated_buffers.rb_node;
+	struct rb_node *n;
 	struct binder_buffer *buffer;
 	struct binder_buffer *kern_ptr;
 
 	kern_ptr = user_ptr - proc->user_buffer_offset
 		- offsetof(struct binder_buffer, data);
 
+	mutex_lock(&proc->alloc_lock);
+	n = proc->allocated_buffers.rb_node;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(buffer->free);
@@ -603,9 +792,96 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 		else if (kern_ptr > buffer)
 			n = n->rb_right;
 		else
-			return buffer;
+			break;
 	}
-	return NULL;
+	mutex_unlock(&proc->alloc_lock);
+	return n ? buffer : NULL;
+}
+
+static struct mm_struct *binder_lock_proc_mm(struct binder_proc *proc,
+					     struct vm_area_struct **vma)
+{
+	struct mm_struct *mm;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		down_write(&mm->mmap_sem);
+		*vma = proc->vma;
+		if (*vma && mm != proc->vma_vm_mm) {
+			pr_err("binder: %d: vma mm and task mm mismatch\n",
+				proc->pid);
+			*vma = NULL;
+		}
+	}
+	return mm;
+}
+
+static void binder_unlock_proc_mm(struct mm_struct *mm)
+{
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+}
+
+static void binder_free_page(struct binder_proc *proc,
+			     struct binder_lru_page *lru_page,
+			     struct vm_area_struct *vma)
+{
+	void *page_addr = proc->buffer + (lru_page - proc->pages) * PAGE_SIZE;
+
+	if (vma)
+		zap_page_range(vma, (uintptr_t)page_addr +
+			proc->user_buffer_offset, PAGE_SIZE, NULL);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(lru_page->page);
+	lru_page->page = NULL;
+}
+
+/*
+ * Pages of freed buffers stay mapped in the kernel and in the process and
+ * go on a small per-proc cache, so that the next buffer covering them does
+ * not have to allocate and map pages or take mmap_sem.  Only pages above
+ * page_cache_max are actually released, least recently freed first.
+ */
+static void binder_cache_page_range(struct binder_proc *proc,
+				    void *start, void *end)
+{
+	void *page_addr;
+	struct binder_lru_page *lru_page;
+
+	for (page_addr = end - PAGE_SIZE; page_addr >= start;
+	     page_addr -= PAGE_SIZE) {
+		lru_page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (lru_page->page == NULL)
+			continue;
+		BUG_ON(!list_empty(&lru_page->lru));
+		list_add(&lru_page->lru, &proc->page_cache);
+		proc->page_cache_count++;
+	}
+}
+
+static void binder_trim_page_cache(struct binder_proc *proc,
+				   struct vm_area_struct *vma)
+{
+	struct binder_lru_page *lru_page;
+	struct mm_struct *mm = NULL;
+
+	if (proc->page_cache_count <= binder_page_cache_max)
+		return;
+
+	if (vma == NULL)
+		mm = binder_lock_proc_mm(proc, &vma);
+
+	while (proc->page_cache_count > binder_page_cache_max) {
+		lru_page = list_entry(proc->page_cache.prev,
+				      struct binder_lru_page, lru);
+		list_del_init(&lru_page->lru);
+		proc->page_cache_count--;
+		proc->page_cache_evicted++;
+		binder_free_page(proc, lru_page, vma);
+	}
+	binder_unlock_proc_mm(mm);
 }
 
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
@@ -615,8 +891,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *lru_page;
+	struct mm_struct *mm = NULL;
+	int need_map = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -625,23 +902,27 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
-		mm = get_task_mm(proc->tsk);
+	if (allocate == 0) {
+		binder_cache_page_range(proc, start, end);
+		binder_trim_page_cache(proc, vma);
+		return 0;
+	}
 
-	if (mm) {
-		down_write(&mm->mmap_sem);
-		vma = proc->vma;
-		if (vma && mm != proc->vma_vm_mm) {
-			pr_err("binder: %d: vma mm and task mm mismatch\n",
-				proc->pid);
-			vma = NULL;
-		}
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		lru_page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (lru_page->page) {
+			BUG_ON(list_empty(&lru_page->lru));
+			list_del_init(&lru_page->lru);
+			proc->page_cache_count--;
+			proc->page_cache_hits++;
+		} else
+			need_map = 1;
 	}
+	if (!need_map)
+		return 0;
 
-	if (allocate == 0)
-		goto free_range;
+	if (vma == NULL)
+		mm = binder_lock_proc_mm(proc, &vma);
 
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
@@ -652,18 +933,20 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		int ret;
 		struct page **page_array_ptr;
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		lru_page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO);
-		if (*page == NULL) {
+		if (lru_page->page)
+			continue;
+		lru_page->page = alloc_page(GFP_KERNEL | __GFP_HIGHMEM |
+					    __GFP_ZERO);
+		if (lru_page->page == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &lru_page->page;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -673,7 +956,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, lru_page->page);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -681,39 +964,32 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
+		proc->page_cache_misses++;
 	}
-	if (mm) {
-		up_write(&mm->mmap_sem);
-		mmput(mm);
-	}
+	binder_unlock_proc_mm(mm);
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(lru_page->page);
+	lru_page->page = NULL;
 err_alloc_page_failed:
-		;
-	}
 err_no_vma:
+	/* keep whatever part of the range did get mapped for later */
+	binder_cache_page_range(proc, start, end);
 	if (mm) {
-		up_write(&mm->mmap_sem);
-		mmput(mm);
+		binder_unlock_proc_mm(mm);
+		vma = NULL;
 	}
+	binder_trim_page_cache(proc, vma);
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+						     size_t data_size,
+						     size_t offsets_size,
+						     int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -806,6 +1082,9 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
+	buffer->allow_user_free = 0;
+	buffer->transaction = NULL;
+	buffer->target_node = NULL;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
@@ -817,6 +1096,19 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 is_async);
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -874,8 +1166,8 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void binder_free_buf_locked(struct binder_proc *proc,
+				   struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
@@ -929,6 +1221,20 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	binder_free_buf_locked(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	if (atomic_dec_and_test(&proc->tmp_ref) && proc->is_dead)
+		wake_up_all(&proc->wait);
+}
+
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -1058,7 +1364,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
-			kfree(node);
+			binder_free_node(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
 		}
 	}
@@ -1381,15 +1687,54 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+/*
+ * Gather a scatter-gather payload directly into the target buffer, which
+ * saves the sender the copy it would otherwise need to flatten it.
+ */
+static int binder_copy_iov(void *dst, const struct iovec __user *uiov,
+			   unsigned long iov_count, size_t size)
+{
+	struct iovec iovstack[UIO_FASTIOV];
+	struct iovec *iov = iovstack;
+	unsigned long seg;
+	ssize_t len;
+	int ret;
+
+	len = rw_copy_check_uvector(WRITE, uiov, iov_count,
+				    ARRAY_SIZE(iovstack), iovstack, &iov, 1);
+	if (len < 0) {
+		ret = len;
+		goto out;
+	}
+	if (len != size) {
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = 0;
+	for (seg = 0; seg < iov_count; seg++) {
+		if (copy_from_user(dst, iov[seg].iov_base, iov[seg].iov_len)) {
+			ret = -EFAULT;
+			break;
+		}
+		dst += iov[seg].iov_len;
+	}
+out:
+	if (iov != iovstack)
+		kfree(iov);
+	return ret;
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       const struct binder_transaction_data_sg *sg)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	size_t *offp, *off_end;
 	struct binder_proc *target_proc;
 	struct binder_thread *target_thread = NULL;
+	struct binder_thread *waiter = NULL;
 	struct binder_node *target_node = NULL;
 	struct list_head *target_list;
 	wait_queue_head_t *target_wait;
@@ -1414,7 +1759,7 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_set_priority(current, in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1487,21 +1832,8 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
 		}
 	}
-	if (target_thread) {
-		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1545,36 +1877,108 @@ static void binder_transaction(struct binder_proc *proc,
 		t->from = NULL;
 	t->sender_euid = proc->tsk->cred->euid;
 	t->to_proc = target_proc;
-	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_get_priority(current);
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+
+	/*
+	 * Allocating the target buffer and copying the payload into it are
+	 * the expensive parts of a transaction.  Do them without binder_lock,
+	 * with only the target process pinned, so that transactions between
+	 * unrelated processes are not serialized behind page allocation and
+	 * user copies.
+	 */
+	atomic_inc(&target_proc->tmp_ref);
+	mutex_unlock(&binder_lock);
+
+	return_error = BR_OK;
+	offp = NULL;
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
+	} else {
+		offp = (size_t *)(t->buffer->data +
+				  ALIGN(tr->data_size, sizeof(void *)));
+		if (sg) {
+			if (binder_copy_iov(t->buffer->data, sg->iov,
+					    sg->iov_count, tr->data_size)) {
+				binder_user_error("binder: %d:%d got "
+					"transaction with invalid iovec\n",
+					proc->pid, thread->pid);
+				return_error = BR_FAILED_REPLY;
+			}
+		} else if (copy_from_user(t->buffer->data,
+					  tr->data.ptr.buffer,
+					  tr->data_size)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid data ptr\n", proc->pid, thread->pid);
+			return_error = BR_FAILED_REPLY;
+		}
+		if (return_error == BR_OK &&
+		    copy_from_user(offp, tr->data.ptr.offsets,
+				   tr->offsets_size)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid offsets ptr\n", proc->pid, thread->pid);
+			return_error = BR_FAILED_REPLY;
+		}
+	}
+
+	mutex_lock(&binder_lock);
+	if (target_proc->is_dead) {
+		/* the release dropped every node of target_proc */
+		return_error = BR_DEAD_REPLY;
+		target_node = NULL;
+	}
+	if (t->buffer == NULL) {
+		if (target_node)
+			binder_dec_node(target_node, 1, 0);
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
-
-	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
-
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
+	if (return_error != BR_OK)
 		goto err_copy_data_failed;
+
+	if (reply) {
+		if (in_reply_to->from != target_thread) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target;
+		}
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d got reply transaction "
+				"with bad target transaction stack %d, "
+				"expected %d\n",
+				proc->pid, thread->pid,
+				target_thread->transaction_stack ?
+				target_thread->transaction_stack->debug_id : 0,
+				in_reply_to->debug_id);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			target_thread = NULL;
+			goto err_dead_target;
+		}
+	} else if (!(t->flags & TF_ONE_WAY) && thread->transaction_stack) {
+		struct binder_transaction *tmp;
+
+		tmp = thread->transaction_stack;
+		while (tmp) {
+			if (tmp->from && tmp->from->proc == target_proc)
+				target_thread = tmp->from;
+			tmp = tmp->from_parent;
+		}
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
+	t->to_thread = target_thread;
+	if (target_thread) {
+		e->to_thread = target_thread->pid;
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
 	}
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
@@ -1721,7 +2125,14 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	t->enqueue_ns = binder_clock();
 	if (reply) {
+		u64 turnaround_ns = t->enqueue_ns - in_reply_to->enqueue_ns;
+
+		binder_latency_add(proc, in_reply_to->buffer ?
+				   in_reply_to->buffer->target_node : NULL,
+				   BINDER_LATENCY_REPLY, turnaround_ns);
+		trace_binder_transaction_reply(in_reply_to, turnaround_ns);
 		BUG_ON(t->buffer->async_transaction != 0);
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
@@ -1729,6 +2140,22 @@ static void binder_transaction(struct binder_proc *proc,
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
+		if (target_thread == NULL &&
+		    !list_empty(&target_proc->waiting_threads)) {
+			/*
+			 * Hand the work to a specific idle looper and give it
+			 * our priority before it is woken, so an RT caller is
+			 * not left waiting for a CFS thread to get the cpu.
+			 */
+			waiter = list_first_entry(&target_proc->waiting_threads,
+						  struct binder_thread,
+						  waiting_thread_node);
+			list_del_init(&waiter->waiting_thread_node);
+			binder_transaction_priority(waiter->task, t,
+						    target_node);
+			target_list = &waiter->todo;
+			target_wait = NULL;
+		}
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
@@ -1738,12 +2165,16 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
+	trace_binder_transaction(reply, t, target_node);
 	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
+	if (waiter)
+		wake_up_process(waiter->task);
+	else if (target_wait)
 		wake_up_interruptible(target_wait);
+	binder_proc_dec_tmpref(target_proc);
 	return;
 
 err_get_unused_fd_failed:
@@ -1754,11 +2185,13 @@ err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
+err_dead_target:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
 err_binder_alloc_buf_failed:
+	binder_proc_dec_tmpref(target_proc);
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
@@ -1981,7 +2414,20 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY,
+					   NULL);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, &tr);
 			break;
 		}
 
@@ -2187,7 +2633,7 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 static int binder_has_proc_work(struct binder_proc *proc,
 				struct binder_thread *thread)
 {
-	return !list_empty(&proc->todo) ||
+	return !list_empty(&proc->todo) || !list_empty(&thread->todo) ||
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
 }
 
@@ -2197,6 +2643,38 @@ static int binder_has_thread_work(struct binder_thread *thread)
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
 }
 
+/*
+ * Give transactions a sender handed to @thread while it was waiting back
+ * to the process, because the thread is leaving without reading them:
+ * it took a signal or is going away.  They go to the head of proc->todo
+ * for another looper, which is boosted again when it picks them up, and
+ * the thread itself drops the priority it was boosted to.
+ */
+static void binder_requeue_handoff(struct binder_proc *proc,
+				   struct binder_thread *thread)
+{
+	struct binder_work *w, *tmp;
+	struct binder_transaction *t;
+	int requeued = 0;
+
+	list_for_each_entry_safe_reverse(w, tmp, &thread->todo, entry) {
+		if (w->type != BINDER_WORK_TRANSACTION)
+			continue;
+		t = container_of(w, struct binder_transaction, work);
+		if (t->to_thread)
+			continue;
+		if (t->set_priority_called) {
+			if (thread->pid == current->pid)
+				binder_set_priority(current, t->saved_priority);
+			t->set_priority_called = 0;
+		}
+		list_move(&w->entry, &proc->todo);
+		requeued = 1;
+	}
+	if (requeued)
+		wake_up_interruptible(&proc->wait);
+}
+
 static int binder_thread_read(struct binder_proc *proc,
 			      struct binder_thread *thread,
 			      void  __user *buffer, int size,
@@ -2207,6 +2685,7 @@ static int binder_thread_read(struct binder_proc *proc,
 
 	int ret = 0;
 	int wait_for_proc_work;
+	u64 wait_start_ns, resumed_ns;
 
 	if (*consumed == 0) {
 		if (put_user(BR_NOOP, (uint32_t __user *)ptr))
@@ -2235,9 +2714,22 @@ retry:
 	}
 
 
+	trace_binder_wait_for_work(wait_for_proc_work,
+				   !!thread->transaction_stack,
+				   !list_empty(&thread->todo));
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
-	if (wait_for_proc_work)
+	if (wait_for_proc_work) {
 		proc->ready_threads++;
+		/*
+		 * Drop back to the default priority before becoming visible
+		 * on waiting_threads, a sender may boost us from then on.
+		 */
+		binder_set_priority(current, proc->default_priority);
+		if (!non_block)
+			list_add_tail(&thread->waiting_thread_node,
+				      &proc->waiting_threads);
+	}
+	wait_start_ns = binder_clock();
 	mutex_unlock(&binder_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
@@ -2249,7 +2741,6 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2262,13 +2753,19 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
+	resumed_ns = binder_clock();
 	mutex_lock(&binder_lock);
-	if (wait_for_proc_work)
+	if (wait_for_proc_work) {
 		proc->ready_threads--;
+		list_del_init(&thread->waiting_thread_node);
+	}
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
 
-	if (ret)
+	if (ret) {
+		if (wait_for_proc_work)
+			binder_requeue_handoff(proc, thread);
 		return ret;
+	}
 
 	while (1) {
 		uint32_t cmd;
@@ -2358,7 +2855,7 @@ retry:
 						     proc->pid, thread->pid, node->debug_id,
 						     node->ptr, node->cookie);
 					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
+					binder_free_node(node);
 					binder_stats_deleted(BINDER_STAT_NODE);
 				} else {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
@@ -2408,17 +2905,24 @@ retry:
 			continue;
 
 		BUG_ON(t->buffer == NULL);
+		{
+			u64 queue_ns = binder_clock() - t->enqueue_ns;
+
+			binder_latency_add(proc, t->buffer->target_node,
+					   BINDER_LATENCY_QUEUE_WAIT, queue_ns);
+			/* only work that arrived while we slept measures wakeup */
+			if (t->enqueue_ns > wait_start_ns &&
+			    resumed_ns >= t->enqueue_ns)
+				binder_latency_add(proc, t->buffer->target_node,
+						   BINDER_LATENCY_WAKEUP,
+						   resumed_ns - t->enqueue_ns);
+			trace_binder_transaction_received(t, queue_ns);
+		}
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			binder_transaction_priority(current, t, target_node);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2478,6 +2982,13 @@ retry:
 		break;
 	}
 
+	/*
+	 * A looper that was handed work directly may also have taken the
+	 * wakeup meant for proc->todo, pass it on.
+	 */
+	if (wait_for_proc_work && !list_empty(&proc->todo))
+		wake_up_interruptible(&proc->wait);
+
 done:
 
 	*consumed = ptr - buffer;
@@ -2569,6 +3080,8 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
 		thread->pid = current->pid;
+		thread->task = current;
+		INIT_LIST_HEAD(&thread->waiting_thread_node);
 		init_waitqueue_head(&thread->wait);
 		INIT_LIST_HEAD(&thread->todo);
 		rb_link_node(&thread->rb_node, parent, p);
@@ -2615,6 +3128,7 @@ static int binder_free_thread(struct binder_proc *proc,
 	}
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
+	binder_requeue_handoff(proc, thread);
 	binder_release_work(&thread->todo);
 	kfree(thread);
 	binder_stats_deleted(BINDER_STAT_THREAD);
@@ -2699,6 +3213,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		if (bwr.read_size > 0) {
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
+			trace_binder_read_done(ret);
 			if (!list_empty(&proc->todo))
 				wake_up_interruptible(&proc->wait);
 			if (ret < 0) {
@@ -2811,7 +3326,7 @@ static struct vm_operations_struct binder_vm_ops = {
 
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	int ret;
+	int ret, i;
 	struct vm_struct *area;
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
@@ -2865,6 +3380,8 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++)
+		INIT_LIST_HEAD(&proc->pages[i].lru);
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2915,11 +3432,20 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc = kzalloc(sizeof(*proc), GFP_KERNEL);
 	if (proc == NULL)
 		return -ENOMEM;
+	proc->latency = alloc_percpu(struct binder_latency_stats);
+	if (proc->latency == NULL) {
+		kfree(proc);
+		return -ENOMEM;
+	}
 	get_task_struct(current);
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
+	INIT_LIST_HEAD(&proc->waiting_threads);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
+	mutex_init(&proc->alloc_lock);
+	INIT_LIST_HEAD(&proc->page_cache);
+	atomic_set(&proc->tmp_ref, 0);
+	proc->default_priority = binder_get_priority(current);
 	mutex_lock(&binder_lock);
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
@@ -2986,6 +3512,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 	BUG_ON(proc->files);
 
 	hlist_del(&proc->proc_node);
+	proc->is_dead = 1;
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder_release: %d context_mgr_node gone\n",
@@ -3010,7 +3537,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		list_del_init(&node->work.entry);
 		binder_release_work(&node->async_todo);
 		if (hlist_empty(&node->refs)) {
-			kfree(node);
+			binder_free_node(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
 		} else {
 			struct binder_ref *ref;
@@ -3048,6 +3575,17 @@ static void binder_deferred_release(struct binder_proc *proc)
 	}
 	binder_release_work(&proc->todo);
 	binder_release_work(&proc->delivered_death);
+
+	/*
+	 * Senders that looked this process up before it was marked dead may
+	 * still be filling buffers in it without binder_lock.  They free
+	 * their buffer once they see is_dead, so wait for them before tearing
+	 * down the buffer space.
+	 */
+	mutex_unlock(&binder_lock);
+	wait_event(proc->wait, atomic_read(&proc->tmp_ref) == 0);
+	mutex_lock(&binder_lock);
+
 	buffers = 0;
 
 	while ((n = rb_first(&proc->allocated_buffers))) {
@@ -3072,17 +3610,19 @@ static void binder_deferred_release(struct binder_proc *proc)
 	if (proc->pages) {
 		int i;
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
+			if (proc->pages[i].page) {
 				void *page_addr = proc->buffer + i * PAGE_SIZE;
-				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
+				if (list_empty(&proc->pages[i].lru)) {
+					binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+						     "binder_release: %d: "
+						     "page %d at %p not freed\n",
+						     proc->pid, i,
+						     page_addr);
+					page_count++;
+				}
 				unmap_kernel_range((unsigned long)page_addr,
 					PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
+				__free_page(proc->pages[i].page);
 			}
 		}
 		kfree(proc->pages);
@@ -3090,6 +3630,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 	}
 
 	put_task_struct(proc->tsk);
+	free_percpu(proc->latency);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
 		     "binder_release: %d threads %d, nodes %d (ref %d), "
@@ -3159,13 +3700,14 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				     struct binder_transaction *t)
 {
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %u:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3316,9 +3858,11 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	mutex_unlock(&proc->alloc_lock);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3367,7 +3911,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3448,9 +3994,15 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  page cache: %d cached, hits %lu misses %lu "
+		   "evicted %lu\n", proc->page_cache_count,
+		   proc->page_cache_hits, proc->page_cache_misses,
+		   proc->page_cache_evicted);
+	mutex_unlock(&proc->alloc_lock);
 
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
@@ -3496,6 +4048,7 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *proc;
 	struct hlist_node *pos;
+	unsigned long cached = 0, hits = 0, misses = 0, evicted = 0;
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
@@ -3505,6 +4058,15 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 
 	print_binder_stats(m, "", &binder_stats);
 
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		cached += proc->page_cache_count;
+		hits += proc->page_cache_hits;
+		misses += proc->page_cache_misses;
+		evicted += proc->page_cache_evicted;
+	}
+	seq_printf(m, "page cache: %lu cached, hits %lu misses %lu "
+		   "evicted %lu\n", cached, hits, misses, evicted);
+
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
@@ -3529,6 +4091,87 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
+static const char *binder_latency_strings[] = {
+	"queue_wait",
+	"wakeup",
+	"reply"
+};
+
+static void print_binder_latency(struct seq_file *m, const char *prefix,
+				 struct binder_latency_stats *stats)
+{
+	int i, j;
+
+	BUILD_BUG_ON(ARRAY_SIZE(binder_latency_strings) !=
+		     BINDER_LATENCY_COUNT);
+	for (i = 0; i < BINDER_LATENCY_COUNT; i++) {
+		int printed = 0;
+
+		for (j = 0; j < BINDER_LATENCY_BUCKETS; j++) {
+			if (!stats->hist[i][j])
+				continue;
+			if (!printed)
+				seq_printf(m, "%s%s:", prefix,
+					   binder_latency_strings[i]);
+			printed = 1;
+			if (j == BINDER_LATENCY_BUCKETS - 1)
+				seq_printf(m, " >=%uus:%u", 1U << (j - 1),
+					   stats->hist[i][j]);
+			else
+				seq_printf(m, " <%uus:%u", 1U << j,
+					   stats->hist[i][j]);
+		}
+		if (printed)
+			seq_puts(m, "\n");
+	}
+}
+
+static void print_binder_proc_latency(struct seq_file *m,
+				      struct binder_proc *proc)
+{
+	struct binder_latency_stats sum;
+	struct rb_node *n;
+	int cpu, i, j;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		struct binder_latency_stats *s = per_cpu_ptr(proc->latency, cpu);
+
+		for (i = 0; i < BINDER_LATENCY_COUNT; i++)
+			for (j = 0; j < BINDER_LATENCY_BUCKETS; j++)
+				sum.hist[i][j] += s->hist[i][j];
+	}
+	seq_printf(m, "proc %d\n", proc->pid);
+	print_binder_latency(m, "  ", &sum);
+	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+		struct binder_node *node = rb_entry(n, struct binder_node,
+						    rb_node);
+
+		if (node->latency == NULL)
+			continue;
+		seq_printf(m, "  node %d: u%p c%p\n", node->debug_id,
+			   node->ptr, node->cookie);
+		print_binder_latency(m, "    ", node->latency);
+	}
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int do_lock = !binder_debug_no_lock;
+
+	if (do_lock)
+		mutex_lock(&binder_lock);
+
+	seq_puts(m, "binder latency:\n");
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+		print_binder_proc_latency(m, proc);
+	if (do_lock)
+		mutex_unlock(&binder_lock);
+	return 0;
+}
+
 static int binder_proc_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *proc = m->private;
@@ -3588,6 +4231,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init binder_init(void)
 {
@@ -3628,6 +4272,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	}
 	return ret;
 }
@@ -147,6 +147,20 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * Used with BC_TRANSACTION_SG and BC_REPLY_SG.  The payload is gathered
+ * straight from the iov_count struct iovec entries at iov into the
+ * target's buffer instead of from transaction_data.data.ptr.buffer, so a
+ * sender never has to flatten a large payload before sending it.  The
+ * iovec lengths must add up to transaction_data.data_size; offsets are
+ * relative to the start of the gathered data.
+ */
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	const void	*iov;
+	size_t		iov_count;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +338,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with its payload
+	 * scattered over user iovecs.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
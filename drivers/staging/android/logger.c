@@ -24,7 +24,9 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
+#include <linux/timer.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,16 +35,25 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers never sleep holding a lock: under the spinlock 'lock' they only
+ * reserve room for their entry by advancing w_off and write its header,
+ * then copy the payload from userspace with no lock held.  Entries become
+ * visible to readers in reservation order once every earlier reservation
+ * has been copied, c_off marks that point.  The mutex 'mutex' only
+ * serializes readers and their ioctls against each other.
  */
 struct logger_log {
 	unsigned char		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
-	wait_queue_head_t	wq;	/* wait queue for readers */
+	wait_queue_head_t	commit_wq; /* writers waiting for room */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	struct list_head	pending; /* reservations not yet committed */
+	struct mutex		mutex;	/* mutex serializing readers */
+	spinlock_t		lock;	/* protects offsets, readers, pending */
 	size_t			w_off;	/* current write head offset */
+	size_t			c_off;	/* readers may read up to here */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
@@ -51,16 +62,36 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. r_off, r_lapped and the wakeup threshold are
+ * protected by log->lock, the rest by log->mutex.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
+	wait_queue_head_t	wq;	/* wait queue for this reader */
+	struct timer_list	r_timer; /* bounds the wakeup delay */
 	size_t			r_off;	/* current read head offset */
+	size_t			r_wake_bytes; /* wake when this much unread */
+	unsigned long		r_wake_timeout; /* ...or after this (jiffies) */
+	bool			r_expired; /* r_timer fired since last read */
+	bool			r_lapped; /* a writer moved r_off */
 	bool			r_all;	/* reader can read all entries */
+	bool			r_batch; /* read as many entries as fit */
 	int			r_ver;	/* reader ABI version */
 };
 
+/*
+ * struct logger_reservation - a writer's claim on [off, end) of the log
+ *
+ * Lives on the writer's stack while it copies in its payload.
+ */
+struct logger_reservation {
+	struct list_head	list;	/* entry in logger_log's pending list */
+	size_t			off;	/* start of the entry */
+	size_t			end;	/* offset just past the entry */
+	bool			done;	/* payload copied, entry readable */
+};
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 size_t logger_offset(struct logger_log *log, size_t n)
 {
@@ -120,7 +151,7 @@ static struct logger_entry *get_entry_header(struct logger_log *log,
  * In the log, the length does not include the size of the log entry structure.
  * This function returns the size including the log entry structure.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
 {
@@ -164,18 +195,19 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - reads exactly 'count' bytes of the entry at 'off',
+ * whose header is 'entry', from 'log' into the user-space buffer 'buf'.
+ * Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Called without log->lock, so a writer may overwrite the entry while it
+ * is copied; the caller must check reader->r_lapped afterwards.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
+				   size_t off, struct logger_entry *entry,
 				   char __user *buf,
 				   size_t count)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
 	size_t len;
 	size_t msg_start;
 
@@ -183,14 +215,12 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
 	count -= get_user_hdr_len(reader->r_ver);
 	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(log,
-		reader->r_off + sizeof(struct logger_entry));
+	msg_start = logger_offset(log, off + sizeof(struct logger_entry));
 
 	/*
 	 * We read from the msg in two disjoint operations. First, we read from
@@ -209,20 +239,19 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
-
 	return count + get_user_hdr_len(reader->r_ver);
 }
 
 /*
  * get_next_entry_by_uid - Starting at 'off', returns an offset into
  * 'log->buffer' which contains the first entry readable by 'euid'
+ *
+ * Caller needs to hold log->lock.
  */
 static size_t get_next_entry_by_uid(struct logger_log *log,
 		size_t off, uid_t euid)
 {
-	while (off != log->w_off) {
+	while (off != log->c_off) {
 		struct logger_entry *entry;
 		struct logger_entry scratch;
 		size_t next_len;
@@ -239,6 +268,44 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
 	return off;
 }
 
+/*
+ * logger_reader_ready - should 'reader' be woken for the unread part of
+ * the log?
+ *
+ * Caller needs to hold log->lock.
+ */
+static bool logger_reader_ready(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	size_t avail = logger_offset(log, log->c_off - reader->r_off);
+
+	return avail && (avail >= reader->r_wake_bytes || reader->r_expired);
+}
+
+/*
+ * logger_wake_reader - wakes 'reader' if it is ready, otherwise makes
+ * sure its timer will wake it if it has anything unread at all.
+ *
+ * Caller needs to hold log->lock.
+ */
+static void logger_wake_reader(struct logger_log *log,
+			       struct logger_reader *reader)
+{
+	if (logger_reader_ready(log, reader))
+		wake_up_interruptible(&reader->wq);
+	else if (log->c_off != reader->r_off && reader->r_wake_timeout &&
+		 !timer_pending(&reader->r_timer))
+		mod_timer(&reader->r_timer, jiffies + reader->r_wake_timeout);
+}
+
+static void logger_reader_timeout(unsigned long data)
+{
+	struct logger_reader *reader = (struct logger_reader *) data;
+
+	reader->r_expired = true;
+	wake_up_interruptible(&reader->wq);
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -246,7 +313,9 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  *
  *	- O_NONBLOCK works
  *	- If there are no log entries to read, blocks until log is written to
- *	- Atomically reads exactly one log entry
+ *	  and the reader's wakeup threshold is met
+ *	- Atomically reads exactly one log entry, or in LOGGER_READ_BATCH mode
+ *	  as many whole entries as fit in the buffer
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -256,17 +325,22 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
-	ssize_t ret;
+	struct logger_entry scratch, entry;
+	size_t off, len;
+	ssize_t ret, done;
 	DEFINE_WAIT(wait);
 
 start:
 	while (1) {
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 
-		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
+		prepare_to_wait(&reader->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		if (file->f_flags & O_NONBLOCK)
+			ret = (log->c_off == reader->r_off);
+		else
+			ret = !logger_reader_ready(log, reader);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -283,44 +357,82 @@ start:
 		schedule();
 	}
 
-	finish_wait(&log->wq, &wait);
+	finish_wait(&reader->wq, &wait);
 	if (ret)
 		return ret;
 
 	mutex_lock(&log->mutex);
+	done = 0;
 
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+	do {
+		spin_lock(&log->lock);
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
+		if (!reader->r_all)
+			reader->r_off = get_next_entry_by_uid(log,
+				reader->r_off, current_euid());
 
-	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
+		/* is there still something to read or did we race? */
+		if (unlikely(log->c_off == reader->r_off)) {
+			spin_unlock(&log->lock);
+			break;
+		}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+		off = reader->r_off;
+		entry = *get_entry_header(log, off, &scratch);
+		reader->r_lapped = false;
+		spin_unlock(&log->lock);
+
+		/* get the size of the next entry */
+		len = get_user_hdr_len(reader->r_ver) + entry.len;
+		if (count - done < len) {
+			if (!done)
+				done = -EINVAL;
+			break;
+		}
+
+		/* get exactly one entry from the log */
+		ret = do_read_log_to_user(log, reader, off, &entry,
+					  buf + done, len);
+		if (ret < 0) {
+			if (!done)
+				done = ret;
+			break;
+		}
+
+		spin_lock(&log->lock);
+		if (unlikely(reader->r_lapped)) {
+			/* a writer overwrote the entry while we copied it */
+			spin_unlock(&log->lock);
+			break;
+		}
+		reader->r_off = logger_offset(log, off +
+			sizeof(struct logger_entry) + entry.len);
+		spin_unlock(&log->lock);
+
+		done += ret;
+	} while (reader->r_batch);
+
+	if (done > 0) {
+		spin_lock(&log->lock);
+		reader->r_expired = false;
+		logger_wake_reader(log, reader);
+		spin_unlock(&log->lock);
+	}
 
-out:
 	mutex_unlock(&log->mutex);
 
-	return ret;
+	/* nothing was read, because we raced with another reader or writer */
+	if (!done)
+		goto start;
+
+	return done;
 }
 
 /*
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -369,9 +481,10 @@ static inline int is_between(size_t a, size_t b, size_t c)
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * entry after the new write head.  A reader moved this way is marked as
+ * lapped, as it may be copying out the entry being overwritten.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -383,61 +496,159 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 		log->head = get_next_entry(log, log->head, len);
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
+		if (is_between(old, new, reader->r_off)) {
 			reader->r_off = get_next_entry(log, reader->r_off, len);
+			reader->r_lapped = true;
+		}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * logger_can_reserve - can 'len' more bytes be reserved without
+ * overwriting an entry that is still being copied in?
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
+ */
+static bool logger_can_reserve(struct logger_log *log, size_t len)
+{
+	struct logger_reservation *oldest;
+	size_t busy;
+
+	if (list_empty(&log->pending))
+		return true;
+
+	oldest = list_first_entry(&log->pending, struct logger_reservation,
+				  list);
+	busy = logger_offset(log, log->w_off - oldest->off);
+	return busy + len < log->size;
+}
+
+static bool logger_can_reserve_unlocked(struct logger_log *log, size_t len)
+{
+	bool ret;
+
+	spin_lock(&log->lock);
+	ret = logger_can_reserve(log, len);
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
+/*
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at offset 'off'
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log, log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * to the log 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * Called without log->lock, on a range reserved by the caller.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
 			return -EFAULT;
 
-	log->w_off = logger_offset(log, log->w_off + count);
-
 	return count;
 }
 
+/*
+ * logger_reserve - claims room for an entry of 'len' bytes and writes its
+ * 'header', waiting if the room is still being filled by an earlier writer
+ * that has been lapped.
+ */
+static void logger_reserve(struct logger_log *log,
+			   struct logger_reservation *res,
+			   struct logger_entry *header, size_t len)
+{
+	spin_lock(&log->lock);
+	while (unlikely(!logger_can_reserve(log, len))) {
+		spin_unlock(&log->lock);
+		wait_event(log->commit_wq, logger_can_reserve_unlocked(log, len));
+		spin_lock(&log->lock);
+	}
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset.
+	 */
+	fix_up_readers(log, len);
+
+	res->off = log->w_off;
+	res->end = logger_offset(log, log->w_off + len);
+	res->done = false;
+	do_write_log(log, res->off, header, sizeof(struct logger_entry));
+	log->w_off = res->end;
+	list_add_tail(&res->list, &log->pending);
+	spin_unlock(&log->lock);
+}
+
+/*
+ * logger_commit - marks the entry reserved by 'res' as complete and makes
+ * every leading complete entry readable.  If the payload could not be
+ * copied and nothing was reserved after it, the entry is abandoned;
+ * otherwise the entry must stay in place and is published with the
+ * payload already cleared by the caller.
+ */
+static void logger_commit(struct logger_log *log,
+			  struct logger_reservation *res, bool failed)
+{
+	struct logger_reservation *oldest;
+	size_t old_c_off;
+
+	spin_lock(&log->lock);
+	old_c_off = log->c_off;
+	if (failed && log->w_off == res->end &&
+	    list_is_last(&res->list, &log->pending)) {
+		log->w_off = res->off;
+		list_del(&res->list);
+	} else
+		res->done = true;
+
+	while (!list_empty(&log->pending)) {
+		oldest = list_first_entry(&log->pending,
+					  struct logger_reservation, list);
+		if (!oldest->done)
+			break;
+		log->c_off = oldest->end;
+		list_del(&oldest->list);
+	}
+	if (list_empty(&log->pending))
+		log->c_off = log->w_off;
+
+	/* wake up any blocked readers whose threshold is now met */
+	if (log->c_off != old_c_off) {
+		struct logger_reader *reader;
+
+		list_for_each_entry(reader, &log->readers, list)
+			logger_wake_reader(log, reader);
+	}
+	spin_unlock(&log->lock);
+
+	if (waitqueue_active(&log->commit_wq))
+		wake_up(&log->commit_wq);
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -447,9 +658,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	struct logger_reservation res;
 	struct logger_entry header;
 	struct timespec now;
+	size_t off;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -466,17 +678,9 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	logger_reserve(log, &res, &header,
+		       sizeof(struct logger_entry) + header.len);
+	off = logger_offset(log, res.off + sizeof(struct logger_entry));
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -486,21 +690,27 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
+			/*
+			 * Do not let readers see a partial message: either
+			 * the entry is dropped or its payload is blanked.
+			 */
+			off = logger_offset(log, res.off +
+					    sizeof(struct logger_entry));
+			len = min_t(size_t, header.len, log->size - off);
+			memset(log->buffer + off, 0, len);
+			memset(log->buffer, 0, header.len - len);
+			logger_commit(log, &res, true);
 			return nr;
 		}
 
 		iov++;
 		ret += nr;
+		off = logger_offset(log, off + nr);
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_commit(log, &res, false);
 
 	return ret;
 }
@@ -534,15 +744,23 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->r_batch = false;
+		reader->r_wake_bytes = 0;
+		reader->r_wake_timeout = 0;
+		reader->r_expired = false;
+		init_waitqueue_head(&reader->wq);
+		setup_timer(&reader->r_timer, logger_reader_timeout,
+			    (unsigned long) reader);
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		reader->r_lapped = false;
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -562,9 +780,10 @@ static int logger_release(struct inode *ignored, struct file *file)
 		struct logger_reader *reader = file->private_data;
 		struct logger_log *log = reader->log;
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
+		del_timer_sync(&reader->r_timer);
 
 		kfree(reader);
 	}
@@ -593,16 +812,16 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	reader = file->private_data;
 	log = reader->log;
 
-	poll_wait(file, &log->wq, wait);
+	poll_wait(file, &reader->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
 
-	if (log->w_off != reader->r_off)
+	if (logger_reader_ready(log, reader))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -620,6 +839,42 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+static long logger_set_read_mode(struct logger_reader *reader,
+				 void __user *arg)
+{
+	int mode;
+	if (copy_from_user(&mode, arg, sizeof(int)))
+		return -EFAULT;
+
+	if (mode != LOGGER_READ_SINGLE && mode != LOGGER_READ_BATCH)
+		return -EINVAL;
+
+	reader->r_batch = (mode == LOGGER_READ_BATCH);
+	return 0;
+}
+
+static long logger_set_wakeup(struct logger_reader *reader, void __user *arg)
+{
+	struct logger_log *log = reader->log;
+	struct logger_wakeup wakeup;
+
+	if (copy_from_user(&wakeup, arg, sizeof(wakeup)))
+		return -EFAULT;
+
+	/* a threshold the log can never reach would never wake the reader */
+	if (wakeup.bytes > log->size / 2)
+		return -EINVAL;
+
+	spin_lock(&log->lock);
+	reader->r_wake_bytes = wakeup.bytes;
+	reader->r_wake_timeout = wakeup.timeout_ms ?
+		msecs_to_jiffies(wakeup.timeout_ms) : 0;
+	logger_wake_reader(log, reader);
+	spin_unlock(&log->lock);
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
@@ -639,10 +894,12 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		spin_lock(&log->lock);
+		if (log->c_off >= reader->r_off)
+			ret = log->c_off - reader->r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = (log->size - reader->r_off) + log->c_off;
+		spin_unlock(&log->lock);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -651,24 +908,28 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
+		spin_lock(&log->lock);
 		if (!reader->r_all)
 			reader->r_off = get_next_entry_by_uid(log,
 				reader->r_off, current_euid());
 
-		if (log->w_off != reader->r_off)
+		if (log->c_off != reader->r_off)
 			ret = get_user_hdr_len(reader->r_ver) +
 				get_entry_msg_len(log, reader->r_off);
 		else
 			ret = 0;
+		spin_unlock(&log->lock);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
+		spin_lock(&log->lock);
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = log->c_off;
+		log->head = log->c_off;
+		spin_unlock(&log->lock);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -687,6 +948,22 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_SET_READ_MODE:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = logger_set_read_mode(reader, argp);
+		break;
+	case LOGGER_SET_WAKEUP:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = logger_set_wakeup(reader, argp);
+		break;
 	}
 
 	mutex_unlock(&log->mutex);
@@ -720,10 +997,13 @@ static struct logger_log VAR = { \
 		.fops = &logger_fops, \
 		.parent = NULL, \
 	}, \
-	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
+	.pending = LIST_HEAD_INIT(VAR .pending), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.c_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -51,6 +51,21 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * Argument of LOGGER_SET_WAKEUP.  A reader blocked in read() or poll() is
+ * only woken once at least 'bytes' of log are unread, or 'timeout_ms'
+ * after an entry became available, whichever comes first.  A timeout of
+ * zero means no timeout.
+ */
+struct logger_wakeup {
+	__u32		bytes;		/* unread bytes to wake up at */
+	__u32		timeout_ms;	/* max delay of a wakeup, 0 = none */
+};
+
+/* read modes for LOGGER_SET_READ_MODE */
+#define LOGGER_READ_SINGLE	0	/* one entry per read() */
+#define LOGGER_READ_BATCH	1	/* as many whole entries as fit */
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -66,5 +81,7 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_SET_READ_MODE		_IO(__LOGGERIO, 7) /* entries per read */
+#define LOGGER_SET_WAKEUP		_IO(__LOGGERIO, 8) /* reader wakeups */
 
 #endif /* _LINUX_LOGGER_H */
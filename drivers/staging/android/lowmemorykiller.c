@@ -37,6 +37,8 @@
 #include <linux/sched.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/err.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -62,48 +64,186 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+#ifdef CONFIG_ANDROID_LMK_ADJ_INDEX
+/*
+ * Every thread group leader is kept in the bucket for its oom_score_adj, so
+ * a victim is found by looking at the highest non-empty buckets only instead
+ * of at every process in the system.  The buckets are hlists so the table is
+ * usable before this driver is initialized.  The lock is taken from fork and
+ * exit with tasklist_lock write-locked, hence irqsave.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN + 1)
+
+static struct hlist_head lowmem_adj_index[LOWMEM_ADJ_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static unsigned lowmem_index_seq;
+static struct task_struct *lowmem_deathpending;
+
+static struct hlist_head *lowmem_adj_bucket(int oom_score_adj)
+{
+	return &lowmem_adj_index[oom_score_adj - OOM_SCORE_ADJ_MIN];
+}
+
+void lowmem_task_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	INIT_HLIST_NODE(&p->lowmem_node);
+	if (!thread_group_leader(p))
+		return;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	hlist_add_head(&p->lowmem_node,
+		       lowmem_adj_bucket(p->signal->oom_score_adj));
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+void lowmem_task_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (!hlist_unhashed(&p->lowmem_node)) {
+		hlist_del_init(&p->lowmem_node);
+		lowmem_index_seq++;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+void lowmem_task_update(struct task_struct *p)
+{
+	unsigned long flags;
+
+	p = p->group_leader;
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (!hlist_unhashed(&p->lowmem_node)) {
+		hlist_del(&p->lowmem_node);
+		hlist_add_head(&p->lowmem_node,
+			       lowmem_adj_bucket(p->signal->oom_score_adj));
+		lowmem_index_seq++;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/*
+ * lowmem_select_victim - returns the largest process in the highest
+ * oom_score_adj bucket at or above min_score_adj, NULL if there is none,
+ * or ERR_PTR(-EBUSY) while the previous victim is still dying.
+ *
+ * lowmem_index_lock nests inside siglock (fork, exit) and so inside
+ * task_lock (the oom_score_adj writers), so no task is locked with it
+ * held.  Instead a reference is taken on the current task and the index
+ * lock dropped while its mm is looked at.  If a task left or changed
+ * bucket meanwhile, lowmem_index_seq has moved and the bucket is walked
+ * again from its head.
+ *
+ * Caller must hold rcu_read_lock(), which keeps the victim valid.
+ */
+static struct task_struct *lowmem_select_victim(int min_score_adj,
+						int *selected_tasksize,
+						int *selected_oom_score_adj)
 {
 	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
-	int rem = 0;
+	struct task_struct *dead;
+	struct hlist_node *pos;
+	unsigned long flags;
+	unsigned seq;
+	int oom_score_adj;
 	int tasksize;
-	int i;
-	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_score_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES);
-	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_score_adj = lowmem_adj[i];
-			break;
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	dead = lowmem_deathpending;
+	if (dead)
+		get_task_struct(dead);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	if (dead) {
+		struct task_struct *p = find_lock_task_mm(dead);
+
+		if (p) {
+			task_unlock(p);
+			if (time_before_eq(jiffies,
+					   lowmem_deathpending_timeout)) {
+				put_task_struct(dead);
+				return ERR_PTR(-EBUSY);
+			}
+		}
+		spin_lock_irqsave(&lowmem_index_lock, flags);
+		if (lowmem_deathpending == dead) {
+			lowmem_deathpending = NULL;
+			/* drop the reference lowmem_deathpending held */
+			put_task_struct(dead);
 		}
+		spin_unlock_irqrestore(&lowmem_index_lock, flags);
+		put_task_struct(dead);
 	}
-	if (sc->nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
-				sc->nr_to_scan, sc->gfp_mask, other_free,
-				other_file, min_score_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
-			     sc->nr_to_scan, sc->gfp_mask, rem);
-		return rem;
+
+	for (oom_score_adj = OOM_SCORE_ADJ_MAX;
+	     oom_score_adj >= min_score_adj && !selected; oom_score_adj--) {
+		spin_lock_irqsave(&lowmem_index_lock, flags);
+restart:
+		seq = lowmem_index_seq;
+		pos = lowmem_adj_bucket(oom_score_adj)->first;
+		while (pos) {
+			struct task_struct *p;
+
+			tsk = hlist_entry(pos, struct task_struct, lowmem_node);
+			if (tsk->flags & PF_KTHREAD) {
+				pos = pos->next;
+				continue;
+			}
+			get_task_struct(tsk);
+			spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+			tasksize = 0;
+			p = find_lock_task_mm(tsk);
+			if (p) {
+				tasksize = get_mm_rss(p->mm);
+				task_unlock(p);
+			}
+			if (tasksize > 0 &&
+			    (!selected || tasksize > *selected_tasksize)) {
+				get_task_struct(p);
+				if (selected)
+					put_task_struct(selected);
+				selected = p;
+				*selected_tasksize = tasksize;
+				*selected_oom_score_adj = oom_score_adj;
+				lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+					     p->pid, p->comm, oom_score_adj,
+					     tasksize);
+			}
+
+			spin_lock_irqsave(&lowmem_index_lock, flags);
+			pos = tsk->lowmem_node.next;
+			put_task_struct(tsk);
+			if (seq != lowmem_index_seq)
+				goto restart;
+		}
+		spin_unlock_irqrestore(&lowmem_index_lock, flags);
 	}
-	selected_oom_score_adj = min_score_adj;
 
-	rcu_read_lock();
+	if (selected) {
+		spin_lock_irqsave(&lowmem_index_lock, flags);
+		/* a concurrent shrinker may have picked a victim as well */
+		dead = lowmem_deathpending;
+		lowmem_deathpending = selected;
+		spin_unlock_irqrestore(&lowmem_index_lock, flags);
+		if (dead)
+			put_task_struct(dead);
+	}
+	return selected;
+}
+#else
+static struct task_struct *lowmem_select_victim(int min_score_adj,
+						int *selected_tasksize,
+						int *selected_oom_score_adj)
+{
+	struct task_struct *tsk;
+	struct task_struct *selected = NULL;
+	int tasksize;
+
 	for_each_process(tsk) {
 		struct task_struct *p;
 		int oom_score_adj;
@@ -118,8 +258,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
 		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
 			task_unlock(p);
-			rcu_read_unlock();
-			return 0;
+			return ERR_PTR(-EBUSY);
 		}
 		oom_score_adj = p->signal->oom_score_adj;
 		if (oom_score_adj < min_score_adj) {
@@ -131,18 +270,69 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		if (tasksize <= 0)
 			continue;
 		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
+			if (oom_score_adj < *selected_oom_score_adj)
 				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
+			if (oom_score_adj == *selected_oom_score_adj &&
+			    tasksize <= *selected_tasksize)
 				continue;
 		}
 		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
+		*selected_tasksize = tasksize;
+		*selected_oom_score_adj = oom_score_adj;
 		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
 			     p->pid, p->comm, oom_score_adj, tasksize);
 	}
+	return selected;
+}
+#endif
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct task_struct *selected;
+	int rem = 0;
+	int i;
+	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int selected_tasksize = 0;
+	int selected_oom_score_adj;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i]) {
+			min_score_adj = lowmem_adj[i];
+			break;
+		}
+	}
+	if (sc->nr_to_scan > 0)
+		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
+				sc->nr_to_scan, sc->gfp_mask, other_free,
+				other_file, min_score_adj);
+	rem = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_ACTIVE_FILE) +
+		global_page_state(NR_INACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_FILE);
+	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
+		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
+			     sc->nr_to_scan, sc->gfp_mask, rem);
+		return rem;
+	}
+
+	selected_oom_score_adj = min_score_adj;
+
+	rcu_read_lock();
+	selected = lowmem_select_victim(min_score_adj, &selected_tasksize,
+					&selected_oom_score_adj);
+	if (IS_ERR(selected)) {
+		rcu_read_unlock();
+		return 0;
+	}
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
@@ -63,6 +63,7 @@ MODULE_LICENSE("GPL");
 struct zcache_client {
 	struct tmem_pool *tmem_pools[MAX_POOLS_PER_CLIENT];
 	struct zs_pool *zspool;
+	char zspool_name[16];	/* zsmalloc keeps a pointer to it */
 	bool allocated;
 	atomic_t refcount;
 };
@@ -709,7 +710,7 @@ static struct zv_hdr *zv_create(struct zs_pool *pool, uint32_t pool_id,
 		goto out;
 	atomic_inc(&zv_curr_dist_counts[chunks]);
 	atomic_inc(&zv_cumul_dist_counts[chunks]);
-	zv = zs_map_object(pool, handle);
+	zv = zs_map_object(pool, handle, ZS_MM_WO);
 	zv->index = index;
 	zv->oid = *oid;
 	zv->pool_id = pool_id;
@@ -728,7 +729,7 @@ static void zv_free(struct zs_pool *pool, void *handle)
 	uint16_t size;
 	int chunks;
 
-	zv = zs_map_object(pool, handle);
+	zv = zs_map_object(pool, handle, ZS_MM_RW);
 	ASSERT_SENTINEL(zv, ZVH);
 	size = zv->size + sizeof(struct zv_hdr);
 	INVERT_SENTINEL(zv, ZVH);
@@ -750,7 +751,7 @@ static void zv_decompress(struct page *page, void *handle)
 	int ret;
 	struct zv_hdr *zv;
 
-	zv = zs_map_object(zcache_host.zspool, handle);
+	zv = zs_map_object(zcache_host.zspool, handle, ZS_MM_RO);
 	BUG_ON(zv->size == 0);
 	ASSERT_SENTINEL(zv, ZVH);
 	to_va = kmap_atomic(page);
@@ -984,7 +985,13 @@ int zcache_new_client(uint16_t cli_id)
 		goto out;
 	cli->allocated = 1;
 #ifdef CONFIG_FRONTSWAP
-	cli->zspool = zs_create_pool("zcache", ZCACHE_GFP_MASK);
+	/* pool names must be unique, they name debugfs directories */
+	if (cli_id == LOCAL_CLIENT)
+		strlcpy(cli->zspool_name, "zcache", sizeof(cli->zspool_name));
+	else
+		snprintf(cli->zspool_name, sizeof(cli->zspool_name),
+			 "zcache-%u", cli_id);
+	cli->zspool = zs_create_pool(cli->zspool_name, ZCACHE_GFP_MASK);
 	if (cli->zspool == NULL)
 		goto out;
 #endif
@@ -0,0 +1,165 @@
+/*
+ * Compressed RAM block device: same page deduplication
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/*
+ * Every compressed object is indexed by a checksum of its uncompressed
+ * content. A writer looks the checksum of the new page up before
+ * compressing it; if an object with the same checksum exists, it is
+ * decompressed and compared, and on a match the slot just takes a
+ * reference to it. Only the first object found for a checksum is
+ * tried: a real collision only costs the dedup opportunity.
+ */
+
+u32 zram_dedup_checksum(unsigned char *mem)
+{
+	return jhash2((u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct zram_hash *zram_dedup_hash(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum % zram->hash_size];
+}
+
+void zram_dedup_insert(struct zram *zram, struct zram_entry *entry,
+		       u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram, checksum);
+	struct rb_node **rb_node, *parent = NULL;
+	struct zram_entry *cur;
+
+	entry->checksum = checksum;
+
+	spin_lock(&hash->lock);
+	rb_node = &hash->rb_root.rb_node;
+	while (*rb_node) {
+		parent = *rb_node;
+		cur = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < cur->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+	rb_link_node(&entry->rb_node, parent, rb_node);
+	rb_insert_color(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+}
+
+/*
+ * Decompress @entry into the buffer of @zstrm, which must be held and
+ * not yet in use for compression, and compare it with @mem.
+ */
+static bool zram_dedup_match(struct zram *zram, struct zram_stream *zstrm,
+			     struct zram_entry *entry, unsigned char *mem)
+{
+	unsigned int dlen = PAGE_SIZE;
+	unsigned char *cmem;
+	int ret;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	ret = crypto_comp_decompress(zstrm->tfm, cmem, entry->len,
+				     zstrm->buffer, &dlen);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return !ret && dlen == PAGE_SIZE && !memcmp(mem, zstrm->buffer,
+						    PAGE_SIZE);
+}
+
+/*
+ * Return an existing object holding the same content as @mem, with a
+ * reference taken for the caller, or NULL. The candidate is compared
+ * under the bucket lock so that every reference belongs to a slot.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram,
+				   struct zram_stream *zstrm,
+				   unsigned char *mem, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram, checksum);
+	struct zram_entry *entry = NULL, *cur;
+	struct rb_node *rb_node;
+
+	spin_lock(&hash->lock);
+	rb_node = hash->rb_root.rb_node;
+	while (rb_node) {
+		cur = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (checksum == cur->checksum) {
+			if (zram_dedup_match(zram, zstrm, cur, mem)) {
+				entry = cur;
+				entry->refcount++;
+			}
+			break;
+		}
+		rb_node = checksum < cur->checksum ? rb_node->rb_left :
+						     rb_node->rb_right;
+	}
+	spin_unlock(&hash->lock);
+
+	return entry;
+}
+
+/*
+ * Drop a reference to @entry and return the number left. The caller
+ * frees the object when it was the last one.
+ */
+unsigned long zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram, entry->checksum);
+	unsigned long refcount;
+
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount && !RB_EMPTY_NODE(&entry->rb_node)) {
+		rb_erase(&entry->rb_node, &hash->rb_root);
+		RB_CLEAR_NODE(&entry->rb_node);
+	}
+	spin_unlock(&hash->lock);
+
+	return refcount;
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t i;
+
+	if (!zram->use_dedup)
+		return 0;
+
+	zram->hash_size = max_t(size_t, num_pages >> ZRAM_HASH_SHIFT, 1);
+	zram->hash = vzalloc(zram->hash_size * sizeof(struct zram_hash));
+	if (!zram->hash) {
+		pr_err("Error allocating zram dedup hash\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < zram->hash_size; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		zram->hash[i].rb_root = RB_ROOT;
+	}
+
+	return 0;
+}
+
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+}
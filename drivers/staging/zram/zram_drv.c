@@ -23,13 +23,14 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/percpu.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -42,53 +43,179 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 static unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_lock_table(struct zram *zram, u32 index)
 {
-	*v = *v + 1;
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_unlock_table(struct zram *zram, u32 index)
 {
-	*v = *v - 1;
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+/*
+ * The helpers below must be called with the slot lock held; the
+ * non-atomic updates are safe because the lock bit lives in the same
+ * word and is owned by us.
+ */
+static int zram_test_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
+	return zram->table[index].value & BIT(flag);
 }
 
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+static void zram_set_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	zram->table[index].value |= BIT(flag);
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static void zram_clear_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	zram_stat64_add(zram, v, 1);
+	zram->table[index].value &= ~BIT(flag);
 }
 
-static int zram_test_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static size_t zram_get_obj_size(struct zram *zram, u32 index)
 {
-	return zram->table[index].flags & BIT(flag);
+	return zram->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
 }
 
-static void zram_set_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static void zram_set_obj_size(struct zram *zram, u32 index, size_t size)
 {
-	zram->table[index].flags |= BIT(flag);
+	unsigned long flags = zram->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	zram->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
-static void zram_clear_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static void zram_set_age(struct zram *zram, u32 index, unsigned int age)
+{
+	zram->table[index].value &= ~((unsigned long)ZRAM_AGE_MAX <<
+				      ZRAM_AGE_SHIFT);
+	zram->table[index].value |= (unsigned long)age << ZRAM_AGE_SHIFT;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static unsigned int zram_get_age(struct zram *zram, u32 index)
+{
+	return (zram->table[index].value >> ZRAM_AGE_SHIFT) & ZRAM_AGE_MAX;
+}
+
+static unsigned long zram_wb_alloc_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	do {
+		/* Block 0 stays reserved so that a handle is never NULL */
+		blk = find_next_zero_bit(zram->bitmap, zram->nr_blocks, 1);
+		if (blk >= zram->nr_blocks)
+			return 0;
+	} while (test_and_set_bit(blk, zram->bitmap));
+
+	atomic64_inc(&zram->stats.bd_count);
+	return blk;
+}
+
+static void zram_wb_free_block(struct zram *zram, unsigned long blk)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	clear_bit(blk, zram->bitmap);
+	atomic64_dec(&zram->stats.bd_count);
 }
 
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_wb_rw(struct zram *zram, struct page *page,
+		      unsigned long blk, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_wb_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&done);
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_wb_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk;
+	int ret;
+};
+
+static void zram_wb_read_work(struct work_struct *work)
+{
+	struct zram_wb_work *zw = container_of(work, struct zram_wb_work,
+					       work);
+
+	zw->ret = zram_wb_rw(zw->zram, zw->page, zw->blk, READ);
+}
+
+/*
+ * Read block @blk of the backing device into the PAGE_SIZE buffer @mem.
+ * We are called from our own make_request function, where bios
+ * submitted to another device are only issued once we return, so the
+ * read is done from a worker.
+ */
+static int zram_wb_read(struct zram *zram, unsigned long blk,
+			unsigned char *mem)
+{
+	struct zram_wb_work zw;
+	void *src;
+
+	zw.page = alloc_page(GFP_NOIO);
+	if (!zw.page)
+		return -ENOMEM;
+	zw.zram = zram;
+	zw.blk = blk;
+
+	INIT_WORK_ONSTACK(&zw.work, zram_wb_read_work);
+	queue_work(system_unbound_wq, &zw.work);
+	flush_work(&zw.work);
+	destroy_work_on_stack(&zw.work);
+
+	if (!zw.ret) {
+		src = kmap_atomic(zw.page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+		atomic64_inc(&zram->stats.bd_reads);
+	}
+	__free_page(zw.page);
+
+	return zw.ret;
+}
+#else
+static inline void zram_wb_free_block(struct zram *zram, unsigned long blk)
+{
+}
+
+static inline int zram_wb_read(struct zram *zram, unsigned long blk,
+			       unsigned char *mem)
+{
+	return -EIO;
+}
+#endif
+
 static int page_zero_filled(void *ptr)
 {
 	unsigned int pos;
@@ -133,9 +260,71 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/*
+ * Allocate a @len byte object for a slot. With dedup enabled the slot
+ * holds a struct zram_entry that identical pages can share, otherwise
+ * just the zsmalloc handle so that a page costs no extra allocation.
+ */
+static void *zram_entry_alloc(struct zram *zram, size_t len)
+{
+	struct zram_entry *entry;
+	void *handle;
+
+	handle = zs_malloc(zram->mem_pool, len);
+	if (!handle || !zram->use_dedup)
+		return handle;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry) {
+		zs_free(zram->mem_pool, handle);
+		return NULL;
+	}
+
+	RB_CLEAR_NODE(&entry->rb_node);
+	entry->len = len;
+	entry->checksum = 0;
+	entry->refcount = 1;
+	entry->handle = handle;
+	return entry;
+}
+
+/* The zsmalloc handle of a slot's object */
+static void *zram_entry_handle(struct zram *zram, void *entry)
+{
+	if (!zram->use_dedup)
+		return entry;
+	return ((struct zram_entry *)entry)->handle;
+}
+
+/* Drop a slot's reference to @entry, return true if that freed it */
+static bool zram_entry_put(struct zram *zram, void *entry)
+{
+	if (zram->use_dedup && zram_dedup_put(zram, entry))
+		return false;
+
+	zs_free(zram->mem_pool, zram_entry_handle(zram, entry));
+	if (zram->use_dedup)
+		kfree(entry);
+	return true;
+}
+
+/* Called with the slot lock held */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	void *handle = zram->table[index].handle;
+	size_t size = zram_get_obj_size(zram, index);
+
+	/* Let a writeback in progress know that the page changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_set_age(zram, index, 0);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_wb_free_block(zram, (unsigned long)handle);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		atomic64_dec(&zram->stats.pages_stored);
+		zram->table[index].handle = NULL;
+		return;
+	}
 
 	if (unlikely(!handle)) {
 		/*
@@ -144,7 +333,7 @@ static void zram_free_page(struct zram *zram, size_t index)
 		 */
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
 			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
+			atomic64_dec(&zram->stats.pages_zero);
 		}
 		return;
 	}
@@ -152,22 +341,23 @@ static void zram_free_page(struct zram *zram, size_t index)
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		__free_page(handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
-	}
-
-	zs_free(zram->mem_pool, handle);
+		atomic64_dec(&zram->stats.pages_expand);
+		atomic64_sub(size, &zram->stats.compr_size);
+	} else {
+		if (size <= PAGE_SIZE / 2)
+			atomic64_dec(&zram->stats.good_compress);
 
-	if (zram->table[index].size <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+		/* Shared objects only count once in compr_size */
+		if (zram_entry_put(zram, handle))
+			atomic64_sub(size, &zram->stats.compr_size);
+		else
+			atomic64_sub(size, &zram->stats.dup_size);
+	}
 
-out:
-	zram_stat64_sub(zram, &zram->stats.compr_size,
-			zram->table[index].size);
-	zram_stat_dec(&zram->stats.pages_stored);
+	atomic64_dec(&zram->stats.pages_stored);
 
 	zram->table[index].handle = NULL;
-	zram->table[index].size = 0;
+	zram_set_obj_size(zram, index, 0);
 }
 
 static void handle_zero_page(struct bio_vec *bvec)
@@ -182,58 +372,87 @@ static void handle_zero_page(struct bio_vec *bvec)
 	flush_dcache_page(page);
 }
 
-static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
-				     u32 index, int offset)
+static inline int is_partial_io(struct bio_vec *bvec)
 {
-	struct page *page = bvec->bv_page;
-	unsigned char *user_mem, *cmem;
+	return bvec->bv_len != PAGE_SIZE;
+}
 
-	user_mem = kmap_atomic(page);
-	cmem = kmap_atomic(zram->table[index].handle);
+/*
+ * Decompress slot @index into the PAGE_SIZE buffer @mem. Called with
+ * the slot lock held.
+ */
+static int zram_decompress_page(struct zram *zram, unsigned char *mem,
+				u32 index)
+{
+	int ret;
+	unsigned int clen = PAGE_SIZE;
+	struct zobj_header *zheader;
+	struct crypto_comp *tfm;
+	unsigned char *cmem;
+	void *handle = zram->table[index].handle;
 
-	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem);
-	kunmap_atomic(user_mem);
+	if (zram_test_flag(zram, index, ZRAM_ZERO) || !handle) {
+		memset(mem, 0, PAGE_SIZE);
+		return 0;
+	}
 
-	flush_dcache_page(page);
-}
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(handle);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem);
+		return 0;
+	}
 
-static inline int is_partial_io(struct bio_vec *bvec)
-{
-	return bvec->bv_len != PAGE_SIZE;
+	handle = zram_entry_handle(zram, handle);
+	tfm = per_cpu_ptr(zram->streams, get_cpu())->dtfm;
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	ret = crypto_comp_decompress(tfm, cmem + sizeof(*zheader),
+				     zram_get_obj_size(zram, index),
+				     mem, &clen);
+	zs_unmap_object(zram->mem_pool, handle);
+	put_cpu();
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret || clen != PAGE_SIZE)) {
+		if (!ret)
+			ret = -EINVAL;
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		atomic64_inc(&zram->stats.failed_reads);
+		return ret;
+	}
+
+	return 0;
 }
 
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
-	size_t clen;
+	bool wb;
+	unsigned long blk;
 	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	unsigned char *user_mem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+	zram_lock_table(zram, index);
+	if (unlikely(!zram->table[index].handle) ||
+	    zram_test_flag(zram, index, ZRAM_ZERO)) {
+		/* Requested page is not present in compressed area */
+		if (!zram_test_flag(zram, index, ZRAM_ZERO))
+			pr_debug("Read before write: sector=%lu, size=%u",
+				 (ulong)(bio->bi_sector), bio->bi_size);
+		zram_unlock_table(zram, index);
 		handle_zero_page(bvec);
 		return 0;
 	}
+	wb = zram_test_flag(zram, index, ZRAM_WB);
+	blk = (unsigned long)zram->table[index].handle;
+	zram_set_age(zram, index, 0);
+	zram_unlock_table(zram, index);
 
-	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].handle)) {
-		pr_debug("Read before write: sector=%lu, size=%u",
-			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
-		return 0;
-	}
-
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		handle_uncompressed_page(zram, bvec, index, offset);
-		return 0;
-	}
-
-	if (is_partial_io(bvec)) {
+	if (is_partial_io(bvec) || wb) {
 		/* Use  a temporary buffer to decompress the page */
 		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
 		if (!uncmem) {
@@ -242,88 +461,69 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		}
 	}
 
-	user_mem = kmap_atomic(page);
-	if (!is_partial_io(bvec))
-		uncmem = user_mem;
-	clen = PAGE_SIZE;
-
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
+	if (wb) {
+		ret = zram_wb_read(zram, blk, uncmem);
+		user_mem = kmap_atomic(page);
+	} else {
+		user_mem = kmap_atomic(page);
+		if (!is_partial_io(bvec))
+			uncmem = user_mem;
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    uncmem, &clen);
+		zram_lock_table(zram, index);
+		ret = zram_decompress_page(zram, uncmem, index);
+		zram_unlock_table(zram, index);
+	}
 
-	if (is_partial_io(bvec)) {
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
-		       bvec->bv_len);
+	if (uncmem != user_mem) {
+		if (!ret)
+			memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+			       bvec->bv_len);
 		kfree(uncmem);
 	}
-
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
 	kunmap_atomic(user_mem);
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
+	if (unlikely(ret))
 		return ret;
-	}
 
 	flush_dcache_page(page);
 
 	return 0;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
+/*
+ * Writers use the stream of the CPU they start on. The stream lock is
+ * a mutex because the store path may sleep in zs_malloc() while the
+ * compressed data still sits in the stream buffer.
+ */
+static struct zram_stream *zram_stream_get(struct zram *zram)
 {
-	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
-	unsigned char *cmem;
-
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].handle) {
-		memset(mem, 0, PAGE_SIZE);
-		return 0;
-	}
+	struct zram_stream *zstrm;
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
-
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		memcpy(mem, cmem, PAGE_SIZE);
-		kunmap_atomic(cmem);
-		return 0;
-	}
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    mem, &clen);
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
-
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
-	}
+	zstrm = per_cpu_ptr(zram->streams, raw_smp_processor_id());
+	mutex_lock(&zstrm->lock);
+	return zstrm;
+}
 
-	return 0;
+static void zram_stream_put(struct zram_stream *zstrm)
+{
+	mutex_unlock(&zstrm->lock);
 }
 
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
-	size_t clen;
+	unsigned int clen = 2 * PAGE_SIZE;
 	void *handle;
+	u32 checksum = 0;
 	struct zobj_header *zheader;
 	struct page *page, *page_store;
+	struct zram_entry *entry;
+	struct zram_stream *zstrm = NULL;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	bool incompressible = false, deduped = false;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -336,47 +536,71 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
-			goto out;
+		zram_lock_table(zram, index);
+		if (zram_test_flag(zram, index, ZRAM_WB)) {
+			unsigned long blk;
+
+			blk = (unsigned long)zram->table[index].handle;
+			zram_unlock_table(zram, index);
+			ret = zram_wb_read(zram, blk, uncmem);
+		} else {
+			ret = zram_decompress_page(zram, uncmem, index);
+			zram_unlock_table(zram, index);
 		}
+		if (ret)
+			goto out;
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
+	zstrm = zram_stream_get(zram);
 	user_mem = kmap_atomic(page);
 
-	if (is_partial_io(bvec))
+	if (is_partial_io(bvec)) {
 		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
 		       bvec->bv_len);
-	else
+		kunmap_atomic(user_mem);
+		user_mem = NULL;
+	} else {
 		uncmem = user_mem;
+	}
 
 	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
+		if (user_mem)
+			kunmap_atomic(user_mem);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_lock_table(zram, index);
+		zram_free_page(zram, index);
 		zram_set_flag(zram, index, ZRAM_ZERO);
+		zram_unlock_table(zram, index);
+		atomic64_inc(&zram->stats.pages_zero);
 		ret = 0;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	/* Share the object of an identical page instead of compressing */
+	if (zram->use_dedup) {
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_find(zram, zstrm, uncmem, checksum);
+		if (entry) {
+			if (user_mem)
+				kunmap_atomic(user_mem);
+			handle = entry;
+			clen = entry->len;
+			deduped = true;
+			goto store;
+		}
+	}
 
-	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	ret = crypto_comp_compress(zstrm->tfm, uncmem, PAGE_SIZE,
+				   zstrm->buffer, &clen);
+	if (user_mem) {
+		kunmap_atomic(user_mem);
+		uncmem = NULL;
+	}
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
@@ -396,77 +620,266 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
+		incompressible = true;
 		handle = page_store;
-		src = kmap_atomic(page);
+		src = uncmem ? uncmem : kmap_atomic(page);
 		cmem = kmap_atomic(page_store);
-		goto memstore;
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem);
+		if (!uncmem)
+			kunmap_atomic(src);
+		goto store;
 	}
 
-	handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
+	handle = zram_entry_alloc(zram, clen + sizeof(*zheader));
 	if (!handle) {
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		ret = -ENOMEM;
 		goto out;
 	}
-	cmem = zs_map_object(zram->mem_pool, handle);
+	cmem = zs_map_object(zram->mem_pool, zram_entry_handle(zram, handle),
+			     ZS_MM_WO);
 
-memstore:
 #if 0
 	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
+	zheader = (struct zobj_header *)cmem;
+	zheader->table_idx = index;
+	cmem += sizeof(*zheader);
 #endif
 
-	memcpy(cmem, src, clen);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(zram->mem_pool, zram_entry_handle(zram, handle));
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		kunmap_atomic(cmem);
-		kunmap_atomic(src);
-	} else {
-		zs_unmap_object(zram->mem_pool, handle);
-	}
+	if (zram->use_dedup)
+		zram_dedup_insert(zram, handle, checksum);
+
+store:
+	zram_stream_put(zstrm);
+	zstrm = NULL;
 
+	/*
+	 * Free memory associated with this sector now and publish the
+	 * new object.
+	 */
+	zram_lock_table(zram, index);
+	zram_free_page(zram, index);
 	zram->table[index].handle = handle;
-	zram->table[index].size = clen;
+	zram_set_obj_size(zram, index, clen);
+	if (incompressible)
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	zram_unlock_table(zram, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram_stat_inc(&zram->stats.pages_stored);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_inc(&zram->stats.good_compress);
-
-	return 0;
+	if (deduped) {
+		atomic64_add(clen, &zram->stats.dup_size);
+		atomic64_inc(&zram->stats.dedup_hits);
+	} else {
+		atomic64_add(clen, &zram->stats.compr_size);
+	}
+	atomic64_inc(&zram->stats.pages_stored);
+	if (incompressible)
+		atomic64_inc(&zram->stats.pages_expand);
+	else if (clen <= PAGE_SIZE / 2)
+		atomic64_inc(&zram->stats.good_compress);
 
 out:
+	if (zstrm)
+		zram_stream_put(zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		atomic64_inc(&zram->stats.failed_writes);
 	return ret;
 }
 
 static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 			int offset, struct bio *bio, int rw)
 {
+	if (rw == READ)
+		return zram_bvec_read(zram, bvec, index, offset, bio);
+
+	return zram_bvec_write(zram, bvec, index, offset);
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Called with init_lock held for writing */
+static void zram_wb_reset(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_blocks = 0;
+	zram->backing_dev[0] = '\0';
+}
+
+/*
+ * Use the block device at @path to write pages back to. Called with
+ * init_lock held for writing, an empty @path drops the device.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct block_device *bdev;
+	unsigned long nr_blocks, *bitmap;
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
+	if (zram->init_done)
+		return -EBUSY;
+
+	zram_wb_reset(zram);
+	if (!*path)
+		return 0;
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  zram);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	ret = set_blocksize(bdev, PAGE_SIZE);
+	if (ret)
+		goto fail;
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (nr_blocks < 2 || !bitmap) {
+		vfree(bitmap);
+		ret = nr_blocks < 2 ? -EINVAL : -ENOMEM;
+		goto fail;
+	}
+
+	zram->bdev = bdev;
+	zram->nr_blocks = nr_blocks;
+	zram->bitmap = bitmap;
+	strlcpy(zram->backing_dev, path, sizeof(zram->backing_dev));
+	pr_info("Using %s as backing device, %lu pages\n", path, nr_blocks);
+	return 0;
+
+fail:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	return ret;
+}
+
+/* Age every page that is still held in memory by one step */
+void zram_age_pages(struct zram *zram)
+{
+	size_t index, nr_pages = zram->disksize >> PAGE_SHIFT;
+	unsigned int age;
+
+	for (index = 0; index < nr_pages; index++) {
+		zram_lock_table(zram, index);
+		age = zram_get_age(zram, index);
+		if (zram->table[index].handle && age < ZRAM_AGE_MAX &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_age(zram, index, age + 1);
+		zram_unlock_table(zram, index);
+		if (!(index % 1024))
+			cond_resched();
+	}
+}
+
+/* Count the pages held in memory by age */
+void zram_age_histogram(struct zram *zram,
+			unsigned long hist[ZRAM_AGE_MAX + 1])
+{
+	size_t index, nr_pages = zram->disksize >> PAGE_SHIFT;
+
+	memset(hist, 0, (ZRAM_AGE_MAX + 1) * sizeof(hist[0]));
+	for (index = 0; index < nr_pages; index++) {
+		zram_lock_table(zram, index);
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			hist[zram_get_age(zram, index)]++;
+		zram_unlock_table(zram, index);
+	}
+}
+
+/*
+ * Write incompressible pages (@huge_only) or pages of at least @min_age
+ * to the backing device and free their memory. Called with init_lock
+ * held for reading, so regular I/O carries on meanwhile: a page that is
+ * rewritten or freed while its copy is in flight is simply kept.
+ */
+int zram_writeback(struct zram *zram, bool huge_only, unsigned int min_age)
+{
+	size_t index, nr_pages = zram->disksize >> PAGE_SHIFT;
+	unsigned long blk;
+	struct page *page;
+	unsigned char *mem;
+	int ret = 0;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < nr_pages; index++) {
+		cond_resched();
+
+		zram_lock_table(zram, index);
+		if (!zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_WB) ||
+		    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+			goto next;
+		if (huge_only ?
+		    !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) :
+		    zram_get_age(zram, index) < min_age)
+			goto next;
+
+		blk = zram_wb_alloc_block(zram);
+		if (!blk) {
+			zram_unlock_table(zram, index);
+			ret = -ENOSPC;
+			break;
+		}
+
+		mem = kmap_atomic(page);
+		ret = zram_decompress_page(zram, mem, index);
+		kunmap_atomic(mem);
+		if (ret) {
+			zram_wb_free_block(zram, blk);
+			zram_unlock_table(zram, index);
+			break;
+		}
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_unlock_table(zram, index);
+
+		ret = zram_wb_rw(zram, page, blk, WRITE);
+
+		zram_lock_table(zram, index);
+		if (ret || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_wb_free_block(zram, blk);
+			if (ret) {
+				zram_unlock_table(zram, index);
+				break;
+			}
+			goto next;
+		}
+
+		/* Drop the in-memory copy, the page itself stays stored */
+		zram_free_page(zram, index);
+		zram->table[index].handle = (void *)blk;
+		zram_set_flag(zram, index, ZRAM_WB);
+		atomic64_inc(&zram->stats.pages_stored);
+		atomic64_inc(&zram->stats.bd_writes);
+next:
+		zram_unlock_table(zram, index);
 	}
 
+	__free_page(page);
 	return ret;
 }
+#else
+static inline void zram_wb_reset(struct zram *zram)
+{
+}
+#endif
 
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 {
@@ -483,10 +896,10 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 
 	switch (rw) {
 	case READ:
-		zram_stat64_inc(zram, &zram->stats.num_reads);
+		atomic64_inc(&zram->stats.num_reads);
 		break;
 	case WRITE:
-		zram_stat64_inc(zram, &zram->stats.num_writes);
+		atomic64_inc(&zram->stats.num_writes);
 		break;
 	}
 
@@ -562,7 +975,7 @@ static void zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto error_unlock;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		atomic64_inc(&zram->stats.invalid_io);
 		goto error_unlock;
 	}
 
@@ -577,6 +990,69 @@ error:
 	bio_io_error(bio);
 }
 
+static void zram_destroy_streams(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->streams)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_stream *zstrm = per_cpu_ptr(zram->streams, cpu);
+
+		if (!IS_ERR_OR_NULL(zstrm->tfm))
+			crypto_free_comp(zstrm->tfm);
+		if (!IS_ERR_OR_NULL(zstrm->dtfm))
+			crypto_free_comp(zstrm->dtfm);
+		free_pages((unsigned long)zstrm->buffer, 1);
+	}
+	free_percpu(zram->streams);
+	zram->streams = NULL;
+}
+
+static int zram_create_streams(struct zram *zram)
+{
+	int cpu;
+
+	zram->streams = alloc_percpu(struct zram_stream);
+	if (!zram->streams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_stream *zstrm = per_cpu_ptr(zram->streams, cpu);
+
+		mutex_init(&zstrm->lock);
+		zstrm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		zstrm->dtfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		/* Compression may expand the page, allow up to two pages */
+		zstrm->buffer =
+			(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+		if (IS_ERR(zstrm->tfm) || IS_ERR(zstrm->dtfm) ||
+		    !zstrm->buffer) {
+			zram_destroy_streams(zram);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Select the compression algorithm used by the next initialization of
+ * @zram. Called with init_lock held for writing.
+ */
+int zram_set_compressor(struct zram *zram, const char *name)
+{
+	if (zram->init_done)
+		return -EBUSY;
+
+	if (!crypto_has_comp(name, 0, 0))
+		return -EINVAL;
+
+	strlcpy(zram->compressor, name, sizeof(zram->compressor));
+	return 0;
+}
+
 void __zram_reset_device(struct zram *zram)
 {
 	size_t index;
@@ -584,27 +1060,26 @@ void __zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_destroy_streams(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		void *handle = zram->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			__free_page(handle);
 		else
-			zs_free(zram->mem_pool, handle);
+			zram_entry_put(zram, handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
+	zram_dedup_fini(zram);
+	zram_wb_reset(zram);
+
 	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
@@ -635,18 +1110,10 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_create_streams(zram);
+	if (ret) {
+		pr_err("Error allocating %s compression streams\n",
+			zram->compressor);
 		goto fail_no_table;
 	}
 
@@ -663,13 +1130,18 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = zs_create_pool("zram", GFP_NOIO | __GFP_HIGHMEM);
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					 GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret)
+		goto fail;
+
 	zram->init_done = 1;
 	up_write(&zram->init_lock);
 
@@ -692,8 +1164,10 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_table(zram, index);
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	zram_unlock_table(zram, index);
+	atomic64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -705,9 +1179,9 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -844,6 +1318,7 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_wb_reset(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
@@ -17,6 +17,9 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/crypto.h>
+#include <linux/rbtree.h>
 
 #include "../zsmalloc/zsmalloc.h"
 
@@ -43,6 +46,9 @@ struct zobj_header {
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compression algorithm, any crypto_comp name can be used */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -51,9 +57,15 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
+ */
+
+/*
+ * With dedup enabled, one hash bucket is allocated for every
+ * 2^ZRAM_HASH_SHIFT disk pages.
  */
+#define ZRAM_HASH_SHIFT		6
 
 /*-- End of configurable params */
 
@@ -66,49 +78,109 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * The lower ZRAM_FLAG_SHIFT bits of table.value hold the object size
+ * (excluding header), the rest are zram_pageflags.
+ */
+#define ZRAM_FLAG_SHIFT		(PAGE_SHIFT + 1)
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
+	/* Slot lock: protects handle, size and flags of the entry */
+	ZRAM_ACCESS = ZRAM_FLAG_SHIFT,
+
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page lives on the backing device, handle is the block number */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
+/*
+ * Above the flags, table.value holds the age of the page: how many times
+ * the device was aged through the 'idle' sysfs node since the page was
+ * last accessed.
+ */
+#define ZRAM_AGE_SHIFT		__NR_ZRAM_PAGEFLAGS
+#define ZRAM_AGE_BITS		4
+#define ZRAM_AGE_MAX		((1 << ZRAM_AGE_BITS) - 1)
+
 /*-- Data structures */
 
+/*
+ * A compressed object in the pool, only used with dedup enabled. It is
+ * shared by every slot holding the same content and lives in the hash
+ * tree of its checksum; refcount is protected by that hash bucket's lock.
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	u32 len;
+	u32 checksum;
+	unsigned long refcount;
+	void *handle;		/* zsmalloc handle */
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct rb_root rb_root;
+};
+
 /* Allocated for each disk page */
 struct table {
+	/*
+	 * struct zram_entry with dedup enabled or zsmalloc handle without,
+	 * struct page if ZRAM_UNCOMPRESSED, or block number on the backing
+	 * device if ZRAM_WB
+	 */
 	void *handle;
-	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __attribute__((aligned(4)));
+	unsigned long value;	/* object size and zram_pageflags */
+};
+
+/*
+ * Per-CPU compression context. The mutex only matters if the writer
+ * gets preempted or migrated while compressing; normally every CPU
+ * uses its own stream and writers never contend. Decompression runs
+ * under the slot lock, i.e. with preemption disabled, so it gets a
+ * transform of its own that needs no locking.
+ */
+struct zram_stream {
+	struct mutex lock;
+	struct crypto_comp *tfm;	/* compression, under lock */
+	void *buffer;			/* compressed output, 2 pages */
+	struct crypto_comp *dtfm;	/* decompression */
+};
 
 struct zram_stats {
-	u64 compr_size;		/* compressed size of pages stored */
-	u64 num_reads;		/* failed + successful */
-	u64 num_writes;		/* --do-- */
-	u64 failed_reads;	/* should NEVER! happen */
-	u64 failed_writes;	/* can happen when memory is too low */
-	u64 invalid_io;		/* non-page-aligned I/O requests */
-	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic64_t compr_size;		/* compressed size of pages stored */
+	atomic64_t num_reads;		/* failed + successful */
+	atomic64_t num_writes;		/* --do-- */
+	atomic64_t failed_reads;	/* should NEVER! happen */
+	atomic64_t failed_writes;	/* can happen when memory is too low */
+	atomic64_t invalid_io;		/* non-page-aligned I/O requests */
+	atomic64_t notify_free;		/* no. of swap slot free notifications */
+	atomic64_t pages_zero;		/* no. of zero filled pages */
+	atomic64_t pages_stored;	/* no. of pages currently stored */
+	atomic64_t good_compress;	/* no. of pages with compr. ratio<=50% */
+	atomic64_t pages_expand;	/* no. of incompressible pages */
+	atomic64_t dup_size;		/* compressed size of deduped pages */
+	atomic64_t dedup_hits;		/* no. of writes satisfied by dedup */
+	atomic64_t bd_count;		/* no. of pages on backing device */
+	atomic64_t bd_reads;		/* no. of pages read from it */
+	atomic64_t bd_writes;		/* no. of pages written to it */
 };
 
 struct zram {
 	struct zs_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zram_stream __percpu *streams;
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,6 +191,19 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* crypto_comp algorithm, can only be changed before init */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	/* Share identical pages, can only be changed before init */
+	int use_dedup;
+	struct zram_hash *hash;
+	size_t hash_size;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Backing device for written back pages, set before init */
+	struct block_device *bdev;
+	char backing_dev[64];
+	unsigned long nr_blocks;
+	unsigned long *bitmap;	/* allocated blocks, block 0 is unused */
+#endif
 
 	struct zram_stats stats;
 };
@@ -130,6 +215,28 @@ extern struct attribute_group zram_disk_attr_group;
 #endif
 
 extern int zram_init_device(struct zram *zram);
+extern int zram_set_compressor(struct zram *zram, const char *name);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_age_pages(struct zram *zram);
+extern void zram_age_histogram(struct zram *zram,
+			       unsigned long hist[ZRAM_AGE_MAX + 1]);
+extern int zram_writeback(struct zram *zram, bool huge_only,
+			  unsigned int min_age);
+#endif
+
+/* zram_dedup.c */
+extern u32 zram_dedup_checksum(unsigned char *mem);
+extern struct zram_entry *zram_dedup_find(struct zram *zram,
+					  struct zram_stream *zstrm,
+					  unsigned char *mem, u32 checksum);
+extern void zram_dedup_insert(struct zram *zram, struct zram_entry *entry,
+			      u32 checksum);
+extern unsigned long zram_dedup_put(struct zram *zram,
+				    struct zram_entry *entry);
+extern int zram_dedup_init(struct zram *zram, size_t num_pages);
+extern void zram_dedup_fini(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
 
 #endif
@@ -0,0 +1,151 @@
+/*
+ * zsmalloc map/unmap microbenchmark
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the license that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * For every size class, fills a few zspages with objects and times
+ * zs_map_object() + zs_unmap_object() over all of them, in each
+ * mapping mode. Objects that span two pages are where page table
+ * mapping and copying differ, so compare the results of a kernel built
+ * with and without CONFIG_ZSMALLOC_PGTABLE_MAPPING.
+ *
+ * Results go to the kernel log; the module then fails to load, so it
+ * can simply be loaded again:
+ *
+ *	modprobe zsmalloc-bench [loops=N] [step=BYTES]
+ */
+
+#define KMSG_COMPONENT "zsmalloc-bench"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static unsigned int loops = 64;
+module_param(loops, uint, 0);
+MODULE_PARM_DESC(loops, "Passes over the objects of each size class");
+
+static unsigned int step = ZS_SIZE_CLASS_DELTA;
+module_param(step, uint, 0);
+MODULE_PARM_DESC(step, "Size increment between measured classes, bytes");
+
+static const char * const mode_names[] = {
+	[ZS_MM_RW] = "rw",
+	[ZS_MM_RO] = "ro",
+	[ZS_MM_WO] = "wo",
+};
+
+/* Average ns per map/unmap pair over @nr objects */
+static u64 time_mapping(struct zs_pool *pool, void **handles, int nr,
+			int size, enum zs_mapmode mm)
+{
+	ktime_t start;
+	unsigned int i;
+	int n;
+	u64 ns;
+
+	start = ktime_get();
+	for (i = 0; i < loops; i++) {
+		for (n = 0; n < nr; n++) {
+			unsigned char *obj;
+
+			obj = zs_map_object(pool, handles[n], mm);
+			if (mm == ZS_MM_RO)
+				ACCESS_ONCE(obj[size - 1]);
+			else
+				obj[size - 1] = i;
+			zs_unmap_object(pool, handles[n]);
+		}
+		cond_resched();
+	}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	do_div(ns, loops * nr);
+	return ns;
+}
+
+static int bench_size(struct zs_pool *pool, int class_size)
+{
+	/* enough objects to fill every zspage layout at least twice */
+	int nr = 2 * ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / class_size;
+	int size = class_size - ZS_HANDLE_SIZE;
+	u64 ns[ARRAY_SIZE(mode_names)];
+	void **handles;
+	int i, ret = 0;
+
+	handles = kcalloc(nr, sizeof(*handles), GFP_KERNEL);
+	if (!handles)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		handles[i] = zs_malloc(pool, size);
+		if (!handles[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(mode_names); i++)
+		ns[i] = time_mapping(pool, handles, nr, size, i);
+
+	pr_info("%6d %6d %8llu %8llu %8llu\n", class_size, nr,
+		ns[ZS_MM_RW], ns[ZS_MM_RO], ns[ZS_MM_WO]);
+out:
+	for (i = 0; i < nr && handles[i]; i++)
+		zs_free(pool, handles[i]);
+	kfree(handles);
+	return ret;
+}
+
+static int __init zs_bench_init(void)
+{
+	struct zs_pool *pool;
+	int size, ret = 0;
+
+	if (!loops || !step)
+		return -EINVAL;
+
+	pool = zs_create_pool("zsmalloc-bench", GFP_KERNEL);
+	if (!pool)
+		return -ENOMEM;
+
+#ifdef CONFIG_ZSMALLOC_PGTABLE_MAPPING
+	pr_info("objects spanning pages mapped through page tables\n");
+#else
+	pr_info("objects spanning pages mapped by copying\n");
+#endif
+	pr_info("%6s %6s %8s %8s %8s (ns per map+unmap)\n", "class",
+		"objs", mode_names[ZS_MM_RW], mode_names[ZS_MM_RO],
+		mode_names[ZS_MM_WO]);
+
+	for (size = ZS_MIN_ALLOC_SIZE; size <= ZS_MAX_ALLOC_SIZE;
+			size += step) {
+		size = round_up(size, ZS_SIZE_CLASS_DELTA);
+		ret = bench_size(pool, min_t(int, size, ZS_MAX_ALLOC_SIZE));
+		if (ret)
+			break;
+	}
+
+	zs_destroy_pool(pool);
+
+	/* Like tcrypt, never stay loaded: there is nothing left to do */
+	return ret ? ret : -EAGAIN;
+}
+
+module_init(zs_bench_init);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("zsmalloc map/unmap microbenchmark");
@@ -17,11 +17,17 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/bitops.h>
+#include <linux/debugfs.h>
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/bit_spinlock.h>
 #include <asm/tlbflush.h>
 #include <asm/pgtable.h>
 #include <linux/cpumask.h>
@@ -43,6 +49,12 @@
 /* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+/* cache for the words that zs_malloc() hands out as object handles */
+static struct kmem_cache *zs_handle_cache;
+
+/* debugfs directory holding one directory of statistics per pool */
+static struct dentry *zs_stat_root;
+
 static int is_first_page(struct page *page)
 {
 	return test_bit(PG_private, &page->flags);
@@ -107,6 +119,15 @@ static enum fullness_group get_fullness_group(struct page *page)
 	return fg;
 }
 
+static void class_lock(struct size_class *class)
+{
+	if (!spin_trylock(&class->lock)) {
+		spin_lock(&class->lock);
+		class->lock_contended++;
+	}
+	class->lock_acquired++;
+}
+
 static void insert_zspage(struct page *page, struct size_class *class,
 				enum fullness_group fullness)
 {
@@ -114,6 +135,9 @@ static void insert_zspage(struct page *page, struct size_class *class,
 
 	BUG_ON(!is_first_page(page));
 
+	if (fullness != ZS_EMPTY)
+		class->zspages[fullness]++;
+
 	if (fullness >= _ZS_NR_FULLNESS_GROUPS)
 		return;
 
@@ -131,6 +155,9 @@ static void remove_zspage(struct page *page, struct size_class *class,
 
 	BUG_ON(!is_first_page(page));
 
+	if (fullness != ZS_EMPTY)
+		class->zspages[fullness]--;
+
 	if (fullness >= _ZS_NR_FULLNESS_GROUPS)
 		return;
 
@@ -230,30 +257,56 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single obj value */
+static unsigned long location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
-		return NULL;
+		return 0;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
 
-	return (void *)handle;
+	return obj << OBJ_TAG_BITS;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(void *handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given obj value */
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	unsigned long hval = (unsigned long)handle;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
+
+/* The handle word holds the obj; its low bit is the pin lock */
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~(1UL << HANDLE_PIN_BIT);
+}
+
+/* Point a pinned handle at a new location, keeping it pinned */
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	ACCESS_ONCE(*(unsigned long *)handle) = obj | (1UL << HANDLE_PIN_BIT);
+}
+
+static void pin_handle(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_handle(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
 
-	*page = pfn_to_page(hval >> OBJ_INDEX_BITS);
-	*obj_idx = hval & OBJ_INDEX_MASK;
+static void unpin_handle(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -330,7 +383,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = (void *)location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -341,7 +394,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = (void *)location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -396,7 +449,7 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = (void *)location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
 	first_page->objects = class->zspage_order * PAGE_SIZE / class->size;
 
@@ -425,6 +478,637 @@ static struct page *find_get_zspage(struct size_class *class)
 	return page;
 }
 
+/*
+ * Take a free object from @first_page and tag it with @handle, or
+ * leave it untagged for a per-cpu cache if @handle is 0
+ */
+static unsigned long obj_malloc(struct page *first_page,
+				struct size_class *class, unsigned long handle)
+{
+	unsigned long obj;
+	struct link_free *link;
+
+	struct page *m_page;
+	unsigned long m_objidx, m_offset;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	link = (struct link_free *)kmap_atomic(m_page) +
+					m_offset / sizeof(*link);
+	first_page->freelist = link->next;
+	link->handle = handle ? handle | OBJ_ALLOCATED_TAG : 0;
+	kunmap_atomic(link);
+
+	first_page->inuse++;
+
+	return obj;
+}
+
+/* Return @obj to the freelist of its zspage */
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
+							+ f_offset);
+	link->next = first_page->freelist;
+	kunmap_atomic(link);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+}
+
+/* Set the header of @obj to @head */
+static void obj_set_header(struct size_class *class, unsigned long obj,
+				unsigned long head)
+{
+	struct link_free *link;
+	struct page *page;
+	unsigned long obj_idx, off;
+
+	obj_to_location(obj, &page, &obj_idx);
+	off = obj_idx_to_offset(page, obj_idx, class->size);
+
+	link = (struct link_free *)((unsigned char *)kmap_atomic(page) + off);
+	link->handle = head;
+	kunmap_atomic(link);
+}
+
+/*
+ * Return @obj to its zspage and update the class; the class lock is
+ * held. Returns the new fullness group of the zspage: the caller frees
+ * it, after dropping the lock, if it is ZS_EMPTY.
+ */
+static enum fullness_group __zs_release_obj(struct zs_pool *pool,
+				struct size_class *class, unsigned long obj)
+{
+	struct page *page;
+	unsigned long obj_idx;
+	enum fullness_group fullness;
+
+	obj_to_location(obj, &page, &obj_idx);
+
+	obj_free(class, obj);
+	class->objs_inuse--;
+	fullness = fix_fullness_group(pool, get_first_page(page));
+
+	if (fullness == ZS_EMPTY)
+		class->pages_allocated -= class->zspage_order;
+
+	return fullness;
+}
+
+/*
+ * Per-cpu caches: the slot of any cpu will do, since slots are only
+ * ever accessed with xchg() and cmpxchg(), so raw_smp_processor_id()
+ * is good enough and a cache can be drained from any cpu.
+ */
+static unsigned long *zs_cache_slot(struct zs_pool *pool,
+				struct size_class *class)
+{
+	return &per_cpu_ptr(pool->cpu_cache,
+			raw_smp_processor_id())->class[class->index].obj;
+}
+
+/*
+ * Hand out this cpu's cached object of @class, tagged with @handle,
+ * without taking the class lock. Returns 0 if there is none.
+ */
+static unsigned long zs_malloc_cached(struct zs_pool *pool,
+				struct size_class *class, unsigned long handle)
+{
+	unsigned long obj;
+
+	obj = xchg(zs_cache_slot(pool, class), 0);
+	if (!obj)
+		return 0;
+
+	/*
+	 * The compactor may find the object as soon as it is tagged, so
+	 * the handle must point at it first. Pairs with the smp_rmb() in
+	 * obj_handle_at().
+	 */
+	*(unsigned long *)handle = obj;
+	smp_wmb();
+	obj_set_header(class, obj, handle | OBJ_ALLOCATED_TAG);
+
+	this_cpu_inc(pool->cpu_cache->class[class->index].hits);
+
+	return obj;
+}
+
+/*
+ * Park @obj, already untagged and counted in use, in this cpu's cache
+ * of @class. The class lock is held. Returns false if the slot is
+ * taken.
+ */
+static bool zs_cache_obj(struct zs_pool *pool, struct size_class *class,
+				unsigned long obj)
+{
+	return !cmpxchg(zs_cache_slot(pool, class), 0, obj);
+}
+
+/* Give the objects of all per-cpu caches back to their zspages */
+static void zs_drain_caches(struct zs_pool *pool)
+{
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_cpu_cache *cache = per_cpu_ptr(pool->cpu_cache, cpu);
+
+		for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+			struct size_class *class = &pool->size_class[i];
+			unsigned long obj;
+			struct page *page;
+			unsigned long obj_idx;
+			enum fullness_group fullness;
+
+			obj = xchg(&cache->class[i].obj, 0);
+			if (!obj)
+				continue;
+
+			obj_to_location(obj, &page, &obj_idx);
+			class_lock(class);
+			fullness = __zs_release_obj(pool, class, obj);
+			spin_unlock(&class->lock);
+
+			if (fullness == ZS_EMPTY)
+				free_zspage(get_first_page(page));
+		}
+	}
+}
+
+/*
+ * Take back the cached objects in @first_page if nothing else in it is
+ * in use, so that per-cpu caches never keep an otherwise empty zspage
+ * around. The class lock is held. Returns the new fullness group of the
+ * zspage, like __zs_release_obj().
+ */
+static enum fullness_group zs_uncache_zspage(struct zs_pool *pool,
+				struct size_class *class, struct page *first_page,
+				enum fullness_group fullness)
+{
+	unsigned long *slot;
+	unsigned long obj, obj_idx;
+	struct page *page;
+	int cpu, cached = 0;
+
+	/* each cpu holds at most one object of the class */
+	if (fullness == ZS_EMPTY || first_page->inuse > num_possible_cpus())
+		return fullness;
+
+	for_each_possible_cpu(cpu) {
+		slot = &per_cpu_ptr(pool->cpu_cache, cpu)->class[class->index].obj;
+		obj = ACCESS_ONCE(*slot);
+		if (!obj)
+			continue;
+		obj_to_location(obj, &page, &obj_idx);
+		if (get_first_page(page) == first_page)
+			cached++;
+	}
+	if (cached < first_page->inuse)
+		return fullness;
+
+	for_each_possible_cpu(cpu) {
+		slot = &per_cpu_ptr(pool->cpu_cache, cpu)->class[class->index].obj;
+		obj = ACCESS_ONCE(*slot);
+		if (!obj)
+			continue;
+		obj_to_location(obj, &page, &obj_idx);
+		/* lost to an allocation on that cpu, the zspage stays */
+		if (get_first_page(page) != first_page ||
+		    cmpxchg(slot, obj, 0) != obj)
+			continue;
+		fullness = __zs_release_obj(pool, class, obj);
+	}
+
+	return fullness;
+}
+
+/*
+ * Compaction moves the live objects of sparsely used zspages into the
+ * free slots of fuller zspages of the same class, so that the emptied
+ * zspages can be given back to the system. An object is only moved if
+ * its handle can be pinned without waiting, so mapped objects and ones
+ * being freed are skipped; zs_malloc() and zs_free() are excluded by
+ * the class lock.
+ */
+
+/* Number of pages compaction of @class could free right now */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long objs_allocated;
+
+	objs_allocated = (unsigned long)class->pages_allocated /
+				class->zspage_order * class->objs_per_zspage;
+	if (objs_allocated <= class->objs_inuse)
+		return 0;
+
+	return (objs_allocated - class->objs_inuse) / class->objs_per_zspage *
+				class->zspage_order;
+}
+
+/* Take a zspage off its fullness list for the compactor */
+static struct page *isolate_zspage(struct size_class *class,
+				enum fullness_group fg)
+{
+	struct page *page = class->fullness_list[fg];
+
+	if (page)
+		remove_zspage(page, class, fg);
+
+	return page;
+}
+
+/* Return an isolated zspage to the fullness list it now belongs to */
+static enum fullness_group putback_zspage(struct size_class *class,
+				struct page *first_page)
+{
+	enum fullness_group fullness = get_fullness_group(first_page);
+
+	insert_zspage(first_page, class, fullness);
+	set_zspage_mapping(first_page, class->index, fullness);
+
+	return fullness;
+}
+
+/* Copy the whole object, handle tag included, from @src to @dst */
+static void zs_object_copy(unsigned long dst, unsigned long src,
+				struct size_class *class)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	s_size = min_t(int, class->size, PAGE_SIZE - s_off);
+	d_size = min_t(int, class->size, PAGE_SIZE - d_off);
+
+	s_addr = kmap_atomic(s_page);
+	d_addr = kmap_atomic(d_page);
+
+	while (1) {
+		size = min(s_size, d_size);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		written += size;
+
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		/* kmap_atomic() mappings must be undone in reverse order */
+		if (!s_size) {
+			kunmap_atomic(d_addr);
+			kunmap_atomic(s_addr);
+			s_page = get_next_page(s_page);
+			BUG_ON(!s_page);
+			s_addr = kmap_atomic(s_page);
+			d_addr = kmap_atomic(d_page);
+			s_size = class->size - written;
+			s_off = 0;
+		}
+
+		if (!d_size) {
+			kunmap_atomic(d_addr);
+			d_page = get_next_page(d_page);
+			BUG_ON(!d_page);
+			d_addr = kmap_atomic(d_page);
+			d_size = class->size - written;
+			d_off = 0;
+		}
+	}
+
+	kunmap_atomic(d_addr);
+	kunmap_atomic(s_addr);
+}
+
+/*
+ * Return the handle of the object at <page, obj_idx>, or 0 if it is
+ * free or does not start on this page.
+ */
+static unsigned long obj_handle_at(struct page *page, unsigned long obj_idx,
+				struct size_class *class)
+{
+	unsigned long off, head;
+	struct link_free *link;
+
+	off = obj_idx_to_offset(page, obj_idx, class->size);
+	if (off >= PAGE_SIZE)
+		return 0;
+
+	link = (struct link_free *)((unsigned char *)kmap_atomic(page) + off);
+	head = link->handle;
+	kunmap_atomic(link);
+
+	/* pairs with the smp_wmb() in zs_malloc_cached() */
+	smp_rmb();
+
+	return head & OBJ_ALLOCATED_TAG ? head & ~OBJ_ALLOCATED_TAG : 0;
+}
+
+/*
+ * Move objects out of @src_page into @dst_page until the source is
+ * empty, the destination is full or an object is busy. Both zspages
+ * are isolated and the class lock is held. Returns 0 once the source
+ * is empty.
+ */
+static int migrate_zspage(struct zs_pool *pool, struct size_class *class,
+				struct page *src_page, struct page *dst_page)
+{
+	struct page *page;
+	unsigned long obj_idx, handle, used_obj, free_obj;
+
+	for (page = src_page; page; page = get_next_page(page)) {
+		for (obj_idx = 0; ; obj_idx++) {
+			if (!src_page->inuse)
+				return 0;
+			if (obj_idx_to_offset(page, obj_idx, class->size) >=
+						PAGE_SIZE)
+				break;
+
+			handle = obj_handle_at(page, obj_idx, class);
+			if (!handle)
+				continue;
+
+			if (dst_page->inuse == dst_page->objects)
+				return -ENOSPC;
+			if (!trypin_handle(handle))
+				return -EBUSY;
+
+			used_obj = handle_to_obj(handle);
+			free_obj = obj_malloc(dst_page, class, handle);
+			zs_object_copy(free_obj, used_obj, class);
+			record_obj(handle, free_obj);
+			unpin_handle(handle);
+			obj_free(class, used_obj);
+			atomic_long_inc(&pool->objs_migrated);
+		}
+	}
+
+	return src_page->inuse ? -EBUSY : 0;
+}
+
+static unsigned long zs_compact_class(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct page *src_page, *dst_page;
+	unsigned long freed = 0;
+	int ret;
+
+	class_lock(class);
+	while (zs_can_compact(class)) {
+		src_page = isolate_zspage(class, ZS_ALMOST_EMPTY);
+		if (!src_page)
+			break;
+
+		ret = -ENOSPC;
+		while (ret == -ENOSPC) {
+			dst_page = isolate_zspage(class, ZS_ALMOST_FULL);
+			if (!dst_page)
+				dst_page = isolate_zspage(class,
+							ZS_ALMOST_EMPTY);
+			if (!dst_page)
+				break;
+
+			ret = migrate_zspage(pool, class, src_page, dst_page);
+			putback_zspage(class, dst_page);
+		}
+
+		if (putback_zspage(class, src_page) != ZS_EMPTY) {
+			/* nowhere left to move to, or an object is busy */
+			break;
+		}
+
+		class->pages_allocated -= class->zspage_order;
+		freed += class->zspage_order;
+		spin_unlock(&class->lock);
+
+		free_zspage(src_page);
+		cond_resched();
+		class_lock(class);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Free zspages by packing live objects together.
+ * @pool: pool to compact
+ *
+ * Returns the number of pages given back to the system.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	/* cached objects would keep their zspages from being emptied */
+	zs_drain_caches(pool);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		freed += zs_compact_class(pool, &pool->size_class[i]);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+	stats->objs_migrated = atomic_long_read(&pool->objs_migrated);
+}
+EXPORT_SYMBOL_GPL(zs_pool_stats);
+
+static unsigned long zs_compactable_pages(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		pages += zs_can_compact(&pool->size_class[i]);
+
+	return pages;
+}
+
+/*
+ * Compacting frees pages without writing anything out, so let reclaim
+ * do it before it has to evict anything. Reports how many pages could
+ * still be freed.
+ */
+static int zs_shrinker_scan(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					shrinker);
+
+	if (sc->nr_to_scan)
+		zs_compact(pool);
+
+	return min_t(unsigned long, zs_compactable_pages(pool), INT_MAX);
+}
+
+/*
+ * Objects that span two pages are accessed either through a per-cpu
+ * two page VM area whose ptes are pointed at the pages on every map
+ * (CONFIG_ZSMALLOC_PGTABLE_MAPPING), or by copying them into a per-cpu
+ * buffer and back. Which is cheaper depends on the cost of a local TLB
+ * flush against that of a memcpy() of up to a page; zsmalloc-bench
+ * measures both.
+ */
+#ifdef CONFIG_ZSMALLOC_PGTABLE_MAPPING
+
+#if defined(CONFIG_X86)
+#define zs_flush_tlb_page(addr)	__flush_tlb_one(addr)
+#elif defined(CONFIG_ARM)
+#define zs_flush_tlb_page(addr)	local_flush_tlb_kernel_page(addr)
+#endif
+
+static int __zs_cpu_up(struct mapping_area *area)
+{
+	if (area->vm)
+		return 0;
+	area->vm = alloc_vm_area(2 * PAGE_SIZE, area->vm_ptes);
+	if (!area->vm)
+		return -ENOMEM;
+	return 0;
+}
+
+static void __zs_cpu_down(struct mapping_area *area)
+{
+	if (area->vm)
+		free_vm_area(area->vm);
+	area->vm = NULL;
+}
+
+static void *__zs_map_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	unsigned long addr = (unsigned long)area->vm->addr;
+
+	/* We pre-allocated VM area so mapping can never fail */
+	set_pte_at(&init_mm, addr, area->vm_ptes[0],
+			mk_pte(pages[0], PAGE_KERNEL));
+	set_pte_at(&init_mm, addr + PAGE_SIZE, area->vm_ptes[1],
+			mk_pte(pages[1], PAGE_KERNEL));
+	area->vm_addr = area->vm->addr;
+
+	return area->vm_addr + off;
+}
+
+static void __zs_unmap_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	unsigned long addr = (unsigned long)area->vm_addr;
+
+	/* The area is only ever used by this cpu, a local flush will do */
+	pte_clear(&init_mm, addr, area->vm_ptes[0]);
+	pte_clear(&init_mm, addr + PAGE_SIZE, area->vm_ptes[1]);
+	zs_flush_tlb_page(addr);
+	zs_flush_tlb_page(addr + PAGE_SIZE);
+}
+
+#else /* CONFIG_ZSMALLOC_PGTABLE_MAPPING */
+
+static int __zs_cpu_up(struct mapping_area *area)
+{
+	if (area->vm_buf)
+		return 0;
+	area->vm_buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!area->vm_buf)
+		return -ENOMEM;
+	return 0;
+}
+
+static void __zs_cpu_down(struct mapping_area *area)
+{
+	if (area->vm_buf)
+		free_page((unsigned long)area->vm_buf);
+	area->vm_buf = NULL;
+}
+
+static void *__zs_map_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	int sizes[2];
+	void *addr;
+	char *buf = area->vm_buf;
+
+	/* disable page faults to match kmap_atomic() return conditions */
+	pagefault_disable();
+
+	/* the caller is going to overwrite the object anyway */
+	if (area->vm_mm == ZS_MM_WO)
+		goto out;
+
+	sizes[0] = PAGE_SIZE - off;
+	sizes[1] = size - sizes[0];
+
+	addr = kmap_atomic(pages[0]);
+	memcpy(buf, addr + off, sizes[0]);
+	kunmap_atomic(addr);
+	addr = kmap_atomic(pages[1]);
+	memcpy(buf + sizes[0], addr, sizes[1]);
+	kunmap_atomic(addr);
+out:
+	return area->vm_buf;
+}
+
+static void __zs_unmap_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	int sizes[2];
+	void *addr;
+	char *buf = area->vm_buf;
+
+	/* nothing to write back */
+	if (area->vm_mm == ZS_MM_RO)
+		goto out;
+
+	/*
+	 * Only the payload is copied back: after a ZS_MM_WO mapping the
+	 * buffer holds no valid handle header.
+	 */
+	buf += ZS_HANDLE_SIZE;
+	size -= ZS_HANDLE_SIZE;
+	off += ZS_HANDLE_SIZE;
+
+	sizes[0] = PAGE_SIZE - off;
+	sizes[1] = size - sizes[0];
+
+	addr = kmap_atomic(pages[0]);
+	memcpy(addr + off, buf, sizes[0]);
+	kunmap_atomic(addr);
+	addr = kmap_atomic(pages[1]);
+	memcpy(addr, buf + sizes[0], sizes[1]);
+	kunmap_atomic(addr);
+out:
+	pagefault_enable();
+}
+
+#endif /* CONFIG_ZSMALLOC_PGTABLE_MAPPING */
 
 static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 				void *pcpu)
@@ -432,21 +1116,19 @@ static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 	int cpu = (long)pcpu;
 	struct mapping_area *area;
 
+	int ret;
+
 	switch (action) {
 	case CPU_UP_PREPARE:
 		area = &per_cpu(zs_map_area, cpu);
-		if (area->vm)
-			break;
-		area->vm = alloc_vm_area(2 * PAGE_SIZE, area->vm_ptes);
-		if (!area->vm)
-			return notifier_from_errno(-ENOMEM);
+		ret = __zs_cpu_up(area);
+		if (ret)
+			return notifier_from_errno(ret);
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
 		area = &per_cpu(zs_map_area, cpu);
-		if (area->vm)
-			free_vm_area(area->vm);
-		area->vm = NULL;
+		__zs_cpu_down(area);
 		break;
 	}
 
@@ -464,12 +1146,29 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	if (zs_handle_cache)
+		kmem_cache_destroy(zs_handle_cache);
+	zs_handle_cache = NULL;
+
+	debugfs_remove_recursive(zs_stat_root);
+	zs_stat_root = NULL;
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cache = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					0, 0, NULL);
+	if (!zs_handle_cache)
+		return -ENOMEM;
+
+	/* statistics are optional */
+	zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+	if (IS_ERR(zs_stat_root))
+		zs_stat_root = NULL;
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
@@ -482,6 +1181,102 @@ fail:
 	return notifier_to_errno(ret);
 }
 
+static int zs_stats_classes_show(struct seq_file *s, void *v)
+{
+	struct zs_pool *pool = s->private;
+	unsigned long total_objs = 0, total_used = 0, total_cached = 0;
+	unsigned long total_pages = 0, total_hits = 0;
+	unsigned long total_acquired = 0, total_contended = 0;
+	int i, cpu;
+
+	seq_printf(s, "%5s %5s %11s %12s %6s %13s %10s %10s %10s %16s "
+			"%10s %13s %14s\n", "class", "size", "almost_full",
+			"almost_empty", "full", "obj_allocated", "obj_used",
+			"obj_cached", "pages_used", "pages_per_zspage",
+			"cache_hits", "lock_acquired", "lock_contended");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		unsigned long almost_full, almost_empty, full;
+		unsigned long objs, used, cached = 0, pages, hits = 0;
+		unsigned long acquired, contended;
+
+		/* not class_lock(), which would count this */
+		spin_lock(&class->lock);
+		almost_full = class->zspages[ZS_ALMOST_FULL];
+		almost_empty = class->zspages[ZS_ALMOST_EMPTY];
+		full = class->zspages[ZS_FULL];
+		pages = class->pages_allocated;
+		used = class->objs_inuse;
+		acquired = class->lock_acquired;
+		contended = class->lock_contended;
+		spin_unlock(&class->lock);
+
+		for_each_possible_cpu(cpu) {
+			struct zs_cached_obj *c;
+
+			c = &per_cpu_ptr(pool->cpu_cache, cpu)->class[i];
+			if (ACCESS_ONCE(c->obj))
+				cached++;
+			hits += c->hits;
+		}
+
+		objs = pages / class->zspage_order * class->objs_per_zspage;
+
+		/* the cache may have been refilled since the lock */
+		used = used > cached ? used - cached : 0;
+
+		seq_printf(s, "%5d %5d %11lu %12lu %6lu %13lu %10lu %10lu "
+				"%10lu %16d %10lu %13lu %14lu\n", i,
+				class->size, almost_full, almost_empty, full,
+				objs, used, cached, pages,
+				class->zspage_order, hits, acquired, contended);
+
+		total_objs += objs;
+		total_used += used;
+		total_cached += cached;
+		total_pages += pages;
+		total_hits += hits;
+		total_acquired += acquired;
+		total_contended += contended;
+	}
+
+	seq_printf(s, "\n%5s %5s %11s %12s %6s %13lu %10lu %10lu %10lu "
+			"%16s %10lu %13lu %14lu\n", "Total", "", "", "", "",
+			total_objs, total_used, total_cached, total_pages, "",
+			total_hits, total_acquired, total_contended);
+
+	return 0;
+}
+
+static int zs_stats_classes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_classes_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_classes_fops = {
+	.open		= zs_stats_classes_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Statistics of @pool go to zsmalloc/<pool name>/classes in debugfs */
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	if (!zs_stat_root)
+		return;
+
+	pool->stat_dentry = debugfs_create_dir(pool->name, zs_stat_root);
+	if (!pool->stat_dentry) {
+		pr_warn("no debugfs statistics for pool %s\n", pool->name);
+		return;
+	}
+
+	debugfs_create_file("classes", S_IRUGO, pool->stat_dentry, pool,
+			&zs_stats_classes_fops);
+}
+
 struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 {
 	int i, ovhd_size;
@@ -495,6 +1290,12 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 	if (!pool)
 		return NULL;
 
+	pool->cpu_cache = alloc_percpu(struct zs_cpu_cache);
+	if (!pool->cpu_cache) {
+		kfree(pool);
+		return NULL;
+	}
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int size;
 		struct size_class *class;
@@ -508,12 +1309,19 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->zspage_order = get_zspage_order(size);
-
+		class->objs_per_zspage = class->zspage_order * PAGE_SIZE /
+						class->size;
 	}
 
 	pool->flags = flags;
 	pool->name = name;
 
+	zs_pool_stat_create(pool);
+
+	pool->shrinker.shrink = zs_shrinker_scan;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
 	return pool;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
@@ -522,6 +1330,10 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	debugfs_remove_recursive(pool->stat_dentry);
+	unregister_shrinker(&pool->shrinker);
+	zs_drain_caches(pool);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
@@ -534,6 +1346,7 @@ void zs_destroy_pool(struct zs_pool *pool)
 			}
 		}
 	}
+	free_percpu(pool->cpu_cache);
 	kfree(pool);
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
@@ -542,108 +1355,137 @@ EXPORT_SYMBOL_GPL(zs_destroy_pool);
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
  *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
+ * On success, a handle to the allocated object is returned; the
+ * object itself is only reachable through zs_map_object(). On
+ * failure, NULL is returned.
  *
- * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
  */
 void *zs_malloc(struct zs_pool *pool, size_t size)
 {
-	void *obj;
-	struct link_free *link;
+	unsigned long handle, obj;
 	int class_idx;
 	struct size_class *class;
+	struct page *first_page;
 
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return NULL;
 
-	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+	handle = (unsigned long)kmem_cache_alloc(zs_handle_cache,
+					pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
 		return NULL;
 
+	size += ZS_HANDLE_SIZE;
 	class_idx = get_size_class_index(size);
 	class = &pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
 
-	spin_lock(&class->lock);
+	if (zs_malloc_cached(pool, class, handle))
+		return (void *)handle;
+
+	class_lock(class);
 	first_page = find_get_zspage(class);
 
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			kmem_cache_free(zs_handle_cache, (void *)handle);
 			return NULL;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
-		spin_lock(&class->lock);
+		class_lock(class);
 		class->pages_allocated += class->zspage_order;
 	}
 
-	obj = first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
+	obj = obj_malloc(first_page, class, handle);
+	*(unsigned long *)handle = obj;
+	class->objs_inuse++;
+
+	/* Refill this cpu's cache while we hold the lock anyway */
+	if (!ACCESS_ONCE(*zs_cache_slot(pool, class)) &&
+	    first_page->inuse < first_page->objects) {
+		obj = obj_malloc(first_page, class, 0);
+		if (zs_cache_obj(pool, class, obj))
+			class->objs_inuse++;
+		else
+			obj_free(class, obj);
+	}
 
-	first_page->inuse++;
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return (void *)handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, void *obj)
+void zs_free(struct zs_pool *pool, void *handle)
 {
-	struct link_free *link;
+	unsigned long obj;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
+	unsigned long f_objidx;
 
 	int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
+	bool cached = false;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
+	/* The pin keeps compaction from moving the object under us */
+	pin_handle((unsigned long)handle);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
 	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
 
-	spin_lock(&class->lock);
+	class_lock(class);
 
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = obj;
-
-	first_page->inuse--;
-	fullness = fix_fullness_group(pool, first_page);
-
-	if (fullness == ZS_EMPTY)
-		class->pages_allocated -= class->zspage_order;
+	/*
+	 * Keep the object for the next allocation on this cpu, unless
+	 * that would keep an otherwise empty zspage around.
+	 */
+	if (first_page->inuse > 1 &&
+	    !ACCESS_ONCE(*zs_cache_slot(pool, class))) {
+		obj_set_header(class, obj, 0);
+		cached = zs_cache_obj(pool, class, obj);
+	}
 
+	if (cached) {
+		fullness = get_fullness_group(first_page);
+	} else {
+		fullness = __zs_release_obj(pool, class, obj);
+		fullness = zs_uncache_zspage(pool, class, first_page, fullness);
+	}
 	spin_unlock(&class->lock);
+	unpin_handle((unsigned long)handle);
+	kmem_cache_free(zs_handle_cache, handle);
 
 	if (fullness == ZS_EMPTY)
 		free_zspage(first_page);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
-void *zs_map_object(struct zs_pool *pool, void *handle)
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: what the caller is going to do with the object
+ *
+ * The object is pinned and preemption is disabled until it is unmapped
+ * with zs_unmap_object(), so only one object may be mapped at a time.
+ * ZS_MM_RO and ZS_MM_WO let an object that spans two pages skip the
+ * copy back, respectively in, when it is mapped by copying.
+ */
+void *zs_map_object(struct zs_pool *pool, void *handle, enum zs_mapmode mm)
 {
 	struct page *page;
 	unsigned long obj_idx, off;
@@ -652,34 +1494,31 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
+	struct page *pages[2];
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	/* The object stays put until zs_unmap_object() unpins it */
+	pin_handle((unsigned long)handle);
+	obj_to_location(handle_to_obj((unsigned long)handle), &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
 
 	area = &get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-	} else {
-		/* this object spans two pages */
-		struct page *nextp;
-
-		nextp = get_next_page(page);
-		BUG_ON(!nextp);
-
-
-		set_pte(area->vm_ptes[0], mk_pte(page, PAGE_KERNEL));
-		set_pte(area->vm_ptes[1], mk_pte(nextp, PAGE_KERNEL));
-
-		/* We pre-allocated VM area so mapping can never fail */
-		area->vm_addr = area->vm->addr;
+		return area->vm_addr + off + ZS_HANDLE_SIZE;
 	}
 
-	return area->vm_addr + off;
+	/* this object spans two pages */
+	pages[0] = page;
+	pages[1] = get_next_page(page);
+	BUG_ON(!pages[1]);
+
+	return __zs_map_object(area, pages, off, class->size) + ZS_HANDLE_SIZE;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
@@ -695,7 +1534,7 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj_to_location(handle_to_obj((unsigned long)handle), &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -704,12 +1543,16 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 	if (off + class->size <= PAGE_SIZE) {
 		kunmap_atomic(area->vm_addr);
 	} else {
-		set_pte(area->vm_ptes[0], __pte(0));
-		set_pte(area->vm_ptes[1], __pte(0));
-		__flush_tlb_one((unsigned long)area->vm_addr);
-		__flush_tlb_one((unsigned long)area->vm_addr + PAGE_SIZE);
+		struct page *pages[2];
+
+		pages[0] = page;
+		pages[1] = get_next_page(page);
+		BUG_ON(!pages[1]);
+
+		__zs_unmap_object(area, pages, off, class->size);
 	}
 	put_cpu_var(zs_map_area);
+	unpin_handle((unsigned long)handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
@@ -15,6 +15,18 @@
 
 #include <linux/types.h>
 
+/*
+ * zsmalloc mapping modes
+ *
+ * NOTE: These only make a difference when a mapped object spans pages
+ * and is accessed by copying (!CONFIG_ZSMALLOC_PGTABLE_MAPPING)
+ */
+enum zs_mapmode {
+	ZS_MM_RW, /* normal read-write mapping */
+	ZS_MM_RO, /* read-only (no copy-out at unmap time) */
+	ZS_MM_WO /* write-only (no copy-in at map time) */
+};
+
 struct zs_pool;
 
 struct zs_pool *zs_create_pool(const char *name, gfp_t flags);
@@ -23,9 +35,21 @@ void zs_destroy_pool(struct zs_pool *pool);
 void *zs_malloc(struct zs_pool *pool, size_t size);
 void zs_free(struct zs_pool *pool, void *obj);
 
-void *zs_map_object(struct zs_pool *pool, void *handle);
+void *zs_map_object(struct zs_pool *pool, void *handle,
+			enum zs_mapmode mm);
 void zs_unmap_object(struct zs_pool *pool, void *handle);
 
 u64 zs_get_total_size_bytes(struct zs_pool *pool);
 
+unsigned long zs_compact(struct zs_pool *pool);
+
+struct zs_pool_stats {
+	/* pages freed by compaction, manual and from the shrinker */
+	unsigned long pages_compacted;
+	/* objects moved by compaction */
+	unsigned long objs_migrated;
+};
+
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats);
+
 #endif
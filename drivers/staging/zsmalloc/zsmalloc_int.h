@@ -14,9 +14,12 @@
 #define _ZS_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/shrinker.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 
+#include "zsmalloc.h"
+
 /*
  * This must be power of 2 and greater than of equal to sizeof(link_free).
  * These two conditions ensure that any 'struct link_free' itself doesn't
@@ -33,14 +36,23 @@
 #define ZS_MAX_PAGES_PER_ZSPAGE (_AC(1, UL) << ZS_MAX_ZSPAGE_ORDER)
 
 /*
- * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * Object location (<PFN>, <obj_idx>) is encoded as a single unsigned
+ * long 'obj' value, shifted left by OBJ_TAG_BITS.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * Callers do not see obj values: the handle returned by zs_malloc() is
+ * the address of a word holding the obj, so that compaction can move
+ * the object and update that word. Bit HANDLE_PIN_BIT of the word is a
+ * lock which keeps the object in place while it is mapped or freed.
+ *
+ * The first word of every object links it back: a free object stores
+ * the obj of the next free object there, an allocated one its handle
+ * with OBJ_ALLOCATED_TAG set. The payload follows at ZS_HANDLE_SIZE.
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -55,9 +67,14 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS		1
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT		0
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -110,9 +127,14 @@ enum fullness_group {
 static const int fullness_threshold_frac = 4;
 
 struct mapping_area {
-	struct vm_struct *vm;
+#ifdef CONFIG_ZSMALLOC_PGTABLE_MAPPING
+	struct vm_struct *vm; /* vm area for mapping objects that span pages */
 	pte_t *vm_ptes[2];
-	char *vm_addr;
+#else
+	char *vm_buf; /* copy buffer for objects that span pages */
+#endif
+	char *vm_addr; /* address of kmap_atomic()'ed pages */
+	enum zs_mapmode vm_mm; /* mapping mode */
 };
 
 struct size_class {
@@ -126,30 +148,71 @@ struct size_class {
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int zspage_order;
 
+	/* Number of objects a zspage of this class holds */
+	int objs_per_zspage;
+
 	spinlock_t lock;
 
 	/* stats */
 	u64 pages_allocated;
+	/* objects handed out, or held in per-cpu caches */
+	unsigned long objs_inuse;
+	/* zspages per fullness group, ZS_EMPTY excepted */
+	unsigned long zspages[ZS_FULL + 1];
+	/* acquisitions of the lock, and how many of them had to spin */
+	unsigned long lock_acquired;
+	unsigned long lock_contended;
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
 
 /*
- * Placed within free objects to form a singly linked list.
- * For every zspage, first_page->freelist gives head of this list.
+ * Placed at the start of every object. Free objects form a singly
+ * linked list through it; for every zspage, first_page->freelist gives
+ * head of this list.
  *
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* obj of next free chunk (encodes <PFN, obj_idx>) */
+		void *next;
+		/* Handle of an allocated object, with OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
+};
+
+/*
+ * Each cpu holds on to one free object per size class, so that most
+ * allocations can take it without the class lock. It is refilled
+ * under the lock, by zs_malloc() and zs_free(). A cached object counts
+ * as in use in its zspage; its header carries no OBJ_ALLOCATED_TAG.
+ * zs_free() takes cached objects back once they are all that is left
+ * in use in a zspage, so the zspage can be freed.
+ */
+struct zs_cached_obj {
+	unsigned long obj;	/* 0 if empty */
+	unsigned long hits;	/* allocations served from it */
+};
+
+struct zs_cpu_cache {
+	struct zs_cached_obj class[ZS_SIZE_CLASSES];
 };
 
 struct zs_pool {
 	struct size_class size_class[ZS_SIZE_CLASSES];
+	struct zs_cpu_cache __percpu *cpu_cache;
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	/* Compacts the pool under memory pressure */
+	struct shrinker shrinker;
+	/* stats */
+	atomic_long_t pages_compacted;
+	atomic_long_t objs_migrated;
+
+	struct dentry *stat_dentry;
 };
 
 #endif
@@ -952,8 +952,10 @@ static int de_thread(struct task_struct *tsk)
 		list_replace_rcu(&leader->tasks, &tsk->tasks);
 		list_replace_init(&leader->sibling, &tsk->sibling);
 
+		lowmem_task_del(leader);
 		tsk->group_leader = tsk;
 		leader->group_leader = tsk;
+		lowmem_task_add(tsk);
 
 		tsk->exit_signal = SIGCHLD;
 		leader->exit_signal = -1;
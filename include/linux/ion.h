@@ -27,12 +27,15 @@ struct ion_handle;
  * @ION_HEAP_TYPE_CARVEOUT:	 memory allocated from a prereserved
  * 				 carveout heap, allocations are physically
  * 				 contiguous
+ * @ION_HEAP_TYPE_CMA:		 memory allocated from a CMA area, allocations
+ *				 are physically contiguous
  * @ION_HEAP_END:		 helper for iterating over heaps
  */
 enum ion_heap_type {
 	ION_HEAP_TYPE_SYSTEM,
 	ION_HEAP_TYPE_SYSTEM_CONTIG,
 	ION_HEAP_TYPE_CARVEOUT,
+	ION_HEAP_TYPE_CMA,
 	ION_HEAP_TYPE_CUSTOM, /* must be last so device specific heaps always
 				 are at the end of this enum */
 	ION_NUM_HEAPS,
@@ -41,6 +44,7 @@ enum ion_heap_type {
 #define ION_HEAP_SYSTEM_MASK		(1 << ION_HEAP_TYPE_SYSTEM)
 #define ION_HEAP_SYSTEM_CONTIG_MASK	(1 << ION_HEAP_TYPE_SYSTEM_CONTIG)
 #define ION_HEAP_CARVEOUT_MASK		(1 << ION_HEAP_TYPE_CARVEOUT)
+#define ION_HEAP_CMA_MASK		(1 << ION_HEAP_TYPE_CMA)
 
 #ifdef __KERNEL__
 struct ion_device;
@@ -63,6 +67,9 @@ struct ion_buffer;
  * @name:	used for debug purposes
  * @base:	base address of heap in physical memory if applicable
  * @size:	size of the heap in bytes if applicable
+ * @flags:	ION_HEAP_FLAG_* flags for the heap
+ * @priv:	heap type specific data: for ION_HEAP_TYPE_CMA the device
+ *		whose CMA area to allocate from, NULL for the default one
  *
  * Provided by the board file.
  */
@@ -72,8 +79,16 @@ struct ion_platform_heap {
 	const char *name;
 	ion_phys_addr_t base;
 	size_t size;
+	unsigned long flags;
+	void *priv;
 };
 
+/*
+ * Free the heap's buffers from a kernel thread rather than in the context
+ * that drops the last reference, typically an ION_IOC_FREE from userspace.
+ */
+#define ION_HEAP_FLAG_DEFER_FREE	(1 << 0)
+
 /**
  * struct ion_platform_data - array of platform heaps passed from board file
  * @nr:		number of structures in the array
@@ -1324,6 +1324,9 @@ struct task_struct {
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
+#ifdef CONFIG_ANDROID_LMK_ADJ_INDEX
+	struct hlist_node lowmem_node;	/* lowmemorykiller oom_score_adj index */
+#endif
 
 	struct mm_struct *mm, *active_mm;
 #ifdef CONFIG_COMPAT_BRK
@@ -2832,6 +2835,24 @@ static inline unsigned long rlimit_max(unsigned int limit)
 	return task_rlimit_max(current, limit);
 }
 
+#ifdef CONFIG_CPU_FREQ
+/*
+ * Called by the scheduler with the runqueue lock held, on the cpu the
+ * runqueue belongs to, whenever a task is enqueued or dequeued there and
+ * on every tick.  @time is the runqueue clock in ns and @nr_running the
+ * number of tasks now runnable on that cpu.
+ */
+struct update_util_data {
+	void (*func)(struct update_util_data *data, u64 time,
+		     unsigned long nr_running);
+};
+
+void cpufreq_add_update_util_hook(int cpu, struct update_util_data *data,
+		void (*func)(struct update_util_data *data, u64 time,
+			     unsigned long nr_running));
+void cpufreq_remove_update_util_hook(int cpu);
+#endif /* CONFIG_CPU_FREQ */
+
 #endif /* __KERNEL__ */
 
 #endif
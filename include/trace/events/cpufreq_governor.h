@@ -0,0 +1,50 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cpufreq_governor
+
+#if !defined(_TRACE_CPUFREQ_GOVERNOR_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_CPUFREQ_GOVERNOR_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Emitted by the load based governors each time they evaluate a cpu, in
+ * one format for all of them so that tools/cpufreq/governor-replay can
+ * feed a recorded workload to each governor.
+ *
+ * @load is the busy percentage measured at @cur kHz, @target the speed
+ * asked for as a result (@cur when the governor holds) and @reason a
+ * short word naming the rule that decided.
+ */
+TRACE_EVENT(cpufreq_governor_decision,
+	    TP_PROTO(const char *governor, unsigned int cpu,
+		     unsigned int load, unsigned int cur,
+		     unsigned int target, const char *reason),
+	    TP_ARGS(governor, cpu, load, cur, target, reason),
+
+	    TP_STRUCT__entry(
+		    __string(governor, governor)
+		    __field(unsigned int, cpu)
+		    __field(unsigned int, load)
+		    __field(unsigned int, cur)
+		    __field(unsigned int, target)
+		    __string(reason, reason)
+	    ),
+
+	    TP_fast_assign(
+		    __assign_str(governor, governor);
+		    __entry->cpu = cpu;
+		    __entry->load = load;
+		    __entry->cur = cur;
+		    __entry->target = target;
+		    __assign_str(reason, reason);
+	    ),
+
+	    TP_printk("governor=%s cpu=%u load=%u cur=%u targ=%u reason=%s",
+		      __get_str(governor), __entry->cpu, __entry->load,
+		      __entry->cur, __entry->target, __get_str(reason))
+);
+
+#endif /* _TRACE_CPUFREQ_GOVERNOR_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
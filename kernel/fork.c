@@ -1460,6 +1460,7 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 			__this_cpu_inc(process_counts);
 		}
 		attach_pid(p, PIDTYPE_PID, pid);
+		lowmem_task_add(p);
 		nr_threads++;
 	}
 
@@ -0,0 +1,55 @@
+/*
+ * Scheduler hooks for cpufreq governors
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+
+#include "sched.h"
+
+DEFINE_PER_CPU(struct update_util_data *, cpufreq_update_util_data);
+
+/**
+ * cpufreq_add_update_util_hook - have the scheduler report load on @cpu
+ * @cpu: cpu to report on
+ * @data: passed back to @func, and usually embedded in the caller's
+ *	  per-cpu state
+ * @func: called from enqueue, dequeue and the tick with the runqueue
+ *	  lock held, so it must neither sleep nor wake tasks up
+ *
+ * Only one hook can be installed per cpu.
+ */
+void cpufreq_add_update_util_hook(int cpu, struct update_util_data *data,
+		void (*func)(struct update_util_data *data, u64 time,
+			     unsigned long nr_running))
+{
+	if (WARN_ON(!data || !func))
+		return;
+
+	if (WARN_ON(per_cpu(cpufreq_update_util_data, cpu)))
+		return;
+
+	data->func = func;
+	rcu_assign_pointer(per_cpu(cpufreq_update_util_data, cpu), data);
+}
+EXPORT_SYMBOL_GPL(cpufreq_add_update_util_hook);
+
+/**
+ * cpufreq_remove_update_util_hook - stop reporting load on @cpu
+ * @cpu: cpu to stop reporting on
+ *
+ * The hook may still be running when this returns; callers must wait
+ * with synchronize_sched() before freeing what it uses.
+ */
+void cpufreq_remove_update_util_hook(int cpu)
+{
+	rcu_assign_pointer(per_cpu(cpufreq_update_util_data, cpu), NULL);
+}
+EXPORT_SYMBOL_GPL(cpufreq_remove_update_util_hook);
@@ -2214,6 +2214,7 @@ enqueue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 	if (!se)
 		inc_nr_running(rq);
 	hrtick_update(rq);
+	cpufreq_update_util(rq);
 }
 
 static void set_next_buddy(struct sched_entity *se);
@@ -2273,6 +2274,7 @@ static void dequeue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 	if (!se)
 		dec_nr_running(rq);
 	hrtick_update(rq);
+	cpufreq_update_util(rq);
 }
 
 #ifdef CONFIG_SMP
@@ -5168,6 +5170,8 @@ static void task_tick_fair(struct rq *rq, struct task_struct *curr, int queued)
 		cfs_rq = cfs_rq_of(se);
 		entity_tick(cfs_rq, se, queued);
 	}
+
+	cpufreq_update_util(rq);
 }
 
 /*
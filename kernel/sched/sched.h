@@ -921,6 +921,29 @@ static inline void dec_nr_running(struct rq *rq)
 	rq->nr_running--;
 }
 
+#ifdef CONFIG_CPU_FREQ
+DECLARE_PER_CPU(struct update_util_data *, cpufreq_update_util_data);
+
+/*
+ * Tell a cpufreq governor that has asked for it that the load on @rq
+ * changed.  Only the local runqueue is reported: the hook keeps per-cpu
+ * state and relies on running on the cpu it describes.
+ */
+static inline void cpufreq_update_util(struct rq *rq)
+{
+	struct update_util_data *data;
+
+	if (cpu_of(rq) != smp_processor_id())
+		return;
+
+	data = rcu_dereference_sched(__get_cpu_var(cpufreq_update_util_data));
+	if (data)
+		data->func(data, rq->clock, rq->nr_running);
+}
+#else
+static inline void cpufreq_update_util(struct rq *rq) { }
+#endif
+
 extern void update_rq_clock(struct rq *rq);
 
 extern void activate_task(struct rq *rq, struct task_struct *p, int flags);
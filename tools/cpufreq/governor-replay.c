@@ -0,0 +1,528 @@
+/*
+ * governor-replay: run a recorded cpu load trace through models of the
+ * ondemand, conservative and interactive cpufreq governors
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Record a workload on a device with
+ *
+ *	echo 1 > /sys/kernel/debug/tracing/events/cpufreq_governor/enable
+ *	... run the workload ...
+ *	cat /sys/kernel/debug/tracing/trace > trace.txt
+ *
+ * and replay it with "governor-replay trace.txt".  Each event gives the
+ * load seen at the speed the cpu was running at, which is turned into
+ * the work (in kHz) demanded over the time since the previous event.
+ * Every governor model is then run over that demand, sampling at its own
+ * rate and seeing the load its own choice of speed would have given, so
+ * all of them face an identical workload.
+ *
+ * Lines of the form "<time in us> <cpu> <load> <speed in kHz>" are
+ * accepted as well, for traces recorded or written by other means.
+ *
+ * The models follow dbs_check_cpu() in cpufreq_ondemand.c and
+ * cpufreq_conservative.c and cpufreq_interactive_eval() in
+ * cpufreq_interactive.c with their default tunables.  Interactive is
+ * modelled by its timer path at a fixed rate: idle entry and exit are not
+ * in the trace.  Speed changes are taken to be instantaneous.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+#define EVENT_NAME	"cpufreq_governor_decision:"
+#define MAX_FREQS	64
+
+struct sample {
+	double time;		/* end of the interval, in s */
+	double demand;		/* work done over it, in kHz */
+	unsigned int cur;	/* speed it was recorded at */
+};
+
+static struct sample *samples;
+static int nsamples;
+
+static unsigned int freqs[MAX_FREQS];
+static int nfreqs;
+
+enum relation { RELATION_L, RELATION_H };
+
+struct result {
+	double time_at[MAX_FREQS];
+	double work;		/* demanded, in kHz * s */
+	double excess;		/* demanded above the speed run at */
+	double energy;		/* busy time weighted by (f / fmax)^3 */
+	unsigned long transitions;
+};
+
+/* Tunables, defaulting to the kernel's */
+static double dbs_sampling_rate = 20000;
+static double interactive_timer_rate = 20000;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] <trace>\n"
+		"  -c <cpu>     replay events of this cpu (default: first seen)\n"
+		"  -f <list>    available speeds in kHz, comma separated\n"
+		"               (default: every speed found in the trace)\n"
+		"  -s <us>      ondemand/conservative sampling_rate (%.0f)\n"
+		"  -t <us>      interactive timer_rate (%.0f)\n"
+		"  -v           also show time spent at each speed\n",
+		prog, dbs_sampling_rate, interactive_timer_rate);
+	exit(1);
+}
+
+static int freq_index(unsigned int freq)
+{
+	int i;
+
+	for (i = 0; i < nfreqs; i++)
+		if (freqs[i] == freq)
+			return i;
+	return -1;
+}
+
+static void add_freq(unsigned int freq)
+{
+	int i;
+
+	if (!freq || freq_index(freq) >= 0)
+		return;
+	if (nfreqs == MAX_FREQS) {
+		fprintf(stderr, "too many speeds, use -f\n");
+		exit(1);
+	}
+
+	for (i = nfreqs; i > 0 && freqs[i - 1] > freq; i--)
+		freqs[i] = freqs[i - 1];
+	freqs[i] = freq;
+	nfreqs++;
+}
+
+/* Like cpufreq_frequency_table_target() within the whole table */
+static unsigned int table_target(double target, enum relation relation)
+{
+	int i;
+
+	if (relation == RELATION_L) {
+		for (i = 0; i < nfreqs; i++)
+			if (freqs[i] >= target)
+				return freqs[i];
+		return freqs[nfreqs - 1];
+	}
+
+	for (i = nfreqs - 1; i >= 0; i--)
+		if (freqs[i] <= target)
+			return freqs[i];
+	return freqs[0];
+}
+
+static int parse_line(const char *line, double *time, unsigned int *cpu,
+		      unsigned int *load, unsigned int *cur,
+		      unsigned int *targ)
+{
+	const char *event = strstr(line, EVENT_NAME);
+	const char *ts;
+	char governor[32];
+	double us;
+
+	if (!event) {
+		*targ = 0;
+		if (sscanf(line, "%lf %u %u %u", &us, cpu, load, cur) != 4)
+			return 0;
+		*time = us / 1e6;
+		return 1;
+	}
+
+	/* "<task>-<pid> [cpu] <flags> <seconds>: cpufreq_governor_..." */
+	ts = event - 2;
+	while (ts > line && ts[-1] != ' ')
+		ts--;
+	*time = strtod(ts, NULL);
+
+	return sscanf(event + strlen(EVENT_NAME),
+		      " governor=%31s cpu=%u load=%u cur=%u targ=%u",
+		      governor, cpu, load, cur, targ) == 5;
+}
+
+static void read_trace(const char *path, int want_cpu, int table_given)
+{
+	FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	char line[512];
+	double time;
+	double start = -1;
+	unsigned int cpu, load, cur, targ;
+	int size = 0;
+
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || !parse_line(line, &time, &cpu, &load,
+						  &cur, &targ))
+			continue;
+		if (want_cpu < 0)
+			want_cpu = cpu;
+		if (cpu != (unsigned int)want_cpu || !cur)
+			continue;
+
+		if (!table_given) {
+			add_freq(cur);
+			add_freq(targ);
+		}
+
+		/* the first event only marks where the trace starts */
+		if (start < 0) {
+			start = time;
+			continue;
+		}
+		if (nsamples && time - start <= samples[nsamples - 1].time)
+			continue;
+
+		if (nsamples == size) {
+			size = size ? size * 2 : 1024;
+			samples = realloc(samples, size * sizeof(*samples));
+			if (!samples) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+
+		samples[nsamples].time = time - start;
+		samples[nsamples].demand = (double)load * cur / 100;
+		samples[nsamples].cur = cur;
+		nsamples++;
+	}
+
+	if (f != stdin)
+		fclose(f);
+
+	if (nsamples < 2) {
+		fprintf(stderr, "%s: not enough events for cpu %d\n", path,
+			want_cpu);
+		exit(1);
+	}
+}
+
+/*
+ * Account running at @freq from @t0 to @t1 s into @res, returning the
+ * load in percent that a governor would measure over that window.
+ * @pos caches where the previous window ended in the trace.
+ */
+static unsigned int run_window(double t0, double t1, unsigned int freq,
+			       int *pos, struct result *res)
+{
+	double fmax = freqs[nfreqs - 1];
+	double busy = 0;
+	double begin = *pos ? samples[*pos - 1].time : 0;
+	int i;
+
+	for (i = *pos; i < nsamples && begin < t1; i++) {
+		double from = begin > t0 ? begin : t0;
+		double to = samples[i].time < t1 ? samples[i].time : t1;
+		double demand = samples[i].demand;
+		double len = to - from;
+
+		begin = samples[i].time;
+		if (len <= 0)
+			continue;
+
+		res->work += demand * len;
+		if (demand > freq) {
+			res->excess += (demand - freq) * len;
+			busy += len;
+		} else {
+			busy += demand * len / freq;
+		}
+	}
+
+	/* the next window starts in the sample this one ended in */
+	*pos = i > 0 && samples[i - 1].time > t1 ? i - 1 : i;
+
+	res->time_at[freq_index(freq)] += t1 - t0;
+	res->energy += busy * (freq / fmax) * (freq / fmax) * (freq / fmax);
+	return (unsigned int)(100 * busy / (t1 - t0) + 0.5);
+}
+
+static double trace_end(void)
+{
+	return samples[nsamples - 1].time;
+}
+
+static void set_freq(unsigned int *cur, unsigned int freq,
+		     struct result *res)
+{
+	if (freq != *cur)
+		res->transitions++;
+	*cur = freq;
+}
+
+static void replay_recorded(struct result *res)
+{
+	unsigned int cur = samples[0].cur;
+	int pos = 0;
+	double t = 0;
+	int i;
+
+	for (i = 0; i < nsamples; i++) {
+		set_freq(&cur, samples[i].cur, res);
+		run_window(t, samples[i].time, cur, &pos, res);
+		t = samples[i].time;
+	}
+}
+
+#define OD_UP_THRESHOLD		80
+#define OD_DOWN_DIFFERENTIAL	10
+
+static void replay_ondemand(struct result *res)
+{
+	unsigned int min = freqs[0], max = freqs[nfreqs - 1];
+	unsigned int cur = samples[0].cur;
+	double period = dbs_sampling_rate / 1e6;
+	int pos = 0;
+	double t;
+
+	for (t = 0; t + period <= trace_end(); t += period) {
+		unsigned int load = run_window(t, t + period, cur, &pos, res);
+		double load_freq = (double)load * cur;
+		double freq_next;
+
+		if (load_freq > OD_UP_THRESHOLD * cur) {
+			set_freq(&cur, table_target(max, RELATION_H), res);
+			continue;
+		}
+
+		if (cur == min)
+			continue;
+
+		if (load_freq < (OD_UP_THRESHOLD - OD_DOWN_DIFFERENTIAL) * cur) {
+			freq_next = load_freq /
+				(OD_UP_THRESHOLD - OD_DOWN_DIFFERENTIAL);
+			if (freq_next < min)
+				freq_next = min;
+			set_freq(&cur, table_target(freq_next, RELATION_L), res);
+		}
+	}
+}
+
+#define CS_UP_THRESHOLD		80
+#define CS_DOWN_THRESHOLD	20
+#define CS_FREQ_STEP		5
+
+static void replay_conservative(struct result *res)
+{
+	unsigned int min = freqs[0], max = freqs[nfreqs - 1];
+	unsigned int cur = samples[0].cur;
+	double requested = cur;
+	double step = CS_FREQ_STEP * max / 100.0;
+	double period = dbs_sampling_rate / 1e6;
+	int pos = 0;
+	double t;
+
+	for (t = 0; t + period <= trace_end(); t += period) {
+		unsigned int load = run_window(t, t + period, cur, &pos, res);
+
+		if (load > CS_UP_THRESHOLD) {
+			if (requested == max)
+				continue;
+			requested += step;
+			if (requested > max)
+				requested = max;
+			set_freq(&cur, table_target(requested, RELATION_H), res);
+			continue;
+		}
+
+		if (load < CS_DOWN_THRESHOLD - 10) {
+			requested -= step;
+			if (requested < min)
+				requested = min;
+			if (cur == min)
+				continue;
+			set_freq(&cur, table_target(requested, RELATION_H), res);
+		}
+	}
+}
+
+#define IN_GO_HISPEED_LOAD	85
+#define IN_TARGET_LOAD		100
+#define IN_MIN_SAMPLE_TIME	0.080
+#define IN_ABOVE_HISPEED_DELAY	0.020
+
+static void replay_interactive(struct result *res)
+{
+	unsigned int min = freqs[0], max = freqs[nfreqs - 1];
+	unsigned int hispeed_freq = max;
+	unsigned int cur = samples[0].cur;
+	unsigned int floor_freq = cur;
+	double floor_validate_time = 0;
+	double target_set_time = 0;
+	double busy_since_change = 0;
+	double period = interactive_timer_rate / 1e6;
+	int pos = 0;
+	double t;
+
+	for (t = 0; t + period <= trace_end(); t += period) {
+		double now = t + period;
+		unsigned int cpu_load;
+		unsigned int load_since_change;
+		unsigned int new_freq;
+
+		cpu_load = run_window(t, now, cur, &pos, res);
+		busy_since_change += cpu_load * period / 100;
+		load_since_change = (unsigned int)(100 * busy_since_change /
+						   (now - target_set_time));
+		if (load_since_change > cpu_load)
+			cpu_load = load_since_change;
+
+		if (cpu_load >= IN_GO_HISPEED_LOAD) {
+			if (cur <= min) {
+				new_freq = hispeed_freq;
+			} else {
+				new_freq = (double)max * cpu_load /
+					IN_TARGET_LOAD;
+				if (new_freq < hispeed_freq)
+					new_freq = hispeed_freq;
+				if (cur == hispeed_freq &&
+				    new_freq > hispeed_freq &&
+				    now - target_set_time <
+				    IN_ABOVE_HISPEED_DELAY)
+					continue;
+			}
+		} else {
+			new_freq = (double)max * cpu_load / IN_TARGET_LOAD;
+		}
+
+		new_freq = table_target(new_freq, RELATION_H);
+
+		if (new_freq < floor_freq &&
+		    now - floor_validate_time < IN_MIN_SAMPLE_TIME)
+			continue;
+
+		floor_freq = new_freq;
+		floor_validate_time = now;
+
+		if (new_freq == cur)
+			continue;
+
+		target_set_time = now;
+		busy_since_change = 0;
+		set_freq(&cur, new_freq, res);
+	}
+}
+
+struct governor {
+	const char *name;
+	void (*replay)(struct result *res);
+};
+
+static const struct governor governors[] = {
+	{ "recorded",		replay_recorded },
+	{ "ondemand",		replay_ondemand },
+	{ "conservative",	replay_conservative },
+	{ "interactive",	replay_interactive },
+};
+
+static void print_result(const char *name, const struct result *res,
+			 int verbose)
+{
+	double total = 0, avg = 0;
+	int i;
+
+	for (i = 0; i < nfreqs; i++) {
+		total += res->time_at[i];
+		avg += res->time_at[i] * freqs[i];
+	}
+
+	printf("%-13s %10.0f %11lu %9.2f %9.3f\n", name, avg / total,
+	       res->transitions,
+	       res->work ? 100 * res->excess / res->work : 0.0,
+	       res->work ? res->energy * freqs[nfreqs - 1] / res->work : 0.0);
+
+	if (!verbose)
+		return;
+	for (i = 0; i < nfreqs; i++)
+		if (res->time_at[i])
+			printf("  %10u kHz %6.2f%%\n", freqs[i],
+			       100 * res->time_at[i] / total);
+}
+
+int main(int argc, char *argv[])
+{
+	int want_cpu = -1;
+	int verbose = 0;
+	char *list = NULL;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:f:s:t:vh")) != -1) {
+		switch (opt) {
+		case 'c':
+			want_cpu = atoi(optarg);
+			break;
+		case 'f':
+			list = optarg;
+			break;
+		case 's':
+			dbs_sampling_rate = atof(optarg);
+			break;
+		case 't':
+			interactive_timer_rate = atof(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || dbs_sampling_rate <= 0 ||
+	    interactive_timer_rate <= 0)
+		usage(argv[0]);
+
+	if (list) {
+		char *tok;
+
+		for (tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+			add_freq(strtoul(tok, NULL, 0));
+	}
+
+	read_trace(argv[optind], want_cpu, nfreqs > 0);
+
+	/* speeds recorded outside the given table are run as the nearest */
+	for (i = 0; i < (unsigned int)nsamples; i++)
+		samples[i].cur = table_target(samples[i].cur, RELATION_L);
+
+	printf("%d events over %.3f s, %d speeds from %u to %u kHz\n\n",
+	       nsamples, trace_end(), nfreqs, freqs[0], freqs[nfreqs - 1]);
+	printf("%-13s %10s %11s %9s %9s\n", "governor", "avg kHz",
+	       "transitions", "starved%", "energy");
+
+	for (i = 0; i < sizeof(governors) / sizeof(governors[0]); i++) {
+		struct result res;
+
+		memset(&res, 0, sizeof(res));
+		governors[i].replay(&res);
+		print_result(governors[i].name, &res, verbose);
+	}
+
+	printf("\nstarved%%: work demanded above the speed run at\n"
+	       "energy: busy time * (f / fmax)^3, relative to running "
+	       "the work at fmax\n");
+	return 0;
+}
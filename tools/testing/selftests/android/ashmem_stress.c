@@ -0,0 +1,254 @@
+/*
+ * ashmem_stress.c - ashmem pin/unpin throughput under shrinking
+ *
+ * Sweeps the number of threads and has each of them own an ashmem area,
+ * the way every app has its own, and unpin and re-pin ranges of it as
+ * fast as it can.  Meanwhile another thread keeps purging all unpinned
+ * ranges with ASHMEM_PURGE_ALL_CACHES, standing in for the shrinker
+ * under memory pressure.  Areas are locked individually, so the rate
+ * should scale with the number of threads and the purging should only
+ * cost the pages it takes.
+ *
+ * Purging needs CAP_SYS_ADMIN; without it only pin/unpin is measured.
+ * -n turns the purging off to get a baseline.
+ *
+ * Usage: ashmem_stress [-t max_threads] [-d seconds] [-p pages] [-n]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/types.h>
+
+#include "ashmem.h"
+
+#define ASHMEM_DEV		"/dev/ashmem"
+#define PAGE_SZ			4096
+
+struct pinner {
+	pthread_t thread;
+	size_t pages;
+	volatile int *stop;
+	unsigned long ops;
+	unsigned long purged;
+	int err;
+};
+
+struct purger {
+	pthread_t thread;
+	volatile int *stop;
+	unsigned long purges;
+	int err;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *pinner_main(void *arg)
+{
+	struct pinner *p = arg;
+	unsigned int seed = (unsigned long)p;
+	struct ashmem_pin pin;
+	char *map;
+	size_t i;
+	int fd, ret;
+
+	fd = open(ASHMEM_DEV, O_RDWR);
+	if (fd < 0) {
+		p->err = errno;
+		return NULL;
+	}
+	if (ioctl(fd, ASHMEM_SET_SIZE, p->pages * PAGE_SZ) < 0) {
+		p->err = errno;
+		goto out;
+	}
+	map = mmap(NULL, p->pages * PAGE_SZ, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		p->err = errno;
+		goto out;
+	}
+
+	while (!*p->stop) {
+		/* a random range of up to a quarter of the area */
+		pin.offset = rand_r(&seed) % p->pages;
+		pin.len = 1 + rand_r(&seed) % (p->pages / 4 + 1);
+		if (pin.offset + pin.len > p->pages)
+			pin.len = p->pages - pin.offset;
+		pin.offset *= PAGE_SZ;
+		pin.len *= PAGE_SZ;
+
+		if (ioctl(fd, ASHMEM_UNPIN, &pin) < 0) {
+			p->err = errno;
+			break;
+		}
+		ret = ioctl(fd, ASHMEM_PIN, &pin);
+		if (ret < 0) {
+			p->err = errno;
+			break;
+		}
+		if (ret == ASHMEM_WAS_PURGED) {
+			/* repopulate what the purge took */
+			for (i = 0; i < pin.len; i += PAGE_SZ)
+				map[pin.offset + i] = 1;
+			p->purged++;
+		}
+		p->ops += 2;
+	}
+
+	munmap(map, p->pages * PAGE_SZ);
+out:
+	close(fd);
+	return NULL;
+}
+
+static void *purger_main(void *arg)
+{
+	struct purger *p = arg;
+	int fd;
+
+	fd = open(ASHMEM_DEV, O_RDWR);
+	if (fd < 0) {
+		p->err = errno;
+		return NULL;
+	}
+	while (!*p->stop) {
+		if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0) {
+			p->err = errno;
+			break;
+		}
+		p->purges++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static int run(int nr, double duration, size_t pages, int purge,
+	       double *rate, double *purge_rate, unsigned long *purged)
+{
+	struct pinner *pinners;
+	struct purger purger;
+	volatile int stop = 0;
+	unsigned long total = 0;
+	double start, elapsed;
+	int i, err = 0;
+
+	pinners = calloc(nr, sizeof(*pinners));
+	if (!pinners)
+		return ENOMEM;
+	memset(&purger, 0, sizeof(purger));
+	purger.stop = &stop;
+	*purged = 0;
+
+	start = now_sec();
+	if (purge && pthread_create(&purger.thread, NULL, purger_main,
+				    &purger))
+		purge = 0;
+	for (i = 0; i < nr; i++) {
+		pinners[i].pages = pages;
+		pinners[i].stop = &stop;
+		if (pthread_create(&pinners[i].thread, NULL, pinner_main,
+				   &pinners[i])) {
+			stop = 1;
+			nr = i;
+			err = EAGAIN;
+			break;
+		}
+	}
+	if (!err)
+		usleep(duration * 1e6);
+	stop = 1;
+	for (i = 0; i < nr; i++) {
+		pthread_join(pinners[i].thread, NULL);
+		total += pinners[i].ops;
+		*purged += pinners[i].purged;
+		if (pinners[i].err)
+			err = pinners[i].err;
+	}
+	if (purge) {
+		pthread_join(purger.thread, NULL);
+		if (purger.err)
+			err = purger.err;
+	}
+	elapsed = now_sec() - start;
+	*rate = total / elapsed;
+	*purge_rate = purger.purges / elapsed;
+	free(pinners);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	double duration = 2, rate, purge_rate;
+	unsigned long purged;
+	size_t pages = 256;
+	int purge = 1;
+	int opt, nr, err, fd;
+
+	while ((opt = getopt(argc, argv, "t:d:p:n")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'p':
+			pages = atoi(optarg);
+			break;
+		case 'n':
+			purge = 0;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] "
+				"[-d seconds] [-p pages] [-n]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads < 1 || pages < 1) {
+		fprintf(stderr, "ashmem_stress: bad arguments\n");
+		return 1;
+	}
+
+	fd = open(ASHMEM_DEV, O_RDWR);
+	if (fd < 0) {
+		printf("ashmem_stress: %s not available, skipping\n",
+		       ASHMEM_DEV);
+		return 0;
+	}
+	if (purge && ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0) {
+		printf("ashmem_stress: cannot purge (%s), measuring "
+		       "pin/unpin only\n", strerror(errno));
+		purge = 0;
+	}
+	close(fd);
+
+	printf("%8s %16s %16s %12s %12s\n", "threads", "pin+unpin/s",
+	       "per thread", "purges/s", "repins");
+	for (nr = 1; nr <= max_threads; nr *= 2) {
+		err = run(nr, duration, pages, purge, &rate, &purge_rate,
+			  &purged);
+		if (err) {
+			printf("ashmem_stress: failed at %d threads: %s\n",
+			       nr, strerror(err));
+			return 1;
+		}
+		printf("%8d %16.0f %16.0f %12.0f %12lu\n", nr, rate,
+		       rate / nr, purge_rate, purged);
+	}
+
+	return 0;
+}
@@ -0,0 +1,590 @@
+/*
+ * binder_stress.c - binder transaction throughput benchmark
+ *
+ * Starts a private context manager that acts as a tiny service registry,
+ * one echo server process per client and then sweeps the number of client
+ * processes, each hammering its own server with synchronous transactions.
+ * Every client/server pair is independent of the others, so on a driver
+ * without a global lock the aggregate rate should scale with the number
+ * of pairs until the CPUs are saturated.
+ *
+ * With -l it instead measures the round trip latency of a single pair
+ * for payloads from 4KB to 1MB, comparing a payload flattened by the
+ * sender before BC_TRANSACTION with the same payload passed as iovecs to
+ * BC_TRANSACTION_SG.
+ *
+ * The context manager can only be registered once per boot, so stop
+ * servicemanager (or run on a system without one) before running this.
+ *
+ * Usage: binder_stress [-t max_threads] [-d seconds] [-s payload_bytes]
+ *        binder_stress -l [-d seconds]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define BINDER_DEV		"/dev/binder"
+#define BINDER_MAP_SIZE		(4 * 1024 * 1024)
+
+#define LATENCY_MIN_SIZE	(4 * 1024)
+#define LATENCY_MAX_SIZE	(1024 * 1024)
+#define LATENCY_SEGMENTS	4
+
+#define REGISTRY_ADD		1
+#define REGISTRY_GET		2
+#define ECHO_PING		3
+
+struct binder_ctx {
+	int fd;
+	void *map;
+};
+
+struct registry_obj {
+	uint32_t idx;
+	uint32_t status;
+	struct flat_binder_object obj;
+};
+
+static int binder_ctx_open(struct binder_ctx *ctx)
+{
+	ctx->fd = open(BINDER_DEV, O_RDWR);
+	if (ctx->fd < 0)
+		return -1;
+	ctx->map = mmap(NULL, BINDER_MAP_SIZE, PROT_READ, MAP_PRIVATE,
+			ctx->fd, 0);
+	if (ctx->map == MAP_FAILED) {
+		close(ctx->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int binder_write(struct binder_ctx *ctx, void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	return ioctl(ctx->fd, BINDER_WRITE_READ, &bwr);
+}
+
+static void binder_free_buffer(struct binder_ctx *ctx, const void *data)
+{
+	struct {
+		uint32_t cmd;
+		const void *ptr;
+	} __attribute__((packed)) fb = { BC_FREE_BUFFER, data };
+
+	binder_write(ctx, &fb, sizeof(fb));
+}
+
+static void binder_ref(struct binder_ctx *ctx, uint32_t cmd, uint32_t handle)
+{
+	uint32_t buf[2] = { cmd, handle };
+
+	binder_write(ctx, buf, sizeof(buf));
+}
+
+/* Answer the reference count requests the driver sends to node owners. */
+static void binder_ack_refs(struct binder_ctx *ctx, uint32_t cmd,
+			    struct binder_ptr_cookie *pc)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_ptr_cookie pc;
+	} __attribute__((packed)) ack;
+
+	ack.cmd = cmd == BR_INCREFS ? BC_INCREFS_DONE : BC_ACQUIRE_DONE;
+	ack.pc = *pc;
+	binder_write(ctx, &ack, sizeof(ack));
+}
+
+typedef void (*binder_handler)(struct binder_ctx *ctx,
+			       struct binder_transaction_data *txn);
+
+/*
+ * Read and dispatch driver commands until a reply arrives (when @reply is
+ * non-NULL) or forever, handing incoming transactions to @handler.
+ */
+static int binder_loop(struct binder_ctx *ctx, binder_handler handler,
+		       struct binder_transaction_data *reply)
+{
+	uint32_t readbuf[128];
+	struct binder_write_read bwr;
+
+	for (;;) {
+		char *ptr, *end;
+
+		memset(&bwr, 0, sizeof(bwr));
+		bwr.read_size = sizeof(readbuf);
+		bwr.read_buffer = (unsigned long)readbuf;
+		if (ioctl(ctx->fd, BINDER_WRITE_READ, &bwr) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		ptr = (char *)readbuf;
+		end = ptr + bwr.read_consumed;
+		while (ptr < end) {
+			uint32_t cmd = *(uint32_t *)ptr;
+
+			ptr += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				binder_ack_refs(ctx, cmd, (void *)ptr);
+				ptr += sizeof(struct binder_ptr_cookie);
+				break;
+			case BR_RELEASE:
+			case BR_DECREFS:
+				ptr += sizeof(struct binder_ptr_cookie);
+				break;
+			case BR_TRANSACTION:
+				if (handler)
+					handler(ctx, (void *)ptr);
+				ptr += sizeof(struct binder_transaction_data);
+				break;
+			case BR_REPLY:
+				memcpy(reply, ptr, sizeof(*reply));
+				return 0;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				return -1;
+			default:
+				fprintf(stderr, "unexpected binder command %x\n",
+					cmd);
+				return -1;
+			}
+		}
+	}
+}
+
+static int binder_send(struct binder_ctx *ctx, uint32_t cmd, uint32_t handle,
+		       uint32_t code, const void *data, size_t size,
+		       const size_t *offsets, size_t offsets_size)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_transaction_data txn;
+	} __attribute__((packed)) wr;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.cmd = cmd;
+	wr.txn.target.handle = handle;
+	wr.txn.code = code;
+	wr.txn.data_size = size;
+	wr.txn.offsets_size = offsets_size;
+	wr.txn.data.ptr.buffer = data;
+	wr.txn.data.ptr.offsets = offsets;
+	return binder_write(ctx, &wr, sizeof(wr));
+}
+
+static int binder_call_sg(struct binder_ctx *ctx, uint32_t handle,
+			  uint32_t code, const struct iovec *iov, int iov_count,
+			  struct binder_transaction_data *reply)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_transaction_data_sg sg;
+	} __attribute__((packed)) wr;
+	int i;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.cmd = BC_TRANSACTION_SG;
+	wr.sg.transaction_data.target.handle = handle;
+	wr.sg.transaction_data.code = code;
+	for (i = 0; i < iov_count; i++)
+		wr.sg.transaction_data.data_size += iov[i].iov_len;
+	wr.sg.iov = iov;
+	wr.sg.iov_count = iov_count;
+	if (binder_write(ctx, &wr, sizeof(wr)) < 0)
+		return -1;
+	return binder_loop(ctx, NULL, reply);
+}
+
+static int binder_call(struct binder_ctx *ctx, uint32_t handle, uint32_t code,
+		       const void *data, size_t size, const size_t *offsets,
+		       size_t offsets_size,
+		       struct binder_transaction_data *reply)
+{
+	if (binder_send(ctx, BC_TRANSACTION, handle, code, data, size,
+			offsets, offsets_size) < 0)
+		return -1;
+	return binder_loop(ctx, NULL, reply);
+}
+
+/* registry: the context manager, mapping an index to a server handle */
+
+static uint32_t *registry_handles;
+static int registry_size;
+
+static void registry_handler(struct binder_ctx *ctx,
+			     struct binder_transaction_data *txn)
+{
+	const struct registry_obj *in = txn->data.ptr.buffer;
+	struct registry_obj out;
+	size_t offset = offsetof(struct registry_obj, obj);
+	int has_obj = 0;
+
+	memset(&out, 0, sizeof(out));
+	out.status = 1;
+	if (txn->data_size >= sizeof(*in) && in->idx < registry_size) {
+		out.idx = in->idx;
+		if (txn->code == REGISTRY_ADD &&
+		    in->obj.type == BINDER_TYPE_HANDLE) {
+			registry_handles[in->idx] = in->obj.handle;
+			binder_ref(ctx, BC_ACQUIRE, in->obj.handle);
+			out.status = 0;
+		} else if (txn->code == REGISTRY_GET &&
+			   registry_handles[in->idx]) {
+			out.obj.type = BINDER_TYPE_HANDLE;
+			out.obj.handle = registry_handles[in->idx];
+			out.status = 0;
+			has_obj = 1;
+		}
+	}
+	binder_free_buffer(ctx, txn->data.ptr.buffer);
+	binder_send(ctx, BC_REPLY, 0, 0, &out, sizeof(out),
+		    has_obj ? &offset : NULL, has_obj ? sizeof(offset) : 0);
+}
+
+static void echo_handler(struct binder_ctx *ctx,
+			 struct binder_transaction_data *txn)
+{
+	uint32_t status = 0;
+
+	binder_free_buffer(ctx, txn->data.ptr.buffer);
+	binder_send(ctx, BC_REPLY, 0, 0, &status, sizeof(status), NULL, 0);
+}
+
+static pid_t start_registry(int size)
+{
+	struct binder_ctx ctx;
+	uint32_t cmd = BC_ENTER_LOOPER;
+	int pipefd[2];
+	char ok = 0;
+	pid_t pid;
+
+	if (pipe(pipefd))
+		return -1;
+	pid = fork();
+	if (pid) {
+		close(pipefd[1]);
+		if (read(pipefd[0], &ok, 1) != 1 || !ok) {
+			waitpid(pid, NULL, 0);
+			pid = -1;
+		}
+		close(pipefd[0]);
+		return pid;
+	}
+	close(pipefd[0]);
+	registry_size = size;
+	registry_handles = calloc(size, sizeof(*registry_handles));
+	if (!registry_handles || binder_ctx_open(&ctx) ||
+	    ioctl(ctx.fd, BINDER_SET_CONTEXT_MGR, 0)) {
+		perror("binder_stress: context manager");
+		exit(1);
+	}
+	ok = 1;
+	if (write(pipefd[1], &ok, 1) != 1)
+		exit(1);
+	close(pipefd[1]);
+	binder_write(&ctx, &cmd, sizeof(cmd));
+	binder_loop(&ctx, registry_handler, NULL);
+	exit(0);
+}
+
+static pid_t start_server(int idx)
+{
+	struct binder_ctx ctx;
+	struct binder_transaction_data reply;
+	struct registry_obj req;
+	size_t offset = offsetof(struct registry_obj, obj);
+	uint32_t cmd = BC_ENTER_LOOPER;
+	pid_t pid;
+
+	pid = fork();
+	if (pid)
+		return pid;
+	if (binder_ctx_open(&ctx))
+		exit(1);
+	memset(&req, 0, sizeof(req));
+	req.idx = idx;
+	req.obj.type = BINDER_TYPE_BINDER;
+	req.obj.binder = (void *)(uintptr_t)(idx + 1);
+	req.obj.cookie = NULL;
+	if (binder_call(&ctx, 0, REGISTRY_ADD, &req, sizeof(req), &offset,
+			sizeof(offset), &reply))
+		exit(1);
+	binder_free_buffer(&ctx, reply.data.ptr.buffer);
+	binder_write(&ctx, &cmd, sizeof(cmd));
+	binder_loop(&ctx, echo_handler, NULL);
+	exit(0);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int lookup_server(struct binder_ctx *ctx, int idx, uint32_t *handle)
+{
+	struct binder_transaction_data reply;
+	struct registry_obj req;
+	const struct registry_obj *out;
+	int tries;
+
+	memset(&req, 0, sizeof(req));
+	req.idx = idx;
+	for (tries = 0; tries < 1000; tries++) {
+		if (binder_call(ctx, 0, REGISTRY_GET, &req, sizeof(req),
+				NULL, 0, &reply))
+			return -1;
+		out = reply.data.ptr.buffer;
+		if (out->status == 0) {
+			*handle = out->obj.handle;
+			binder_ref(ctx, BC_ACQUIRE, *handle);
+			binder_free_buffer(ctx, reply.data.ptr.buffer);
+			return 0;
+		}
+		binder_free_buffer(ctx, reply.data.ptr.buffer);
+		usleep(1000);
+	}
+	return -1;
+}
+
+static void run_client(int idx, int fd, double duration, size_t payload)
+{
+	struct binder_ctx ctx;
+	struct binder_transaction_data reply;
+	unsigned long count = 0;
+	uint32_t handle;
+	double end;
+	void *data;
+
+	data = calloc(1, payload);
+	if (!data || binder_ctx_open(&ctx) || lookup_server(&ctx, idx, &handle))
+		exit(1);
+	end = now() + duration;
+	while (now() < end) {
+		if (binder_call(&ctx, handle, ECHO_PING, data, payload,
+				NULL, 0, &reply))
+			exit(1);
+		binder_free_buffer(&ctx, reply.data.ptr.buffer);
+		count++;
+	}
+	if (write(fd, &count, sizeof(count)) != sizeof(count))
+		exit(1);
+	exit(0);
+}
+
+/*
+ * Average round trip in microseconds for @size bytes split over
+ * LATENCY_SEGMENTS separate user buffers, either flattened into one
+ * buffer first or handed to the driver as iovecs.
+ */
+static double measure_latency(struct binder_ctx *ctx, uint32_t handle,
+			      char *flat, char **segs, size_t size,
+			      double duration, int use_sg)
+{
+	struct binder_transaction_data reply;
+	struct iovec iov[LATENCY_SEGMENTS];
+	size_t seg_size = size / LATENCY_SEGMENTS;
+	unsigned long count = 0;
+	double start, end;
+	int i;
+
+	for (i = 0; i < LATENCY_SEGMENTS; i++) {
+		iov[i].iov_base = segs[i];
+		iov[i].iov_len = seg_size;
+	}
+	start = now();
+	end = start + duration;
+	do {
+		int ret;
+
+		if (use_sg) {
+			ret = binder_call_sg(ctx, handle, ECHO_PING, iov,
+					     LATENCY_SEGMENTS, &reply);
+		} else {
+			for (i = 0; i < LATENCY_SEGMENTS; i++)
+				memcpy(flat + i * seg_size, segs[i], seg_size);
+			ret = binder_call(ctx, handle, ECHO_PING, flat, size,
+					  NULL, 0, &reply);
+		}
+		if (ret)
+			return -1;
+		binder_free_buffer(ctx, reply.data.ptr.buffer);
+		count++;
+	} while (now() < end);
+	return (now() - start) * 1e6 / count;
+}
+
+static int run_latency(double duration)
+{
+	struct binder_ctx ctx;
+	char *flat, *segs[LATENCY_SEGMENTS];
+	uint32_t handle;
+	size_t size;
+	int i;
+
+	flat = malloc(LATENCY_MAX_SIZE);
+	for (i = 0; i < LATENCY_SEGMENTS; i++) {
+		segs[i] = malloc(LATENCY_MAX_SIZE / LATENCY_SEGMENTS);
+		if (!segs[i])
+			return -1;
+		memset(segs[i], i, LATENCY_MAX_SIZE / LATENCY_SEGMENTS);
+	}
+	if (!flat || binder_ctx_open(&ctx) || lookup_server(&ctx, 0, &handle))
+		return -1;
+
+	printf("%10s %14s %14s\n", "bytes", "flat us", "iovec us");
+	for (size = LATENCY_MIN_SIZE; size <= LATENCY_MAX_SIZE; size *= 2) {
+		double flat_us, sg_us;
+
+		flat_us = measure_latency(&ctx, handle, flat, segs, size,
+					  duration, 0);
+		sg_us = measure_latency(&ctx, handle, flat, segs, size,
+					duration, 1);
+		if (flat_us < 0 || sg_us < 0)
+			return -1;
+		printf("%10zu %14.1f %14.1f\n", size, flat_us, sg_us);
+	}
+	return 0;
+}
+
+static double run_clients(int nr, double duration, size_t payload)
+{
+	unsigned long total = 0, count;
+	int pipefd[2];
+	int i, failed = 0;
+
+	if (pipe(pipefd))
+		return -1;
+	for (i = 0; i < nr; i++) {
+		if (fork() == 0) {
+			close(pipefd[0]);
+			run_client(i, pipefd[1], duration, payload);
+		}
+	}
+	close(pipefd[1]);
+	for (i = 0; i < nr; i++) {
+		int status;
+
+		wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed = 1;
+	}
+	while (read(pipefd[0], &count, sizeof(count)) == sizeof(count))
+		total += count;
+	close(pipefd[0]);
+	return failed ? -1 : total / duration;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = 8;
+	double duration = 2;
+	size_t payload = 128;
+	pid_t registry, *servers;
+	int opt, nr, i, ret = 0;
+	int latency = 0;
+
+	while ((opt = getopt(argc, argv, "t:d:s:l")) != -1) {
+		switch (opt) {
+		case 'l':
+			latency = 1;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 's':
+			payload = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] "
+				"[-d seconds] [-s payload_bytes] [-l]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads < 1 || duration <= 0)
+		return 1;
+	if (latency)
+		max_threads = 1;
+
+	if (access(BINDER_DEV, R_OK | W_OK)) {
+		printf("binder_stress: %s not available, skipping\n",
+		       BINDER_DEV);
+		return 0;
+	}
+
+	registry = start_registry(max_threads);
+	if (registry < 0) {
+		printf("binder_stress: cannot become context manager "
+		       "(is servicemanager running?), skipping\n");
+		return 0;
+	}
+	servers = calloc(max_threads, sizeof(*servers));
+	if (!servers)
+		return 1;
+	for (i = 0; i < max_threads; i++)
+		servers[i] = start_server(i);
+
+	if (latency) {
+		if (run_latency(duration)) {
+			printf("binder_stress: latency run failed\n");
+			ret = 1;
+		}
+		goto out;
+	}
+
+	printf("%8s %16s %16s\n", "threads", "transactions/s", "per thread");
+	for (nr = 1; nr <= max_threads; nr *= 2) {
+		double rate = run_clients(nr, duration, payload);
+
+		if (rate < 0) {
+			printf("binder_stress: clients failed at %d threads\n",
+			       nr);
+			ret = 1;
+			break;
+		}
+		printf("%8d %16.0f %16.0f\n", nr, rate, rate / nr);
+		if (nr < max_threads && nr * 2 > max_threads)
+			nr = max_threads / 2;
+	}
+
+out:
+	for (i = 0; i < max_threads; i++)
+		kill(servers[i], SIGTERM);
+	kill(registry, SIGTERM);
+	while (wait(NULL) > 0)
+		;
+	return ret;
+}
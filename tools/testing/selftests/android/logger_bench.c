@@ -0,0 +1,176 @@
+/*
+ * logger_bench.c - Android logger write throughput benchmark
+ *
+ * Sweeps the number of writer threads and has each of them write log
+ * messages to the same log device, the way liblog does: one writev() of
+ * priority, tag and message per entry.  Every thread opens its own
+ * descriptor, so the only thing they share is the log itself and the
+ * aggregate rate shows how well the driver copes with concurrent writers.
+ *
+ * Writing floods the log, so run it against a log nobody is reading
+ * (log_radio by default) or expect logcat to lose messages.
+ *
+ * Usage: logger_bench [-t max_threads] [-d seconds] [-s msg_bytes]
+ *                     [-l /dev/log/name]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define LOG_DEV			"/dev/log/radio"
+#define LOG_TAG			"logger_bench"
+#define LOG_PRIO_INFO		4
+#define MAX_MSG_SIZE		4000
+
+struct writer {
+	pthread_t thread;
+	const char *dev;
+	size_t msg_size;
+	volatile int *stop;
+	unsigned long writes;
+	int err;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer_main(void *arg)
+{
+	struct writer *w = arg;
+	unsigned char prio = LOG_PRIO_INFO;
+	char msg[MAX_MSG_SIZE];
+	struct iovec vec[3];
+	int fd;
+
+	fd = open(w->dev, O_WRONLY);
+	if (fd < 0) {
+		w->err = errno;
+		return NULL;
+	}
+
+	memset(msg, 'x', w->msg_size);
+	msg[w->msg_size - 1] = '\0';
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = LOG_TAG;
+	vec[1].iov_len = sizeof(LOG_TAG);
+	vec[2].iov_base = msg;
+	vec[2].iov_len = w->msg_size;
+
+	while (!*w->stop) {
+		if (writev(fd, vec, 3) < 0) {
+			w->err = errno;
+			break;
+		}
+		w->writes++;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static int run(const char *dev, int nr, double duration, size_t msg_size,
+	       double *rate)
+{
+	struct writer *writers;
+	volatile int stop = 0;
+	unsigned long total = 0;
+	double start;
+	int i, err = 0;
+
+	writers = calloc(nr, sizeof(*writers));
+	if (!writers)
+		return ENOMEM;
+
+	start = now_sec();
+	for (i = 0; i < nr; i++) {
+		writers[i].dev = dev;
+		writers[i].msg_size = msg_size;
+		writers[i].stop = &stop;
+		if (pthread_create(&writers[i].thread, NULL, writer_main,
+				   &writers[i])) {
+			stop = 1;
+			nr = i;
+			err = EAGAIN;
+			break;
+		}
+	}
+	if (!err)
+		usleep(duration * 1e6);
+	stop = 1;
+	for (i = 0; i < nr; i++) {
+		pthread_join(writers[i].thread, NULL);
+		total += writers[i].writes;
+		if (writers[i].err)
+			err = writers[i].err;
+	}
+	*rate = total / (now_sec() - start);
+	free(writers);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = LOG_DEV;
+	int max_threads = 16;
+	double duration = 2;
+	size_t msg_size = 64;
+	double rate;
+	int opt, nr, err;
+
+	while ((opt = getopt(argc, argv, "t:d:s:l:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 'l':
+			dev = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] "
+				"[-d seconds] [-s msg_bytes] "
+				"[-l /dev/log/name]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads < 1 || msg_size < 1 || msg_size > MAX_MSG_SIZE) {
+		fprintf(stderr, "logger_bench: bad arguments\n");
+		return 1;
+	}
+
+	if (access(dev, W_OK)) {
+		printf("logger_bench: %s not available, skipping\n", dev);
+		return 0;
+	}
+
+	printf("%8s %16s %16s\n", "threads", "writes/s", "per thread");
+	for (nr = 1; nr <= max_threads; nr *= 2) {
+		err = run(dev, nr, duration, msg_size, &rate);
+		if (err) {
+			printf("logger_bench: writers failed at %d threads: "
+			       "%s\n", nr, strerror(err));
+			return 1;
+		}
+		printf("%8d %16.0f %16.0f\n", nr, rate, rate / nr);
+	}
+
+	return 0;
+}
@@ -0,0 +1,343 @@
+/*
+ * ion_latency.c - ION allocate/free ioctl latency under load
+ *
+ * Has a number of threads allocate a batch of buffers from /dev/ion and
+ * then free them all again, over and over, the way a UI renders frames
+ * into freshly allocated buffers.  The latency of every ION_IOC_ALLOC
+ * and ION_IOC_FREE is recorded and the average, median, 99th percentile
+ * and worst case of each are printed.
+ *
+ * Freeing a buffer returns its memory to the heap in the context of the
+ * ioctl, unless the heap was set up with ION_HEAP_FLAG_DEFER_FREE, in
+ * which case a kernel thread does it and the free latency should drop
+ * to the cost of the handle bookkeeping.  The heap's debugfs file shows
+ * how much memory is waiting to be freed.
+ *
+ * Before that, a cacheable buffer is mapped MAP_PRIVATE, read only and
+ * read/write, and every page of it is touched.  The heap may refuse such
+ * a mapping with EINVAL, but touching it must not take the kernel down.
+ *
+ * Usage: ion_latency [-t threads] [-d seconds] [-s KB_per_buffer]
+ *                    [-b buffers_per_batch] [-m heap_id_mask]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+/* from include/linux/ion.h */
+struct ion_allocation_data {
+	size_t len;
+	size_t align;
+	unsigned int flags;
+	void *handle;
+};
+
+struct ion_fd_data {
+	void *handle;
+	int fd;
+	unsigned char cacheable;
+};
+
+struct ion_handle_data {
+	void *handle;
+};
+
+#define ION_IOC_MAGIC		'I'
+#define ION_IOC_ALLOC		_IOWR(ION_IOC_MAGIC, 0, \
+				      struct ion_allocation_data)
+#define ION_IOC_FREE		_IOWR(ION_IOC_MAGIC, 1, struct ion_handle_data)
+#define ION_IOC_MAP		_IOWR(ION_IOC_MAGIC, 2, struct ion_fd_data)
+
+#define ION_DEV			"/dev/ion"
+#define MAX_SAMPLES		(1 << 20)
+
+struct samples {
+	double *ns;
+	size_t nr;
+};
+
+struct worker {
+	pthread_t thread;
+	size_t len;
+	int batch;
+	unsigned int heap_mask;
+	volatile int *stop;
+	struct samples alloc;
+	struct samples free;
+	int err;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void record(struct samples *s, double ns)
+{
+	if (s->nr < MAX_SAMPLES)
+		s->ns[s->nr++] = ns;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct ion_allocation_data alloc;
+	struct ion_handle_data data;
+	void **handles;
+	double start;
+	int fd, i, n;
+
+	fd = open(ION_DEV, O_RDONLY);
+	handles = calloc(w->batch, sizeof(*handles));
+	if (fd < 0 || !handles) {
+		w->err = fd < 0 ? errno : ENOMEM;
+		goto out;
+	}
+
+	while (!*w->stop) {
+		for (n = 0; n < w->batch; n++) {
+			memset(&alloc, 0, sizeof(alloc));
+			alloc.len = w->len;
+			alloc.align = 4096;
+			alloc.flags = w->heap_mask;
+			start = now_ns();
+			if (ioctl(fd, ION_IOC_ALLOC, &alloc)) {
+				w->err = errno;
+				break;
+			}
+			record(&w->alloc, now_ns() - start);
+			handles[n] = alloc.handle;
+		}
+		for (i = 0; i < n; i++) {
+			data.handle = handles[i];
+			start = now_ns();
+			if (ioctl(fd, ION_IOC_FREE, &data))
+				w->err = errno;
+			record(&w->free, now_ns() - start);
+		}
+		if (w->err)
+			break;
+	}
+
+out:
+	free(handles);
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+/*
+ * Map a cacheable buffer privately and touch all of it.  Returns 0 if
+ * that worked or the mapping was refused with EINVAL, else an errno.
+ */
+static int check_private_map(unsigned int heap_mask, size_t len)
+{
+	static const int prots[] = { PROT_READ, PROT_READ | PROT_WRITE };
+	struct ion_allocation_data alloc;
+	struct ion_handle_data data;
+	struct ion_fd_data map;
+	volatile char *p;
+	size_t off;
+	int fd, i, err = 0;
+
+	fd = open(ION_DEV, O_RDONLY);
+	if (fd < 0)
+		return errno;
+	memset(&alloc, 0, sizeof(alloc));
+	alloc.len = len;
+	alloc.align = 4096;
+	alloc.flags = heap_mask;
+	if (ioctl(fd, ION_IOC_ALLOC, &alloc)) {
+		err = errno;
+		goto out;
+	}
+	memset(&map, 0, sizeof(map));
+	map.handle = alloc.handle;
+	map.cacheable = 1;
+	if (ioctl(fd, ION_IOC_MAP, &map) || map.fd < 0) {
+		err = map.fd < 0 ? -map.fd : errno;
+		goto out_free;
+	}
+
+	for (i = 0; i < 2; i++) {
+		p = mmap(NULL, len, prots[i], MAP_PRIVATE, map.fd, 0);
+		if (p == MAP_FAILED) {
+			if (errno != EINVAL)
+				err = errno;
+			printf("ion_latency: private %s mapping: %s\n",
+			       i ? "read/write" : "read only", strerror(errno));
+			continue;
+		}
+		for (off = 0; off < len; off += 4096) {
+			if (prots[i] & PROT_WRITE)
+				p[off] = 0x5a;
+			else
+				(void)p[off];
+		}
+		munmap((void *)p, len);
+		printf("ion_latency: private %s mapping: ok\n",
+		       i ? "read/write" : "read only");
+	}
+
+	close(map.fd);
+out_free:
+	data.handle = alloc.handle;
+	ioctl(fd, ION_IOC_FREE, &data);
+out:
+	close(fd);
+	return err;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Merge the samples of all workers into the first one's */
+static struct samples *merge(struct worker *workers, int nr, int free)
+{
+	struct samples *all = free ? &workers[0].free : &workers[0].alloc;
+	int i;
+
+	for (i = 1; i < nr; i++) {
+		struct samples *s = free ? &workers[i].free :
+					   &workers[i].alloc;
+		size_t n = s->nr;
+
+		if (n > MAX_SAMPLES - all->nr)
+			n = MAX_SAMPLES - all->nr;
+		memcpy(all->ns + all->nr, s->ns, n * sizeof(double));
+		all->nr += n;
+	}
+	return all;
+}
+
+static void report(const char *what, struct samples *s)
+{
+	double sum = 0;
+	size_t i;
+
+	if (!s->nr)
+		return;
+	qsort(s->ns, s->nr, sizeof(double), cmp_double);
+	for (i = 0; i < s->nr; i++)
+		sum += s->ns[i];
+	printf("%6s %10zu %10.1f %10.1f %10.1f %10.1f\n", what, s->nr,
+	       sum / s->nr / 1000, s->ns[s->nr / 2] / 1000,
+	       s->ns[s->nr * 99 / 100] / 1000, s->ns[s->nr - 1] / 1000);
+}
+
+int main(int argc, char **argv)
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int heap_mask = ~0u;
+	size_t kb = 1024;
+	int batch = 8, seconds = 5;
+	volatile int stop = 0;
+	struct worker *workers;
+	int opt, i, fd, err = 0;
+
+	while ((opt = getopt(argc, argv, "t:d:s:b:m:")) != -1) {
+		switch (opt) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 's':
+			kb = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'm':
+			heap_mask = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t threads] [-d seconds] "
+				"[-s KB_per_buffer] [-b buffers_per_batch] "
+				"[-m heap_id_mask]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (threads < 1 || seconds < 1 || kb < 1 || batch < 1) {
+		fprintf(stderr, "ion_latency: bad arguments\n");
+		return 1;
+	}
+
+	fd = open(ION_DEV, O_RDONLY);
+	if (fd < 0) {
+		printf("ion_latency: cannot open %s: %s, skipping\n", ION_DEV,
+		       strerror(errno));
+		return 0;
+	}
+	close(fd);
+
+	err = check_private_map(heap_mask, kb << 10);
+	if (err) {
+		printf("ion_latency: private mapping failed: %s\n",
+		       strerror(err));
+		return 1;
+	}
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		return 1;
+	for (i = 0; i < threads; i++) {
+		workers[i].len = kb << 10;
+		workers[i].batch = batch;
+		workers[i].heap_mask = heap_mask;
+		workers[i].stop = &stop;
+		/* the first worker's arrays collect everybody's samples */
+		workers[i].alloc.ns = malloc(MAX_SAMPLES * sizeof(double));
+		workers[i].free.ns = malloc(MAX_SAMPLES * sizeof(double));
+		if (!workers[i].alloc.ns || !workers[i].free.ns) {
+			fprintf(stderr, "ion_latency: out of memory\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_main,
+				   &workers[i])) {
+			threads = i;
+			break;
+		}
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].err)
+			err = workers[i].err;
+	}
+	if (err)
+		printf("ion_latency: ioctl failed: %s\n", strerror(err));
+
+	printf("%d threads, batches of %d x %zu KB\n", threads, batch, kb);
+	printf("%6s %10s %10s %10s %10s %10s\n", "ioctl", "count", "avg us",
+	       "p50 us", "p99 us", "max us");
+	report("alloc", merge(workers, threads, 0));
+	report("free", merge(workers, threads, 1));
+
+	for (i = 0; i < threads; i++) {
+		free(workers[i].alloc.ns);
+		free(workers[i].free.ns);
+	}
+	free(workers);
+	return err ? 1 : 0;
+}
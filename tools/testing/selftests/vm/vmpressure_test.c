@@ -0,0 +1,290 @@
+/*
+ * vmpressure_test - measure how quickly memory pressure levels are reported
+ *
+ * Creates a memory cgroup with a small limit and the OOM killer disabled,
+ * registers an eventfd for each of the "low", "medium" and "critical"
+ * levels of its memory.pressure_level file and then runs a child in the
+ * cgroup that first streams a file through the page cache (cheap reclaim)
+ * and then allocates anonymous memory until it can get no more (reclaim
+ * that fails).  For every level it prints the time from the start of the
+ * pressure until the first notification and the cgroup usage at that
+ * moment.
+ *
+ * Must be run as root with the memory cgroup controller mounted.
+ *
+ * Usage: vmpressure_test [-m limit_mb] [-t timeout_sec]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mntent.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define CGROUP_NAME	"vmpressure_test"
+#define NR_LEVELS	3
+
+static const char *levels[NR_LEVELS] = { "low", "medium", "critical" };
+
+static char cgroup_dir[PATH_MAX];
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int find_memcg_mount(char *buf, size_t len)
+{
+	struct mntent *ent;
+	FILE *f;
+	int ret = -1;
+
+	f = setmntent("/proc/mounts", "r");
+	if (!f)
+		return -1;
+	while ((ent = getmntent(f))) {
+		if (strcmp(ent->mnt_type, "cgroup"))
+			continue;
+		if (!hasmntopt(ent, "memory"))
+			continue;
+		snprintf(buf, len, "%s", ent->mnt_dir);
+		ret = 0;
+		break;
+	}
+	endmntent(f);
+	return ret;
+}
+
+/* Path of @file in the test cgroup, or -1 if it does not fit in PATH_MAX. */
+static int cg_path(char *path, const char *file)
+{
+	int n;
+
+	n = snprintf(path, PATH_MAX, "%s/%s", cgroup_dir, file);
+	if (n < 0 || n >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static int cg_write(const char *file, const char *val)
+{
+	char path[PATH_MAX];
+	int fd, ret;
+
+	if (cg_path(path, file))
+		return -1;
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, val, strlen(val)) == (ssize_t)strlen(val) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+static long long cg_read(const char *file)
+{
+	char path[PATH_MAX], buf[64];
+	ssize_t n;
+	int fd;
+
+	if (cg_path(path, file))
+		return -1;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	return atoll(buf);
+}
+
+static int register_level(const char *level)
+{
+	char path[PATH_MAX], buf[64];
+	int efd, pfd;
+
+	if (cg_path(path, "memory.pressure_level"))
+		return -1;
+	pfd = open(path, O_RDONLY);
+	if (pfd < 0)
+		return -1;
+	efd = eventfd(0, 0);
+	if (efd < 0) {
+		close(pfd);
+		return -1;
+	}
+	snprintf(buf, sizeof(buf), "%d %d %s", efd, pfd, level);
+	if (cg_write("cgroup.event_control", buf)) {
+		close(efd);
+		close(pfd);
+		return -1;
+	}
+	close(pfd);
+	return efd;
+}
+
+/* Runs inside the cgroup: page cache churn first, then anonymous memory. */
+static void pressure_child(size_t limit)
+{
+	char tmpl[] = "/tmp/vmpressure_testXXXXXX";
+	static char buf[1 << 16];
+	size_t done, chunk = 1 << 20;
+	int fd;
+
+	fd = mkstemp(tmpl);
+	if (fd >= 0) {
+		unlink(tmpl);
+		memset(buf, 0x5a, sizeof(buf));
+		for (done = 0; done < 2 * limit; done += sizeof(buf))
+			if (write(fd, buf, sizeof(buf)) < 0)
+				break;
+		close(fd);
+	}
+
+	for (;;) {
+		char *p = mmap(NULL, chunk, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (p == MAP_FAILED)
+			pause();
+		memset(p, 0xa5, chunk);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd pfds[NR_LEVELS];
+	double seen[NR_LEVELS];
+	long long usage[NR_LEVELS];
+	char mnt[PATH_MAX], buf[64];
+	size_t limit = 64 << 20;
+	double timeout = 30, start;
+	int opt, i, n, left, ret = 0;
+	pid_t child;
+
+	while ((opt = getopt(argc, argv, "m:t:")) != -1) {
+		switch (opt) {
+		case 'm':
+			limit = (size_t)atoi(optarg) << 20;
+			break;
+		case 't':
+			timeout = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m limit_mb] "
+				"[-t timeout_sec]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (find_memcg_mount(mnt, sizeof(mnt))) {
+		printf("vmpressure_test: memory cgroup not mounted, skipping\n");
+		return 0;
+	}
+	n = snprintf(cgroup_dir, sizeof(cgroup_dir), "%s/%s", mnt, CGROUP_NAME);
+	if (n < 0 || n >= (int)sizeof(cgroup_dir)) {
+		printf("vmpressure_test: cgroup path too long, skipping\n");
+		return 0;
+	}
+	if (mkdir(cgroup_dir, 0755) && errno != EEXIST) {
+		printf("vmpressure_test: cannot create %s: %s, skipping\n",
+		       cgroup_dir, strerror(errno));
+		return 0;
+	}
+
+	snprintf(buf, sizeof(buf), "%zu", limit);
+	if (cg_write("memory.limit_in_bytes", buf) ||
+	    cg_write("memory.oom_control", "1")) {
+		printf("vmpressure_test: cannot configure %s\n", cgroup_dir);
+		ret = 1;
+		goto out_rmdir;
+	}
+
+	for (i = 0; i < NR_LEVELS; i++) {
+		pfds[i].fd = register_level(levels[i]);
+		pfds[i].events = POLLIN;
+		seen[i] = -1;
+		if (pfds[i].fd < 0) {
+			printf("vmpressure_test: cannot register \"%s\" "
+			       "(no memory.pressure_level?)\n", levels[i]);
+			ret = 1;
+			goto out_rmdir;
+		}
+	}
+
+	start = now_sec();
+	child = fork();
+	if (child < 0) {
+		ret = 1;
+		goto out_rmdir;
+	}
+	if (!child) {
+		snprintf(buf, sizeof(buf), "%d", getpid());
+		if (cg_write("tasks", buf))
+			_exit(1);
+		pressure_child(limit);
+		_exit(0);
+	}
+
+	left = NR_LEVELS;
+	while (left && now_sec() - start < timeout) {
+		if (poll(pfds, NR_LEVELS, 100) <= 0)
+			continue;
+		for (i = 0; i < NR_LEVELS; i++) {
+			uint64_t cnt;
+
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			if (read(pfds[i].fd, &cnt, sizeof(cnt)) < 0)
+				continue;
+			if (seen[i] < 0) {
+				seen[i] = now_sec() - start;
+				usage[i] = cg_read("memory.usage_in_bytes");
+				left--;
+			}
+		}
+	}
+
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+
+	printf("%10s %14s %14s\n", "level", "notify ms", "usage KB");
+	for (i = 0; i < NR_LEVELS; i++) {
+		if (seen[i] < 0) {
+			printf("%10s %14s %14s\n", levels[i], "-", "-");
+			ret = 1;
+			continue;
+		}
+		printf("%10s %14.1f %14lld\n", levels[i], seen[i] * 1e3,
+		       usage[i] >> 10);
+	}
+	if (ret)
+		printf("vmpressure_test: not every level was signalled "
+		       "within %.0fs\n", timeout);
+
+	for (i = 0; i < NR_LEVELS; i++)
+		close(pfds[i].fd);
+out_rmdir:
+	rmdir(cgroup_dir);
+	return ret;
+}
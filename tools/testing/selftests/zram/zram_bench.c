@@ -0,0 +1,391 @@
+/*
+ * zram_bench.c - zram write/read throughput benchmark
+ *
+ * Sweeps the number of threads and has each of them write (and then
+ * read back) its own region of a zram device with O_DIRECT page sized
+ * I/O, the way swap-out hits the device.  The data is made to compress
+ * roughly 2:1 so the compressor does real work.  With per-CPU
+ * compression streams the aggregate rate should scale with the number
+ * of CPUs up to the point where the threads outnumber them.
+ *
+ * To compare compressors on real data, -f takes a corpus file (e.g. a
+ * dump of swapped out pages) whose pages are written instead of the
+ * synthetic ones, and -c resets the device and switches it to another
+ * crypto API compressor first.  -D does the same to turn same page
+ * deduplication on; corpus pages repeat once the written area is larger
+ * than the corpus.  The resulting compression ratio and dedup savings
+ * are printed after the sweep.
+ *
+ * -b attaches a backing device (CONFIG_ZRAM_WRITEBACK, a loop device
+ * will do) and writes every page back to it between the write and the
+ * read pass, so the read rate is that of pages faulted back in from it.
+ *
+ * -C overwrites every other page with zeroes after the sweep, which zram
+ * stores without an object, so half the objects are freed the way swap
+ * churn leaves zspages half empty.  It then compacts the pool, printing the
+ * memory used before and after and what compaction moved and freed.
+ *
+ * The device is opened O_EXCL, so a zram device that is in use as swap
+ * or mounted is refused.  Its contents are destroyed.
+ *
+ * Usage: zram_bench [-t max_threads] [-s MB_per_thread] [-d /dev/zramN]
+ *                   [-c compressor] [-f corpus] [-D] [-b backing_dev]
+ *                   [-C]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#define ZRAM_DEV	"/dev/zram0"
+#define PAGE_SZ		4096
+
+static char sysfs_dir[PATH_MAX];
+static unsigned char *corpus;
+static size_t corpus_pages;
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	int write;
+	off_t start;
+	size_t pages;
+	int err;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sysfs_write(const char *attr, const char *val)
+{
+	char path[PATH_MAX + 32];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfs_dir, attr);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, val, strlen(val)) == (ssize_t)strlen(val) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+static unsigned long long sysfs_read(const char *attr)
+{
+	char path[PATH_MAX + 32], buf[64];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfs_dir, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	return strtoull(buf, NULL, 10);
+}
+
+/* Reset the device and bring it back with the same size */
+static int reconfigure(const char *comp, int dedup, const char *backing)
+{
+	unsigned long long size = sysfs_read("disksize");
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%llu", size);
+	if (sysfs_write("reset", "1") ||
+	    (comp && sysfs_write("comp_algorithm", comp)) ||
+	    sysfs_write("use_dedup", dedup ? "1" : "0") ||
+	    (backing && sysfs_write("backing_dev", backing)) ||
+	    sysfs_write("disksize", buf))
+		return -1;
+	return 0;
+}
+
+static int load_corpus(const char *file)
+{
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		return -1;
+	corpus_pages = st.st_size / PAGE_SZ;
+	corpus = malloc(corpus_pages * PAGE_SZ);
+	if (!corpus_pages || !corpus) {
+		close(fd);
+		return -1;
+	}
+	n = read(fd, corpus, corpus_pages * PAGE_SZ);
+	close(fd);
+	return n == (ssize_t)(corpus_pages * PAGE_SZ) ? 0 : -1;
+}
+
+/*
+ * Corpus page, or half random, half repeated bytes which compresses to
+ * a bit over 50%
+ */
+static void fill_page(unsigned char *p, unsigned int seed)
+{
+	int i;
+
+	if (corpus) {
+		memcpy(p, corpus + (size_t)(seed % corpus_pages) * PAGE_SZ,
+		       PAGE_SZ);
+		return;
+	}
+	for (i = 0; i < PAGE_SZ / 2; i++)
+		p[i] = rand_r(&seed);
+	memset(p + PAGE_SZ / 2, seed & 0xff, PAGE_SZ / 2);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	unsigned char *buf;
+	size_t i;
+
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ)) {
+		w->err = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < w->pages; i++) {
+		off_t off = w->start + (off_t)i * PAGE_SZ;
+		ssize_t ret;
+
+		if (w->write) {
+			fill_page(buf, off / PAGE_SZ);
+			ret = pwrite(w->fd, buf, PAGE_SZ, off);
+		} else {
+			ret = pread(w->fd, buf, PAGE_SZ, off);
+		}
+		if (ret != PAGE_SZ) {
+			w->err = ret < 0 ? errno : EIO;
+			break;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int run(int fd, int nr, size_t pages, int write, double *mbps)
+{
+	struct worker *workers;
+	double start;
+	int i, err = 0;
+
+	workers = calloc(nr, sizeof(*workers));
+	if (!workers)
+		return ENOMEM;
+
+	start = now_sec();
+	for (i = 0; i < nr; i++) {
+		workers[i].fd = fd;
+		workers[i].write = write;
+		workers[i].start = (off_t)i * pages * PAGE_SZ;
+		workers[i].pages = pages;
+		if (pthread_create(&workers[i].thread, NULL, worker_main,
+				   &workers[i])) {
+			nr = i;
+			err = EAGAIN;
+			break;
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].err)
+			err = workers[i].err;
+	}
+	*mbps = (double)nr * pages * PAGE_SZ / (1 << 20) /
+		(now_sec() - start);
+	free(workers);
+	return err;
+}
+
+/* Zero every other page of the first @pages, then compact */
+static int fragment_and_compact(int fd, size_t pages)
+{
+	unsigned long long before;
+	unsigned char *zero;
+	ssize_t ret;
+	size_t i;
+
+	if (posix_memalign((void **)&zero, PAGE_SZ, PAGE_SZ))
+		return ENOMEM;
+	memset(zero, 0, PAGE_SZ);
+	for (i = 1; i < pages; i += 2) {
+		ret = pwrite(fd, zero, PAGE_SZ, (off_t)i * PAGE_SZ);
+		if (ret != PAGE_SZ) {
+			free(zero);
+			return ret < 0 ? errno : EIO;
+		}
+	}
+	free(zero);
+
+	before = sysfs_read("mem_used_total");
+	if (sysfs_write("compact", "1"))
+		return errno;
+
+	printf("compaction: mem_used_total %llu KB -> %llu KB, "
+	       "%llu pages freed, %llu objects moved\n", before >> 10,
+	       sysfs_read("mem_used_total") >> 10,
+	       sysfs_read("pages_compacted"), sysfs_read("num_migrated"));
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = ZRAM_DEV, *comp = NULL, *file = NULL;
+	const char *backing = NULL;
+	char name[PATH_MAX];
+	unsigned long long orig, compr;
+	int dedup = 0, compact = 0;
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t mb = 16, pages, written;
+	unsigned long long size;
+	double wr, rd;
+	int opt, nr, fd, err;
+
+	while ((opt = getopt(argc, argv, "t:s:d:c:f:Db:C")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			mb = atoi(optarg);
+			break;
+		case 'd':
+			dev = optarg;
+			break;
+		case 'c':
+			comp = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'D':
+			dedup = 1;
+			break;
+		case 'b':
+			backing = optarg;
+			break;
+		case 'C':
+			compact = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] "
+				"[-s MB_per_thread] [-d /dev/zramN] "
+				"[-c compressor] [-f corpus] [-D] "
+				"[-b backing_dev] [-C]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads < 1 || mb < 1) {
+		fprintf(stderr, "zram_bench: bad arguments\n");
+		return 1;
+	}
+
+	if (file && load_corpus(file)) {
+		fprintf(stderr, "zram_bench: cannot load corpus %s\n", file);
+		return 1;
+	}
+
+	snprintf(name, sizeof(name), "%s", dev);
+	snprintf(sysfs_dir, sizeof(sysfs_dir), "/sys/block/%s",
+		 basename(name));
+	if ((comp || dedup || backing) &&
+	    reconfigure(comp, dedup, backing)) {
+		printf("zram_bench: cannot reconfigure %s, skipping\n", dev);
+		return 0;
+	}
+
+	fd = open(dev, O_RDWR | O_DIRECT | O_EXCL);
+	if (fd < 0) {
+		printf("zram_bench: cannot open %s: %s, skipping\n", dev,
+		       strerror(errno));
+		return 0;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) || !size) {
+		printf("zram_bench: %s has no disksize, skipping\n", dev);
+		close(fd);
+		return 0;
+	}
+
+	pages = mb << 20 >> 12;
+	if ((unsigned long long)max_threads * pages * PAGE_SZ > size) {
+		max_threads = size / ((unsigned long long)pages * PAGE_SZ);
+		if (!max_threads) {
+			printf("zram_bench: %s too small, skipping\n", dev);
+			close(fd);
+			return 0;
+		}
+	}
+
+	printf("%8s %14s %14s\n", "threads", "write MB/s", "read MB/s");
+	for (nr = 1; nr <= max_threads; nr *= 2) {
+		err = run(fd, nr, pages, 1, &wr);
+		if (!err && backing &&
+		    (sysfs_write("idle", "all") ||
+		     sysfs_write("writeback", "idle")))
+			err = errno;
+		if (!err)
+			err = run(fd, nr, pages, 0, &rd);
+		if (err) {
+			printf("zram_bench: I/O failed at %d threads: %s\n",
+			       nr, strerror(err));
+			close(fd);
+			return 1;
+		}
+		printf("%8d %14.1f %14.1f\n", nr, wr, rd);
+	}
+	/* the last, widest run left this many pages written */
+	written = (size_t)(nr / 2) * pages;
+
+	orig = sysfs_read("orig_data_size");
+	compr = sysfs_read("compr_data_size");
+	if (orig && compr)
+		printf("compressor %s: %llu KB stored in %llu KB, "
+		       "ratio %.2f\n", comp ? comp : "default", orig >> 10,
+		       compr >> 10, (double)orig / compr);
+	if (dedup)
+		printf("dedup: %llu hits, %llu KB of compressed data shared\n",
+		       sysfs_read("dedup_hits"),
+		       sysfs_read("dup_data_size") >> 10);
+	if (backing)
+		printf("backing device: %llu pages held\n",
+		       sysfs_read("bd_stat"));
+
+	if (compact) {
+		err = fragment_and_compact(fd, written);
+		if (err) {
+			printf("zram_bench: compaction failed: %s\n",
+			       strerror(err));
+			close(fd);
+			return 1;
+		}
+	}
+
+	close(fd);
+	return 0;
+}